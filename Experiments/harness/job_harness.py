@@ -0,0 +1,264 @@
+#!/usr/bin/env python3
+"""
+Join Order Benchmark harness for AQO.
+
+Loads the JOB schema and data into a local database and replays the JOB
+queries several times per AQO mode. Each execution is recorded into CSV files:
+
+  runs.csv  - one line per execution: planning time, execution time,
+              client-side latency and the q-error of the whole plan;
+  nodes.csv - one line per plan node of each execution: estimated and actual
+              rows and their q-error, and the AQO prediction of the node:
+              feature subspace, predicted and standard estimate, model;
+  summary.csv - medians per (variant, mode, query), and AQO overhead: the
+              difference of median planning and execution time with the
+              'disabled' mode of the same variant.
+
+All settings are in the configuration file (see job.conf.example):
+
+  ./job_harness.py -c job.conf load   # create the schema and load the data
+  ./job_harness.py -c job.conf run    # replay the queries
+  ./job_harness.py -c job.conf run 1a.sql 2b.sql
+
+Several model variants are compared by running the harness with different
+[variant] sections (the name and the AQO settings) into the same output
+directory: the CSV files are appended to.
+"""
+
+import argparse
+import configparser
+import csv
+import os
+import statistics
+import sys
+import time
+
+import psycopg2
+
+RUNS_FIELDS = ['variant', 'mode', 'query', 'iteration', 'planning_ms',
+               'execution_ms', 'latency_ms', 'plan_rows', 'actual_rows',
+               'q_error']
+NODES_FIELDS = ['variant', 'mode', 'query', 'iteration', 'node_id',
+                'node_type', 'relation', 'plan_rows', 'actual_rows', 'loops',
+                'q_error', 'aqo_fss', 'aqo_rows', 'native_rows', 'aqo_model',
+                'aqo_time_ms']
+SUMMARY_FIELDS = ['variant', 'mode', 'query', 'executions',
+                  'median_planning_ms', 'median_execution_ms',
+                  'median_q_error', 'max_node_q_error',
+                  'planning_overhead_ms', 'execution_overhead_ms']
+
+
+def q_error(estimated, actual):
+    """Symmetric ratio of estimated and actual cardinalities, >= 1."""
+    estimated = max(estimated, 1.0)
+    actual = max(actual, 1.0)
+    return max(estimated, actual) / min(estimated, actual)
+
+
+def walk_plan(plan, nodes):
+    """Collects all executed nodes of the plan tree in depth-first order."""
+    loops = plan.get('Actual Loops', 0)
+    if loops > 0:
+        nodes.append({
+            'node_id': len(nodes),
+            'node_type': plan['Node Type'],
+            'relation': plan.get('Relation Name', ''),
+            'plan_rows': plan['Plan Rows'],
+            'actual_rows': plan['Actual Rows'],
+            'loops': loops,
+            # Both numbers are per loop.
+            'q_error': q_error(plan['Plan Rows'], plan['Actual Rows']),
+            # Shown by EXPLAIN if aqo.show_details is on.
+            'aqo_fss': plan.get('AQO fss hash', ''),
+            'aqo_rows': plan.get('AQO Rows', ''),
+            'native_rows': plan.get('AQO Native Rows', ''),
+            'aqo_model': plan.get('AQO Model', ''),
+            'aqo_time_ms': plan.get('AQO Prediction Time', ''),
+        })
+    for child in plan.get('Plans', []):
+        walk_plan(child, nodes)
+    return nodes
+
+
+def open_csv(path, fields):
+    exists = os.path.exists(path) and os.path.getsize(path) > 0
+    f = open(path, 'a', newline='')
+    writer = csv.DictWriter(f, fieldnames=fields)
+    if not exists:
+        writer.writeheader()
+    return f, writer
+
+
+def connect(config):
+    con = psycopg2.connect(config.get('database', 'dsn'))
+    con.autocommit = True
+    return con
+
+
+def load(config):
+    """Creates JOB schema and loads the CSV files of the IMDB dataset."""
+    job = config['job']
+    data_dir = job.get('data_dir')
+    con = connect(config)
+    cur = con.cursor()
+
+    for name in job.get('schema_files', '').split():
+        print('Execute', name)
+        with open(name) as f:
+            cur.execute(f.read())
+
+    if data_dir:
+        cur.execute("SELECT tablename FROM pg_tables "
+                    "WHERE schemaname = 'public' AND tablename NOT LIKE 'aqo%'")
+        for (table,) in cur.fetchall():
+            path = os.path.join(data_dir, table + '.csv')
+            if not os.path.exists(path):
+                continue
+            print('Load', path)
+            with open(path) as f:
+                cur.copy_expert(
+                    "COPY %s FROM STDIN WITH (FORMAT csv, ESCAPE '\\')" % table,
+                    f)
+
+    for name in job.get('index_files', '').split():
+        print('Execute', name)
+        with open(name) as f:
+            cur.execute(f.read())
+
+    cur.execute('VACUUM ANALYZE')
+    cur.close()
+    con.close()
+
+
+def reset_aqo(cur):
+    """Drops all knowledge of AQO."""
+    cur.execute('DROP EXTENSION IF EXISTS aqo')
+    cur.execute('CREATE EXTENSION aqo')
+
+
+def explain(cur, query):
+    cur.execute('EXPLAIN (ANALYZE, TIMING OFF, FORMAT JSON) ' + query)
+    return cur.fetchone()[0][0]
+
+
+def run(config, only_queries):
+    job = config['job']
+    run_cfg = config['run']
+    variant = config.get('variant', 'name', fallback='default')
+    settings = dict(config['settings']) if 'settings' in config else {}
+    queries_dir = job.get('queries_dir')
+    modes = run_cfg.get('modes', 'disabled learn').split()
+    iterations = run_cfg.getint('iterations', 5)
+    warmup = run_cfg.getint('warmup', 1)
+    reset = run_cfg.getboolean('reset_aqo', True)
+    out_dir = config.get('output', 'dir', fallback='.')
+
+    queries = only_queries or sorted(
+        f for f in os.listdir(queries_dir)
+        if f.endswith('.sql') and os.path.isfile(os.path.join(queries_dir, f)))
+
+    os.makedirs(out_dir, exist_ok=True)
+    runs_file, runs = open_csv(os.path.join(out_dir, 'runs.csv'), RUNS_FIELDS)
+    nodes_file, nodes = open_csv(os.path.join(out_dir, 'nodes.csv'),
+                                 NODES_FIELDS)
+    results = {}
+
+    con = connect(config)
+    cur = con.cursor()
+    for mode in modes:
+        if reset:
+            reset_aqo(cur)
+        cur.execute('SET aqo.mode = %s', (mode,))
+        cur.execute('SET aqo.show_details = on')
+        for name, value in settings.items():
+            cur.execute('SELECT set_config(%s, %s, false)', (name, value))
+
+        for query_name in queries:
+            with open(os.path.join(queries_dir, query_name)) as f:
+                query = f.read()
+            print('%s %s %s' % (variant, mode, query_name), file=sys.stderr)
+
+            for i in range(-warmup, iterations):
+                start = time.perf_counter()
+                result = explain(cur, query)
+                latency = (time.perf_counter() - start) * 1000.
+                if i < 0:
+                    continue
+
+                plan = result['Plan']
+                plan_nodes = walk_plan(plan, [])
+                record = {
+                    'variant': variant, 'mode': mode, 'query': query_name,
+                    'iteration': i,
+                    'planning_ms': result['Planning Time'],
+                    'execution_ms': result['Execution Time'],
+                    'latency_ms': round(latency, 3),
+                    'plan_rows': plan['Plan Rows'],
+                    'actual_rows': plan['Actual Rows'],
+                    'q_error': q_error(plan['Plan Rows'], plan['Actual Rows']),
+                }
+                runs.writerow(record)
+                for node in plan_nodes:
+                    node.update({'variant': variant, 'mode': mode,
+                                 'query': query_name, 'iteration': i})
+                    nodes.writerow(node)
+                results.setdefault((mode, query_name), []).append(
+                    (record, max([n['q_error'] for n in plan_nodes] or [1.])))
+    cur.close()
+    con.close()
+    runs_file.close()
+    nodes_file.close()
+
+    write_summary(os.path.join(out_dir, 'summary.csv'), variant, results)
+
+
+def write_summary(path, variant, results):
+    summary_file, summary = open_csv(path, SUMMARY_FIELDS)
+    medians = {}
+    for (mode, query), records in results.items():
+        medians[(mode, query)] = (
+            statistics.median(r['planning_ms'] for r, _ in records),
+            statistics.median(r['execution_ms'] for r, _ in records))
+
+    for (mode, query), records in sorted(results.items()):
+        planning, execution = medians[(mode, query)]
+        base = medians.get(('disabled', query))
+        summary.writerow({
+            'variant': variant, 'mode': mode, 'query': query,
+            'executions': len(records),
+            'median_planning_ms': planning,
+            'median_execution_ms': execution,
+            'median_q_error': statistics.median(r['q_error']
+                                                for r, _ in records),
+            'max_node_q_error': max(q for _, q in records),
+            'planning_overhead_ms':
+                round(planning - base[0], 3) if base else '',
+            'execution_overhead_ms':
+                round(execution - base[1], 3) if base else '',
+        })
+    summary_file.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument('-c', '--config', required=True,
+                        help='configuration file')
+    parser.add_argument('command', choices=['load', 'run'])
+    parser.add_argument('queries', nargs='*',
+                        help='query files to run instead of all of them')
+    args = parser.parse_args()
+
+    config = configparser.ConfigParser()
+    # GUC names are case-insensitive but keep them as written.
+    config.optionxform = str
+    if not config.read(args.config):
+        sys.exit('cannot read configuration file %s' % args.config)
+
+    if args.command == 'load':
+        load(config)
+    else:
+        run(config, args.queries)
+
+
+if __name__ == '__main__':
+    main()
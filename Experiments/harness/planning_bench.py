@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+"""
+Planning overhead benchmark of the AQO cardinality hooks.
+
+Creates small tables t1..tN and plans (EXPLAIN without ANALYZE) families of
+star, chain and clique join queries of growing size in three modes:
+
+  off     - aqo.mode = disabled;
+  learn   - aqo.mode = learn, the queries were executed once before, so the
+            hooks predict with learned models;
+  frozen  - aqo.mode = frozen, the same queries: the hooks predict with the
+            learned models, but nothing is learned.
+
+For each query the median planning time and per-hook call counts and time
+(from aqo_hook_stats(), aqo.track_hooks = on) per planning are written to CSV.
+
+  ./planning_bench.py --dsn 'dbname=postgres' --shapes star,chain,clique \
+      --sizes 2,4,8,12,15 --repeats 20 > planning.csv
+
+The server must have aqo in shared_preload_libraries.
+"""
+
+import argparse
+import csv
+import statistics
+import sys
+
+import psycopg2
+
+MODES = ['off', 'learn', 'frozen']
+FIELDS = ['shape', 'size', 'mode', 'repeats', 'median_planning_ms', 'hook',
+          'calls_per_plan', 'ms_per_plan']
+
+
+def create_tables(cur, ntables, nrows):
+    for i in range(1, ntables + 1):
+        cur.execute('DROP TABLE IF EXISTS t%d' % i)
+        cur.execute('CREATE TABLE t%d (id int PRIMARY KEY, fk int, val int)'
+                    % i)
+        cur.execute('INSERT INTO t%d SELECT g, 1 + (g * 7919) %% %d, g %% 100 '
+                    'FROM generate_series(1, %d) g' % (i, nrows, nrows))
+    cur.execute('ANALYZE')
+
+
+def make_query(shape, size):
+    """Returns the join query of the given shape over tables t1..t<size>."""
+    tables = ['t%d' % i for i in range(1, size + 1)]
+    if shape == 'star':
+        joins = ['t1.fk = %s.id' % t for t in tables[1:]]
+    elif shape == 'chain':
+        joins = ['%s.fk = %s.id' % (a, b) for a, b in zip(tables, tables[1:])]
+    elif shape == 'clique':
+        joins = ['%s.id = %s.id' % (a, b)
+                 for i, a in enumerate(tables) for b in tables[i + 1:]]
+    else:
+        raise ValueError('unknown shape %s' % shape)
+    filters = ['%s.val < %d' % (t, 50 + i) for i, t in enumerate(tables)]
+    return 'SELECT count(*) FROM %s WHERE %s' % (
+        ', '.join(tables), ' AND '.join(joins + filters))
+
+
+def plan_time(cur, query):
+    cur.execute('EXPLAIN (SUMMARY ON, FORMAT JSON) ' + query)
+    return cur.fetchone()[0][0]['Planning Time']
+
+
+def hook_stats(cur):
+    cur.execute('SELECT hook, calls, total_time FROM aqo_hook_stats()')
+    return {hook: (calls, time) for hook, calls, time in cur.fetchall()}
+
+
+def set_mode(cur, mode):
+    if mode == 'off':
+        cur.execute("SET aqo.mode = 'disabled'")
+    elif mode == 'learn':
+        cur.execute("SET aqo.mode = 'learn'")
+    else:
+        cur.execute("SET aqo.mode = 'frozen'")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[1])
+    parser.add_argument('--dsn', default='dbname=postgres')
+    parser.add_argument('--shapes', default='star,chain,clique')
+    parser.add_argument('--sizes', default='2,4,8,12,15')
+    parser.add_argument('--repeats', type=int, default=20)
+    parser.add_argument('--rows', type=int, default=1000,
+                        help='number of rows in each table')
+    args = parser.parse_args()
+
+    shapes = args.shapes.split(',')
+    sizes = [int(s) for s in args.sizes.split(',')]
+
+    con = psycopg2.connect(args.dsn)
+    con.autocommit = True
+    cur = con.cursor()
+    cur.execute('DROP EXTENSION IF EXISTS aqo')
+    cur.execute('CREATE EXTENSION aqo')
+    create_tables(cur, max(sizes), args.rows)
+
+    # Plan the whole join search space exhaustively.
+    cur.execute('SET geqo = off')
+    cur.execute('SET join_collapse_limit = %d' % max(sizes))
+    cur.execute('SET from_collapse_limit = %d' % max(sizes))
+    cur.execute('SET aqo.track_hooks = on')
+
+    writer = csv.DictWriter(sys.stdout, fieldnames=FIELDS)
+    writer.writeheader()
+
+    for mode in MODES:
+        if mode == 'learn':
+            # Learn all queries once, so the hooks have models to predict.
+            cur.execute("SET aqo.mode = 'learn'")
+            for shape in shapes:
+                for size in sizes:
+                    cur.execute('EXPLAIN ANALYZE ' + make_query(shape, size))
+        set_mode(cur, mode)
+
+        for shape in shapes:
+            for size in sizes:
+                query = make_query(shape, size)
+                print('%s %d %s' % (shape, size, mode), file=sys.stderr)
+                cur.execute('SELECT aqo_hook_stats_reset()')
+                times = [plan_time(cur, query) for _ in range(args.repeats)]
+                stats = hook_stats(cur)
+                for hook, (calls, total) in sorted(stats.items()):
+                    writer.writerow({
+                        'shape': shape, 'size': size, 'mode': mode,
+                        'repeats': args.repeats,
+                        'median_planning_ms': statistics.median(times),
+                        'hook': hook,
+                        'calls_per_plan': calls / args.repeats,
+                        'ms_per_plan': round(total / args.repeats, 6),
+                    })
+                sys.stdout.flush()
+
+    cur.close()
+    con.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,111 @@
+--
+-- Models of a feature subspace: ridge regression weights, the neural network
+-- (stored only in the global model of a feature space) and running errors of
+-- each model used to select the one to predict with.
+--
+ALTER TABLE public.aqo_data ADD COLUMN weights double precision[];
+ALTER TABLE public.aqo_data ADD COLUMN nn double precision[];
+ALTER TABLE public.aqo_data ADD COLUMN errors double precision[];
+
+-- k-d tree over the objects stored for k-NN regression.
+ALTER TABLE public.aqo_data ADD COLUMN knn_tree double precision[];
+
+-- Linear weights were stored in the features column by the previous version.
+UPDATE public.aqo_data SET features = NULL, targets = NULL
+	WHERE array_ndims(features) = 1;
+
+--
+-- Backend-local statistics of the planner hooks, collected if aqo.track_hooks
+-- is on. predict_for_relation is called from the other hooks, so its time is
+-- included into theirs.
+--
+CREATE FUNCTION public.aqo_hook_stats(
+	OUT hook		text,
+	OUT calls		bigint,
+	OUT total_time	double precision
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'aqo_hook_stats'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION public.aqo_hook_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'aqo_hook_stats_reset'
+LANGUAGE C STRICT VOLATILE;
+
+--
+-- Cluster-wide statistics of AQO, collected in shared memory if the extension
+-- is loaded via shared_preload_libraries. Times are in microseconds.
+--
+CREATE FUNCTION public.aqo_stat(
+	OUT predictions_attempted	bigint,
+	OUT predictions_served		bigint,
+	OUT predictions_refused		bigint,
+	OUT fss_loads_hit			bigint,
+	OUT fss_loads_miss			bigint,
+	OUT predict_time			bigint,
+	OUT get_fss_time			bigint,
+	OUT learn_time				bigint,
+	OUT samples_learned			bigint,
+	OUT samples_discarded		bigint,
+	OUT bytes_written			bigint,
+	OUT stats_reset				timestamp with time zone
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'aqo_stat'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION public.aqo_stat_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'aqo_stat_reset'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE EXECUTE ON FUNCTION public.aqo_stat_reset() FROM PUBLIC;
+
+CREATE VIEW public.pg_stat_aqo AS
+	SELECT s.*,
+		   (SELECT sum(pg_total_relation_size(c.oid))::bigint
+			  FROM pg_class c
+			 WHERE c.relnamespace = 'public'::regnamespace
+			   AND c.relkind = 'r'
+			   AND c.relname IN ('aqo_queries', 'aqo_query_texts',
+								 'aqo_query_stat', 'aqo_data')
+		   ) AS bytes_stored
+	  FROM public.aqo_stat() s;
+
+--
+-- Histograms of q-errors of cardinality estimates per feature subspace: the
+-- bucket i (counting from 0) holds errors in [2^i, 2^(i+1)). short_error and
+-- long_error are the short-term and long-term geometric means of q-error;
+-- the subspace is drifting if the former grew above the latter by
+-- aqo.drift_threshold in logarithmic scale.
+--
+CREATE FUNCTION public.aqo_fss_stats(
+	OUT fspace_hash		int,
+	OUT fss_hash		int,
+	OUT nsamples		bigint,
+	OUT error_histogram	bigint[],
+	OUT short_error		double precision,
+	OUT long_error		double precision,
+	OUT drifting		boolean,
+	OUT last_update		timestamp with time zone
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'aqo_fss_stats'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION public.aqo_fss_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'aqo_fss_stats_reset'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE EXECUTE ON FUNCTION public.aqo_fss_stats_reset() FROM PUBLIC;
+
+--
+-- Settings of queries are cached by backends, so the manual insertion of a
+-- query must invalidate the caches too.
+--
+DROP TRIGGER aqo_queries_invalidate ON public.aqo_queries;
+CREATE TRIGGER aqo_queries_invalidate AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE
+	ON public.aqo_queries FOR EACH STATEMENT
+	EXECUTE PROCEDURE invalidate_deactivated_queries_cache();
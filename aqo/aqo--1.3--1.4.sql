@@ -0,0 +1,162 @@
+--
+-- Hashes of query types and feature subspaces are 64-bit now. The old ones
+-- can't be converted, so the knowledge base is dropped; the settings of the
+-- common feature space are kept.
+--
+DELETE FROM public.aqo_data;
+DELETE FROM public.aqo_queries WHERE query_hash <> 0;
+
+ALTER TABLE public.aqo_queries
+	ALTER COLUMN query_hash TYPE bigint,
+	ALTER COLUMN fspace_hash TYPE bigint;
+ALTER TABLE public.aqo_query_texts ALTER COLUMN query_hash TYPE bigint;
+ALTER TABLE public.aqo_query_stat ALTER COLUMN query_hash TYPE bigint;
+ALTER TABLE public.aqo_data
+	ALTER COLUMN fspace_hash TYPE bigint,
+	ALTER COLUMN fsspace_hash TYPE bigint;
+
+--
+-- Service functions take and return 64-bit hashes.
+--
+DROP FUNCTION public.aqo_status(int);
+DROP FUNCTION public.aqo_enable_query(int);
+DROP FUNCTION public.aqo_disable_query(int);
+DROP FUNCTION public.aqo_clear_hist(int);
+DROP FUNCTION public.aqo_ne_queries();
+DROP FUNCTION public.aqo_drop(int);
+
+-- Show query state at the AQO knowledge base
+CREATE FUNCTION public.aqo_status(hash bigint)
+RETURNS TABLE (
+	"learn"			BOOL,
+	"use aqo"		BOOL,
+	"auto tune"		BOOL,
+	"fspace hash"	BIGINT,
+	"t_naqo"		TEXT,
+	"err_naqo"		TEXT,
+	"iters"			BIGINT,
+	"t_aqo"			TEXT,
+	"err_aqo"		TEXT,
+	"iters_aqo"		BIGINT
+)
+AS $func$
+SELECT	learn_aqo,use_aqo,auto_tuning,fspace_hash,
+		to_char(execution_time_without_aqo[n4],'9.99EEEE'),
+		to_char(cardinality_error_without_aqo[n2],'9.99EEEE'),
+		executions_without_aqo,
+		to_char(execution_time_with_aqo[n3],'9.99EEEE'),
+		to_char(cardinality_error_with_aqo[n1],'9.99EEEE'),
+		executions_with_aqo
+FROM public.aqo_queries aq, public.aqo_query_stat aqs,
+	(SELECT array_length(n1,1) AS n1, array_length(n2,1) AS n2,
+		array_length(n3,1) AS n3, array_length(n4,1) AS n4
+	FROM
+		(SELECT cardinality_error_with_aqo		AS n1,
+				cardinality_error_without_aqo	AS n2,
+				execution_time_with_aqo			AS n3,
+				execution_time_without_aqo		AS n4
+		FROM public.aqo_query_stat aqs WHERE
+			aqs.query_hash = $1) AS al) AS q
+WHERE (aqs.query_hash = aq.query_hash) AND
+	aqs.query_hash = $1;
+$func$ LANGUAGE SQL;
+
+CREATE FUNCTION public.aqo_enable_query(hash bigint)
+RETURNS VOID
+AS $func$
+UPDATE public.aqo_queries SET
+	learn_aqo = 'true',
+	use_aqo = 'true'
+	WHERE query_hash = $1;
+$func$ LANGUAGE SQL;
+
+CREATE FUNCTION public.aqo_disable_query(hash bigint)
+RETURNS VOID
+AS $func$
+UPDATE public.aqo_queries SET
+	learn_aqo = 'false',
+	use_aqo = 'false',
+	auto_tuning = 'false'
+	WHERE query_hash = $1;
+$func$ LANGUAGE SQL;
+
+CREATE FUNCTION public.aqo_clear_hist(hash bigint)
+RETURNS VOID
+AS $func$
+DELETE FROM public.aqo_data WHERE fspace_hash=$1;
+$func$ LANGUAGE SQL;
+
+-- Show queries that contains 'Never executed' nodes at the plan.
+CREATE FUNCTION public.aqo_ne_queries()
+RETURNS SETOF bigint
+AS $func$
+SELECT query_hash FROM public.aqo_query_stat aqs
+	WHERE -1 = ANY (cardinality_error_with_aqo::double precision[]);
+$func$ LANGUAGE SQL;
+
+CREATE FUNCTION public.aqo_drop(hash bigint)
+RETURNS VOID
+AS $func$
+DELETE FROM public.aqo_queries aq WHERE (aq.query_hash = $1);
+DELETE FROM public.aqo_data ad WHERE (ad.fspace_hash = $1);
+DELETE FROM public.aqo_query_stat aq WHERE (aq.query_hash = $1);
+DELETE FROM public.aqo_query_texts aq WHERE (aq.query_hash = $1);
+$func$ LANGUAGE SQL;
+
+DROP FUNCTION public.aqo_fss_stats();
+CREATE FUNCTION public.aqo_fss_stats(
+	OUT fspace_hash		bigint,
+	OUT fss_hash		bigint,
+	OUT nsamples		bigint,
+	OUT error_histogram	bigint[],
+	OUT short_error		double precision,
+	OUT long_error		double precision,
+	OUT drifting		boolean,
+	OUT last_update		timestamp with time zone
+)
+RETURNS SETOF record
+AS 'MODULE_PATHNAME', 'aqo_fss_stats'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION public.aqo_export(path text)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'aqo_export'
+LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION public.aqo_import(path text)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'aqo_import'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE EXECUTE ON FUNCTION public.aqo_export(text) FROM PUBLIC;
+REVOKE EXECUTE ON FUNCTION public.aqo_import(text) FROM PUBLIC;
+
+CREATE FUNCTION public.aqo_spool_ingest()
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'aqo_spool_ingest'
+LANGUAGE C VOLATILE;
+
+REVOKE EXECUTE ON FUNCTION public.aqo_spool_ingest() FROM PUBLIC;
+
+CREATE FUNCTION public.aqo_shared_models_reset()
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'aqo_shared_models_reset'
+LANGUAGE C STRICT VOLATILE;
+
+REVOKE EXECUTE ON FUNCTION public.aqo_shared_models_reset() FROM PUBLIC;
+
+--
+-- Models deleted or changed by the user, e. g. by aqo_drop() or
+-- aqo_clear_hist(), must be removed from the shared knowledge base too.
+--
+CREATE FUNCTION public.aqo_data_invalidate_shared_models()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'aqo_data_invalidate_shared_models'
+LANGUAGE C;
+
+CREATE TRIGGER aqo_data_invalidate AFTER UPDATE OR DELETE
+	ON public.aqo_data FOR EACH ROW
+	EXECUTE PROCEDURE aqo_data_invalidate_shared_models();
+CREATE TRIGGER aqo_data_invalidate_all AFTER TRUNCATE
+	ON public.aqo_data FOR EACH STATEMENT
+	EXECUTE PROCEDURE aqo_data_invalidate_shared_models();
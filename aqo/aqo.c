@@ -30,6 +30,15 @@ static const struct config_enum_entry format_options[] = {
 	{NULL, 0, false}
 };
 
+static const struct config_enum_entry query_hash_options[] = {
+	{"text", AQO_QUERY_HASH_TEXT, false},
+	{"jumble", AQO_QUERY_HASH_JUMBLE, false},
+	{NULL, 0, false}
+};
+
+/* Method of computing query_hash */
+int			aqo_query_hash_method = AQO_QUERY_HASH_TEXT;
+
 /* Parameters of autotuning */
 int			aqo_stat_size = 20;
 int			auto_tuning_window_size = 5;
@@ -46,19 +55,50 @@ int			auto_tuning_infinite_loop = 8;
  */
 const double	object_selection_prediction_threshold = 0.3;
 
+double		log_selectivity_lower_bound = -30;
+
 /*
- * This parameter tell us that the new learning sample object has very small
- * distance from one whose features stored in matrix already.
- * In this case we will not to add new line in matrix, but will modify this
- * nearest neighbor features and cardinality with linear smoothing by
- * learning_rate coefficient.
+ * Use the model learned over hashed features of all feature subspaces when
+ * the feature subspace of the object has no model yet.
  */
-const double	object_selection_threshold = 0.1;
-const double	learning_rate = 1e-1;
+bool		aqo_use_global_model = false;
 
-/* The number of nearest neighbors which will be chosen for ML-operations */
-int			aqo_k = 3;
-double		log_selectivity_lower_bound = -30;
+/*
+ * The cheapest model is used for prediction if its running error (in terms of
+ * logarithm of cardinality) exceeds the best one not more than by this value.
+ */
+double		aqo_model_selection_tolerance = AQO_DEFAULT_MODEL_SELECTION_TOLERANCE;
+
+/*
+ * Predictions with lower confidence are blended with the estimate of the
+ * standard PostgreSQL estimator, and with zero confidence they are replaced
+ * by it.
+ */
+double		aqo_min_confidence = 0.1;
+
+/* Collect backend-local statistics of the planner hooks */
+bool		aqo_track_hooks = false;
+
+/* Max number of objects stored for k-NN regression in a feature subspace */
+int			aqo_knn_capacity = aqo_K;
+
+/*
+ * Show details of the prediction for each plan node in EXPLAIN and compute
+ * the standard estimate even for confident predictions to show it.
+ */
+bool		aqo_show_details = false;
+
+/* Learn underestimated nodes of failed queries from the rows produced so far */
+bool		aqo_learn_on_error = true;
+
+/*
+ * Invalidate cached plans if the cardinality of a learned node diverged from
+ * the prediction by more than this factor, 0 disables it.
+ */
+double		aqo_replan_threshold = 0.;
+
+static bool check_replan_threshold(double *newval, void **extra,
+								   GucSource source);
 
 /*
  * Currently we use it only to store query_text string which is initialized
@@ -75,13 +115,16 @@ char				*query_text = NULL;
 post_parse_analyze_hook_type				prev_post_parse_analyze_hook;
 planner_hook_type							prev_planner_hook;
 ExecutorStart_hook_type						prev_ExecutorStart_hook;
+ExecutorRun_hook_type						prev_ExecutorRun_hook;
 ExecutorEnd_hook_type						prev_ExecutorEnd_hook;
+ProcessUtility_hook_type					prev_ProcessUtility_hook;
 set_baserel_rows_estimate_hook_type			prev_set_baserel_rows_estimate_hook;
 get_parameterized_baserel_size_hook_type	prev_get_parameterized_baserel_size_hook;
 set_joinrel_size_estimates_hook_type		prev_set_joinrel_size_estimates_hook;
 get_parameterized_joinrel_size_hook_type	prev_get_parameterized_joinrel_size_hook;
 copy_generic_path_info_hook_type			prev_copy_generic_path_info_hook;
 ExplainOnePlan_hook_type					prev_ExplainOnePlan_hook;
+ExplainOneNode_hook_type					prev_ExplainOneNode_hook;
 
 /*****************************************************************************
  *
@@ -104,6 +147,31 @@ _PG_init(void)
 							 NULL,
 							 NULL);
 
+	DefineCustomEnumVariable("aqo.query_hash_method",
+							 "Method of computing hashes of query types.",
+							 "The jumble method walks the query tree itself: queryId computed by other extensions, e. g. pg_stat_statements, isn't used, so the hashes don't depend on them. Hashes computed by different methods differ, so the queries known to AQO become new ones after a change.",
+							 &aqo_query_hash_method,
+							 AQO_QUERY_HASH_TEXT,
+							 query_hash_options,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomBoolVariable(
+							 "aqo.portable_hashes",
+							 "Hash relations and user-defined types, operators and functions by their schema-qualified names rather than OIDs",
+							 "The knowledge base can be moved to another cluster of the same major version then. OIDs of collations are still used. Hashes computed with other value of the setting differ.",
+							 &aqo_portable_hashes,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+		);
+
 	DefineCustomBoolVariable(
 							 "aqo.force_collect_stat",
 							 "Collect statistics at all AQO modes",
@@ -117,14 +185,203 @@ _PG_init(void)
 							 NULL
 		);
 
+	DefineCustomBoolVariable(
+							 "aqo.use_global_model",
+							 "Predict with the model shared by all feature subspaces if the subspace is unknown",
+							 NULL,
+							 &aqo_use_global_model,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+		);
+
+	DefineCustomRealVariable(
+							 "aqo.model_selection_tolerance",
+							 "Allowed excess of the running error of the cheapest model over the best one",
+							 NULL,
+							 &aqo_model_selection_tolerance,
+							 AQO_DEFAULT_MODEL_SELECTION_TOLERANCE,
+							 0.0,
+							 DBL_MAX,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+		);
+
+	DefineCustomRealVariable(
+							 "aqo.min_confidence",
+							 "Confidence of prediction below which it is blended with the standard estimate",
+							 NULL,
+							 &aqo_min_confidence,
+							 0.1,
+							 0.0,
+							 1.0,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+		);
+
+	DefineCustomBoolVariable(
+							 "aqo.track_hooks",
+							 "Collect statistics of calls of the planner hooks",
+							 NULL,
+							 &aqo_track_hooks,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+		);
+
+	DefineCustomIntVariable(
+							 "aqo.knn_capacity",
+							 "Max number of objects stored for k-NN regression in a feature subspace",
+							 "Each object takes about 8 bytes per feature in aqo_data and in the backend. Each load of the model copies all its objects: from the backend cache of models, or detoasting the whole row of aqo_data when the model isn't cached. The time of learning grows with the number of objects too.",
+							 &aqo_knn_capacity,
+							 aqo_K,
+							 1,
+							 AQO_KNN_MAX_CAPACITY,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+		);
+
+	DefineCustomIntVariable(
+							 "aqo.fss_stats_max",
+							 "Max number of feature subspaces with q-error histograms in shared memory",
+							 "When the limit is reached, the histogram updated least recently is replaced by the new one.",
+							 &aqo_fss_stats_max,
+							 5000,
+							 0,
+							 INT_MAX / 2,
+							 PGC_POSTMASTER,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+		);
+
+	DefineCustomIntVariable(
+							 "aqo.shared_models",
+							 "Max number of models in the knowledge base shared by all databases",
+							 "The shared knowledge base is used only with aqo.portable_hashes. Zero disables it. Not supported on Windows.",
+							 &aqo_shared_models_max,
+							 0,
+							 0,
+							 INT_MAX / 2,
+							 PGC_POSTMASTER,
+							 0,
+							 check_shared_models_max,
+							 NULL,
+							 NULL
+		);
+
+	DefineCustomRealVariable(
+							 "aqo.drift_threshold",
+							 "Excess of short-term over long-term log q-error that marks a feature subspace as drifting",
+							 NULL,
+							 &aqo_drift_threshold,
+							 0.7,
+							 0.0,
+							 DBL_MAX,
+							 PGC_SUSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+		);
+
+	DefineCustomIntVariable(
+							 "aqo.fss_stats_save_interval",
+							 "Interval between saves of q-error histograms to disk, 0 saves them only at shutdown",
+							 "Only the save at shutdown is synced to disk.",
+							 &aqo_fss_stats_save_interval,
+							 300,
+							 0,
+							 INT_MAX / 1000,
+							 PGC_SIGHUP,
+							 GUC_UNIT_S,
+							 NULL,
+							 NULL,
+							 NULL
+		);
+
+	DefineCustomBoolVariable(
+							 "aqo.learn_on_error",
+							 "Learn from the rows produced by the nodes of failed and cancelled queries",
+							 NULL,
+							 &aqo_learn_on_error,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+		);
+
+	DefineCustomRealVariable(
+							 "aqo.replan_threshold",
+							 "Q-error of a learned plan node which makes cached plans be built again",
+							 "Only a diverged generic plan of a prepared statement triggers the invalidation, at most once per 10 seconds. The plan cache has no link to the executed query, so all cached plans of the backend are invalidated and built again at their next executions. Zero disables invalidation of cached plans.",
+							 &aqo_replan_threshold,
+							 0.0,
+							 0.0,
+							 DBL_MAX,
+							 PGC_USERSET,
+							 0,
+							 check_replan_threshold,
+							 NULL,
+							 NULL
+		);
+
+	DefineCustomStringVariable(
+							 "aqo.spool_directory",
+							 "Directory of the files of objects learned on hot standbys",
+							 "On a hot standby the objects are written there instead of being learned, on the primary aqo_spool_ingest() learns them. Empty disables it.",
+							 &aqo_spool_directory,
+							 "",
+							 PGC_SIGHUP,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+		);
+
+	DefineCustomBoolVariable(
+							 "aqo.show_details",
+							 "Show AQO state of the query and predictions for plan nodes in EXPLAIN",
+							 "The predictions are stored in the plan, the standard estimate and the time of prediction are collected only if the setting is on during planning.",
+							 &aqo_show_details,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL
+		);
+
 	prev_planner_hook							= planner_hook;
 	planner_hook								= aqo_planner;
 	prev_post_parse_analyze_hook				= post_parse_analyze_hook;
 	post_parse_analyze_hook						= get_query_text;
 	prev_ExecutorStart_hook						= ExecutorStart_hook;
 	ExecutorStart_hook							= aqo_ExecutorStart;
+	prev_ExecutorRun_hook						= ExecutorRun_hook;
+	ExecutorRun_hook							= aqo_ExecutorRun;
 	prev_ExecutorEnd_hook						= ExecutorEnd_hook;
 	ExecutorEnd_hook							= aqo_ExecutorEnd;
+	prev_ProcessUtility_hook					= ProcessUtility_hook;
+	ProcessUtility_hook							= aqo_ProcessUtility;
 	prev_set_baserel_rows_estimate_hook			= set_baserel_rows_estimate_hook;
 	set_baserel_rows_estimate_hook				= aqo_set_baserel_rows_estimate;
 	prev_get_parameterized_baserel_size_hook	= get_parameterized_baserel_size_hook;
@@ -137,24 +394,44 @@ _PG_init(void)
 	copy_generic_path_info_hook					= aqo_copy_generic_path_info;
 	prev_ExplainOnePlan_hook					= ExplainOnePlan_hook;
 	ExplainOnePlan_hook							= print_into_explain;
+	prev_ExplainOneNode_hook					= ExplainOneNode_hook;
+	ExplainOneNode_hook							= print_node_explain;
 	parampathinfo_postinit_hook					= ppi_hook;
 
-	init_deactivated_queries_storage();
+	aqo_stat_init();
+	shared_models_init();
+	spool_init();
+	init_query_settings_cache();
+	init_extension_cache();
+	init_relid_hashes();
 	AQOMemoryContext = AllocSetContextCreate(TopMemoryContext,
 											 "AQOMemoryContext",
 											 ALLOCSET_DEFAULT_SIZES);
+	init_fss_models_cache();
+}
+
+/*
+ * Q-error is not less than 1, so the lower values are meaningless.
+ */
+static bool
+check_replan_threshold(double *newval, void **extra, GucSource source)
+{
+	if (*newval == 0. || *newval >= 1.)
+		return true;
+
+	GUC_check_errdetail("aqo.replan_threshold must be 0 or not less than 1.");
+	return false;
 }
 
 PG_FUNCTION_INFO_V1(invalidate_deactivated_queries_cache);
 
 /*
- * Clears the cache of deactivated queries if the user changed aqo_queries
- * manually.
+ * Invalidates the caches of query settings if the user changed aqo_queries
+ * manually. The trigger function keeps its historical name.
  */
 Datum
 invalidate_deactivated_queries_cache(PG_FUNCTION_ARGS)
 {
-	fini_deactivated_queries_storage();
-	init_deactivated_queries_storage();
+	invalidate_query_settings_cache();
 	PG_RETURN_POINTER(NULL);
 }
@@ -114,6 +114,8 @@
 #ifndef __ML_CARD_H__
 #define __ML_CARD_H__
 
+#include <float.h>
+#include <limits.h>
 #include <math.h>
 
 #include "postgres.h"
@@ -140,6 +142,7 @@
 #include "optimizer/cost.h"
 #include "parser/analyze.h"
 #include "parser/parsetree.h"
+#include "tcop/utility.h"
 #include "utils/array.h"
 #include "utils/builtins.h"
 #include "utils/guc.h"
@@ -149,6 +152,8 @@
 #include "utils/fmgroids.h"
 #include "utils/snapmgr.h"
 
+#include "aqo_probes.h"
+#include "machine_learning.h"
 
 /* Check PostgreSQL version (9.6.0 contains important changes in planner) */
 #if PG_VERSION_NUM < 90600
@@ -175,6 +180,17 @@ typedef enum
 extern int	aqo_mode;
 extern bool	force_collect_stat;
 
+/* Method of computing query_hash */
+typedef enum
+{
+	/* Hash of the constant-stripped text representation of the query tree */
+	AQO_QUERY_HASH_TEXT,
+	/* The query tree jumbled by AQO, queryId of other extensions isn't used */
+	AQO_QUERY_HASH_JUMBLE,
+}	AQO_QUERY_HASH_METHOD;
+
+extern int	aqo_query_hash_method;
+
 /*
  * It is mostly needed for auto tuning of query. with auto tuning mode aqo
  * checks stability of last executions of the query, bad influence of strong
@@ -204,22 +220,36 @@ typedef struct
 /* Parameters for current query */
 typedef struct QueryContextData
 {
-	int			query_hash;
+	int64		query_hash;
 	bool		learn_aqo;
 	bool		use_aqo;
-	int			fspace_hash;
+	int64		fspace_hash;
 	bool		auto_tuning;
 	bool		collect_stat;
 	bool		adding_query;
 	bool		explain_only;
+	bool		custom_plan;	/* planned with the values of parameters */
 
 	/* Query execution time */
 	instr_time	query_starttime;
 	double		query_planning_time;
 } QueryContextData;
 
+/*
+ * Details of a prediction, carried through the path into the plan node to be
+ * shown by EXPLAIN.
+ */
+typedef struct AqoPredictionDetails
+{
+	AQO_MODEL	kind;
+	double		confidence;
+	double		native_rows;	/* -1 if not known */
+	double		latency;		/* in milliseconds, -1 if not measured */
+} AqoPredictionDetails;
+
 extern double predicted_ppi_rows;
-extern double fss_ppi_hash;
+extern int64 fss_ppi_hash;
+extern AqoPredictionDetails ppi_details;
 
 /* Parameters of autotuning */
 extern int	aqo_stat_size;
@@ -233,10 +263,16 @@ extern double auto_tuning_convergence_error;
 
 
 extern const double object_selection_prediction_threshold;
-extern const double object_selection_threshold;
-extern const double learning_rate;
-extern int	aqo_k;
 extern double log_selectivity_lower_bound;
+extern bool aqo_use_global_model;
+extern double aqo_min_confidence;
+extern bool aqo_track_hooks;
+extern bool aqo_show_details;
+extern bool aqo_learn_on_error;
+extern double aqo_replan_threshold;
+
+/* Hash of the pseudo feature subspace which stores the global model */
+#define AQO_GLOBAL_FSS_HASH		(0)
 
 /* Parameters for current query */
 extern QueryContextData query_context;
@@ -250,7 +286,9 @@ extern MemoryContext AQOMemoryContext;
 extern post_parse_analyze_hook_type prev_post_parse_analyze_hook;
 extern planner_hook_type prev_planner_hook;
 extern ExecutorStart_hook_type prev_ExecutorStart_hook;
+extern ExecutorRun_hook_type prev_ExecutorRun_hook;
 extern ExecutorEnd_hook_type prev_ExecutorEnd_hook;
+extern ProcessUtility_hook_type prev_ProcessUtility_hook;
 extern		set_baserel_rows_estimate_hook_type
 			prev_set_baserel_rows_estimate_hook;
 extern		get_parameterized_baserel_size_hook_type
@@ -262,40 +300,62 @@ extern		get_parameterized_joinrel_size_hook_type
 extern		copy_generic_path_info_hook_type
 			prev_copy_generic_path_info_hook;
 extern ExplainOnePlan_hook_type prev_ExplainOnePlan_hook;
+extern ExplainOneNode_hook_type prev_ExplainOneNode_hook;
 
 extern void ppi_hook(ParamPathInfo *ppi);
 
 /* Hash functions */
-int			get_query_hash(Query *parse, const char *query_text);
-extern int get_fss_for_object(List *clauselist, List *selectivities,
-						List *relidslist, int *nfeatures, double **features);
+extern bool aqo_portable_hashes;
+void		init_relid_hashes(void);
+int64		get_query_hash(Query *parse, const char *query_text);
+extern int64 get_fss_for_object(List *clauselist, List *selectivities,
+						List *relidslist, int *nfeatures, double **features,
+						double *hashed_features);
 void		get_eclasses(List *clauselist, int *nargs,
-						 int **args_hash, int **eclass_hash);
-int			get_clause_hash(Expr *clause, int nargs,
-							int *args_hash, int *eclass_hash);
+						 int64 **args_hash, int64 **eclass_hash);
+int64		get_clause_hash(Expr *clause, int nargs,
+							int64 *args_hash, int64 *eclass_hash);
 
 
+/* Settings of a query from aqo_queries */
+typedef struct QuerySettings
+{
+	int64		query_hash;		/* hash key */
+	bool		stored;			/* the query is in aqo_queries */
+	bool		learn_aqo;
+	bool		use_aqo;
+	int64		fspace_hash;
+	bool		auto_tuning;
+} QuerySettings;
+
 /* Storage interaction */
-bool find_query(int query_hash,
+bool find_query(int64 query_hash,
 		   Datum *search_values,
 		   bool *search_nulls);
-bool add_query(int query_hash, bool learn_aqo, bool use_aqo,
-		  int fspace_hash, bool auto_tuning);
-bool update_query(int query_hash, bool learn_aqo, bool use_aqo,
-			 int fspace_hash, bool auto_tuning);
-bool		add_query_text(int query_hash, const char *query_text);
-bool load_fss(int fss_hash, int ncols,
-		 double *weights, int *rows);
-extern bool update_fss(int fss_hash, int nrows, int ncols,
-					   double *weights);
-QueryStat  *get_aqo_stat(int query_hash);
-void		update_aqo_stat(int query_hash, QueryStat * stat);
-void		init_deactivated_queries_storage(void);
-void		fini_deactivated_queries_storage(void);
-bool		query_is_deactivated(int query_hash);
-void		add_deactivated_query(int query_hash);
+bool		get_query_settings(int64 query_hash, bool recheck_missing,
+							   QuerySettings *settings);
+bool add_query(int64 query_hash, bool learn_aqo, bool use_aqo,
+		  int64 fspace_hash, bool auto_tuning);
+bool update_query(int64 query_hash, bool learn_aqo, bool use_aqo,
+			 int64 fspace_hash, bool auto_tuning);
+bool		add_query_text(int64 query_hash, const char *query_text);
+bool load_fss(int64 fss_hash, int ncols, AqoFssModel *model);
+extern bool update_fss(int64 fss_hash, AqoFssModel *model);
+extern bool aqo_data_row_is_valid(Datum *values, bool *isnull);
+QueryStat  *get_aqo_stat(int64 query_hash);
+void		update_aqo_stat(int64 query_hash, QueryStat * stat);
+void		init_query_settings_cache(void);
+void		invalidate_query_settings_cache(void);
+void		init_fss_models_cache(void);
+void		invalidate_fss_models_cache(void);
+void		aqo_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+							   ProcessUtilityContext context,
+							   ParamListInfo params,
+							   QueryEnvironment *queryEnv,
+							   DestReceiver *dest, char *completionTag);
 
 /* Query preprocessing hooks */
+void		init_extension_cache(void);
 void		get_query_text(ParseState *pstate, Query *query);
 PlannedStmt *call_default_planner(Query *parse,
 					 int cursorOptions,
@@ -307,6 +367,7 @@ void print_into_explain(PlannedStmt *plannedstmt, IntoClause *into,
 			   ExplainState *es, const char *queryString,
 			   ParamListInfo params, const instr_time *planduration,
 			   QueryEnvironment *queryEnv);
+void		print_node_explain(ExplainState *es, PlanState *ps, Plan *plan);
 void		disable_aqo_for_query(void);
 
 /* Cardinality estimation hooks */
@@ -335,27 +396,101 @@ List *get_selectivities(PlannerInfo *root,
 List	   *get_list_of_relids(PlannerInfo *root, Relids relids);
 List	   *get_path_clauses(Path *path, PlannerInfo *root, List **selectivities);
 
-/* Cardinality estimation */
+/* Statistics of the planner hooks */
+typedef enum
+{
+	AQO_HOOK_BASEREL_ROWS,
+	AQO_HOOK_PARAM_BASEREL_SIZE,
+	AQO_HOOK_JOINREL_SIZE,
+	AQO_HOOK_PARAM_JOINREL_SIZE,
+	AQO_HOOK_PREDICT,
+	AQO_NHOOKS
+} AqoHookId;
+
+extern void hook_stats_start(instr_time *start);
+extern void hook_stats_stop(AqoHookId hook, instr_time *start);
+
+/* Shared statistics, the order is the order of columns of aqo_stat() */
+typedef enum
+{
+	AQO_STAT_PREDICTIONS_ATTEMPTED,
+	AQO_STAT_PREDICTIONS_SERVED,
+	AQO_STAT_PREDICTIONS_REFUSED,
+	AQO_STAT_FSS_LOADS_HIT,
+	AQO_STAT_FSS_LOADS_MISS,
+	AQO_STAT_PREDICT_TIME,
+	AQO_STAT_GET_FSS_TIME,
+	AQO_STAT_LEARN_TIME,
+	AQO_STAT_SAMPLES_LEARNED,
+	AQO_STAT_SAMPLES_DISCARDED,
+	AQO_STAT_BYTES_WRITTEN,
+	AQO_NSTATS
+} AqoStatCounter;
+
+extern void aqo_stat_init(void);
+extern void aqo_stat_add(AqoStatCounter counter, uint64 value);
+extern void aqo_stat_start(instr_time *start);
+extern void aqo_stat_add_time(AqoStatCounter counter, instr_time *start);
+extern bool aqo_queries_generation(uint64 *generation);
+extern void aqo_queries_changed(void);
+extern bool aqo_data_generation(uint64 *generation);
+extern uint64 aqo_data_changed(void);
+
+/* Number of buckets of q-error histograms of feature subspaces */
+#define AQO_FSS_STAT_NBUCKETS	(16)
+
+extern int	aqo_fss_stats_max;
+extern double aqo_drift_threshold;
+extern int	aqo_fss_stats_save_interval;
+
+extern void aqo_fss_stat_update(int64 fspace_hash, int64 fss_hash,
+								double predicted, double actual);
+
+/* Shared knowledge base */
+extern int	aqo_shared_models_max;
+
+extern void shared_models_init(void);
+extern bool check_shared_models_max(int *newval, void **extra,
+									GucSource source);
+extern bool shared_model_load(int64 fspace_hash, int64 fss_hash, int ncols,
+							  AqoFssModel *model);
+extern void shared_model_store(int64 fspace_hash, int64 fss_hash,
+							   AqoFssModel *model);
+extern void shared_models_invalidate_all(void);
+
+/* Cardinality estimation, the predictions are clamped to AQO_MAX_ROWS */
+#define AQO_MAX_ROWS	(1e100)
+
 double predict_for_relation(List *restrict_clauses, List *selectivities,
-					 List *relids, int *fss_hash);
+					 List *relids, int64 *fss_hash,
+					 AqoPredictionDetails *details);
 
 /* Query execution statistics collecting hooks */
 void		aqo_ExecutorStart(QueryDesc *queryDesc, int eflags);
 void		aqo_copy_generic_path_info(PlannerInfo *root, Plan *dest, Path *src);
+void		aqo_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+							uint64 count, bool execute_once);
 void		aqo_ExecutorEnd(QueryDesc *queryDesc);
+void		learn_object(int64 fss_hash, int nfeatures, double *features,
+						 double *hashed_features, double target);
+void		learn_global_objects(void);
+void		learn_pending_samples(void);
 
-/* Machine learning techniques */
-extern double rg_predict(int ncols,double *weights,double *features);
+/* Spool of learning samples of hot standbys */
+extern char *aqo_spool_directory;
 
-extern int rg_learn(int matrix_cols,
-			double double *weights,
-			double *features, double target);
+extern void spool_init(void);
+extern bool aqo_spool_enabled(void);
+extern void spool_sample(int64 fss_hash, int nfeatures, double *features,
+						 double *hashed_features, double target);
+extern void flush_spooled_samples(void);
 
 /* Automatic query tuning */
-void		automatical_query_tuning(int query_hash, QueryStat * stat);
+void		automatical_query_tuning(int64 query_hash, QueryStat * stat);
 
 /* Utilities */
 int			int_cmp(const void *a, const void *b);
+int			int64_cmp(const void *a, const void *b);
 int			double_cmp(const void *a, const void *b);
 int *argsort(void *a, int n, size_t es,
 		int (*cmp) (const void *, const void *));
@@ -364,11 +499,14 @@ QueryStat  *palloc_query_stat(void);
 void		pfree_query_stat(QueryStat *stat);
 
 /* Selectivity cache for parametrized baserels */
-void cache_selectivity(int clause_hash,
+void cache_selectivity(int64 clause_hash,
 				  int relid,
 				  int global_relid,
 				  double selectivity);
-double	   *selectivity_cache_find_global_relid(int clause_hash, int global_relid);
+double	   *selectivity_cache_find_global_relid(int64 clause_hash,
+												 int global_relid);
+List	   *selectivity_cache_copy(void);
+void		selectivity_cache_set(List *entries);
 void		selectivity_cache_clear(void);
 
 #endif
@@ -0,0 +1,85 @@
+/*
+ *******************************************************************************
+ *
+ *	STATIC TRACE POINTS
+ *
+ * Probes declared in aqo_probes.d. With PostgreSQL configured with
+ * --enable-dtrace they are emitted by <sys/sdt.h> as USDT probes of provider
+ * "aqo", which are visible to perf, bpftrace, SystemTap and DTrace without
+ * rebuilding. Otherwise they are no-ops.
+ *
+ * Arguments:
+ *	planner-start		query text
+ *	planner-done		query hash, use_aqo, learn_aqo
+ *	predict-done		fss hash, model (-1 if none), predicted rows (-1 if none)
+ *	load-fss-*			fspace hash, fss hash[, found]
+ *	update-fss-*		fspace hash, fss hash[, stored]
+ *	learn-sample-done	fspace hash, fss hash, true rows, predicted rows
+ *	auto-tuning-start	query hash
+ *	auto-tuning-done	query hash, use_aqo, learn_aqo
+ *
+ *******************************************************************************
+ *
+ * Copyright (c) 2016-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  aqo/aqo_probes.h
+ *
+ */
+#ifndef AQO_PROBES_H
+#define AQO_PROBES_H
+
+/*
+ * Numbers of rows are passed as long. Conversion of a double out of the range
+ * of long is undefined, so they are clamped.
+ */
+#define AQO_PROBE_ROWS(rows) \
+	((rows) >= (double) LONG_MAX ? LONG_MAX : (long) (rows))
+
+#ifdef ENABLE_DTRACE
+
+#include <sys/sdt.h>
+
+#define TRACE_AQO_PLANNER_START(INT1) \
+	DTRACE_PROBE1(aqo, planner__start, INT1)
+#define TRACE_AQO_PLANNER_DONE(INT1, INT2, INT3) \
+	DTRACE_PROBE3(aqo, planner__done, INT1, INT2, INT3)
+#define TRACE_AQO_PREDICT_START() \
+	DTRACE_PROBE(aqo, predict__start)
+#define TRACE_AQO_PREDICT_DONE(INT1, INT2, INT3) \
+	DTRACE_PROBE3(aqo, predict__done, INT1, INT2, INT3)
+#define TRACE_AQO_LOAD_FSS_START(INT1, INT2) \
+	DTRACE_PROBE2(aqo, load__fss__start, INT1, INT2)
+#define TRACE_AQO_LOAD_FSS_DONE(INT1, INT2, INT3) \
+	DTRACE_PROBE3(aqo, load__fss__done, INT1, INT2, INT3)
+#define TRACE_AQO_UPDATE_FSS_START(INT1, INT2) \
+	DTRACE_PROBE2(aqo, update__fss__start, INT1, INT2)
+#define TRACE_AQO_UPDATE_FSS_DONE(INT1, INT2, INT3) \
+	DTRACE_PROBE3(aqo, update__fss__done, INT1, INT2, INT3)
+#define TRACE_AQO_LEARN_SAMPLE_START() \
+	DTRACE_PROBE(aqo, learn__sample__start)
+#define TRACE_AQO_LEARN_SAMPLE_DONE(INT1, INT2, INT3, INT4) \
+	DTRACE_PROBE4(aqo, learn__sample__done, INT1, INT2, INT3, INT4)
+#define TRACE_AQO_AUTO_TUNING_START(INT1) \
+	DTRACE_PROBE1(aqo, auto__tuning__start, INT1)
+#define TRACE_AQO_AUTO_TUNING_DONE(INT1, INT2, INT3) \
+	DTRACE_PROBE3(aqo, auto__tuning__done, INT1, INT2, INT3)
+
+#else							/* not ENABLE_DTRACE */
+
+#define TRACE_AQO_PLANNER_START(INT1) do {} while (0)
+#define TRACE_AQO_PLANNER_DONE(INT1, INT2, INT3) do {} while (0)
+#define TRACE_AQO_PREDICT_START() do {} while (0)
+#define TRACE_AQO_PREDICT_DONE(INT1, INT2, INT3) do {} while (0)
+#define TRACE_AQO_LOAD_FSS_START(INT1, INT2) do {} while (0)
+#define TRACE_AQO_LOAD_FSS_DONE(INT1, INT2, INT3) do {} while (0)
+#define TRACE_AQO_UPDATE_FSS_START(INT1, INT2) do {} while (0)
+#define TRACE_AQO_UPDATE_FSS_DONE(INT1, INT2, INT3) do {} while (0)
+#define TRACE_AQO_LEARN_SAMPLE_START() do {} while (0)
+#define TRACE_AQO_LEARN_SAMPLE_DONE(INT1, INT2, INT3, INT4) do {} while (0)
+#define TRACE_AQO_AUTO_TUNING_START(INT1) do {} while (0)
+#define TRACE_AQO_AUTO_TUNING_DONE(INT1, INT2, INT3) do {} while (0)
+
+#endif							/* ENABLE_DTRACE */
+
+#endif							/* AQO_PROBES_H */
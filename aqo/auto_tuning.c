@@ -142,7 +142,7 @@ is_in_infinite_loop_cq(double *elems, int nelems)
  * this query to false.
  */
 void
-automatical_query_tuning(int query_hash, QueryStat * stat)
+automatical_query_tuning(int64 query_hash, QueryStat * stat)
 {
 	double		unstability = auto_tuning_exploration;
 	double		t_aqo,
@@ -150,6 +150,8 @@ automatical_query_tuning(int query_hash, QueryStat * stat)
 	double		p_use = -1;
 	int64		num_iterations;
 
+	TRACE_AQO_AUTO_TUNING_START(query_hash);
+
 	num_iterations = stat->executions_with_aqo + stat->executions_without_aqo;
 	query_context.learn_aqo = true;
 	if (stat->executions_without_aqo < auto_tuning_window_size + 1)
@@ -191,4 +193,7 @@ automatical_query_tuning(int query_hash, QueryStat * stat)
 											query_context.fspace_hash, true);
 	else
 		update_query(query_hash, false, false, query_context.fspace_hash, false);
+
+	TRACE_AQO_AUTO_TUNING_DONE(query_hash, query_context.use_aqo,
+							   query_context.learn_aqo);
 }
@@ -0,0 +1,284 @@
+/*
+ *******************************************************************************
+ *
+ *	MACHINE LEARNING MODELS BENCHMARK
+ *
+ * Standalone benchmark of prediction and learning step of the models from
+ * machine_learning.c and neural_network.c. It is built against the thin
+ * replacement of PostgreSQL headers (bench/postgres.h) by the ml_bench target
+ * of the Makefile and doesn't need a server.
+ *
+ * Usage: ml_bench [min_time_ms]
+ *
+ * Each case is repeated until it takes at least min_time_ms (200 by default).
+ * Results are printed in CSV format:
+ *	kernel,operation,ncols,nrows,iterations,ns_per_op
+ * nrows is the number of objects stored for k-NN and 0 for other models.
+ *
+ *******************************************************************************
+ *
+ * Copyright (c) 2016-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  aqo/bench/ml_bench.c
+ *
+ */
+
+#include <time.h>
+
+#include "machine_learning.h"
+
+/* Settings of aqo.c, which is not linked, at their default values */
+double			aqo_model_selection_tolerance = AQO_DEFAULT_MODEL_SELECTION_TOLERANCE;
+int				aqo_knn_capacity = aqo_K;
+
+/* Number of precomputed random objects the operations cycle through */
+#define POOL_SIZE	(1024)
+
+typedef struct BenchContext
+{
+	int			ncols;
+	double	   *pool[POOL_SIZE];
+	double		targets[POOL_SIZE];
+	int			next;
+	double	   *weights;
+	AqoFssModel *model;
+	double	   *nn;
+	double		sink;
+} BenchContext;
+
+typedef void (*bench_op) (BenchContext *cxt);
+
+static double min_time_ns = 200. * 1000. * 1000.;
+
+static void usage(int status);
+static double now_ns(void);
+static double random_log_selectivity(void);
+static void context_init(BenchContext *cxt, int ncols);
+static void context_free(BenchContext *cxt);
+static void fill_model(BenchContext *cxt, int nrows);
+static void run_case(const char *kernel, const char *operation,
+					 int ncols, int nrows, bench_op op, BenchContext *cxt);
+
+static void op_rg_predict(BenchContext *cxt);
+static void op_rg_learn(BenchContext *cxt);
+static void op_knn_predict(BenchContext *cxt);
+static void op_knn_learn(BenchContext *cxt);
+static void op_nn_predict(BenchContext *cxt);
+static void op_nn_learn(BenchContext *cxt);
+
+
+static void
+usage(int status)
+{
+	fprintf(status == 0 ? stdout : stderr,
+			"Usage: ml_bench [min_time_ms]\n"
+			"Each case is repeated until it takes at least min_time_ms "
+			"(200 by default).\n");
+	exit(status);
+}
+
+static double
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Returns random feature in the range of logarithms of selectivities.
+ */
+static double
+random_log_selectivity(void)
+{
+	return -30. * (random() / (double) MAX_RANDOM_VALUE);
+}
+
+static void
+context_init(BenchContext *cxt, int ncols)
+{
+	int			i,
+				j;
+
+	memset(cxt, 0, sizeof(*cxt));
+	cxt->ncols = ncols;
+	for (i = 0; i < POOL_SIZE; ++i)
+	{
+		cxt->pool[i] = palloc(sizeof(double) * Max(ncols, 1));
+		for (j = 0; j < ncols; ++j)
+			cxt->pool[i][j] = random_log_selectivity();
+		cxt->targets[i] = 20. * (random() / (double) MAX_RANDOM_VALUE);
+	}
+	cxt->weights = palloc0(sizeof(double) * (ncols + 1));
+	cxt->model = palloc_fss_model(ncols);
+}
+
+static void
+context_free(BenchContext *cxt)
+{
+	int			i;
+
+	for (i = 0; i < POOL_SIZE; ++i)
+		pfree(cxt->pool[i]);
+	pfree(cxt->weights);
+	pfree_fss_model(cxt->model);
+	if (cxt->nn != NULL)
+		pfree(cxt->nn);
+}
+
+/*
+ * Learns k-NN model of the context until it stores nrows objects.
+ */
+static void
+fill_model(BenchContext *cxt, int nrows)
+{
+	double	   *features = palloc(sizeof(double) * Max(cxt->ncols, 1));
+	int			attempts = 0;
+	int			j;
+
+	aqo_knn_capacity = nrows;
+	while (cxt->model->rows < nrows && attempts++ < 100 * nrows)
+	{
+		for (j = 0; j < cxt->ncols; ++j)
+			features[j] = random_log_selectivity();
+		OkNNr_learn(cxt->model, features, cxt->targets[attempts % POOL_SIZE]);
+	}
+	pfree(features);
+}
+
+/*
+ * Repeats the operation with doubling number of iterations until it takes
+ * at least min_time_ns, and prints the result.
+ */
+static void
+run_case(const char *kernel, const char *operation, int ncols, int nrows,
+		 bench_op op, BenchContext *cxt)
+{
+	long		iterations = 1;
+	double		elapsed;
+
+	for (;;)
+	{
+		double		start = now_ns();
+		long		i;
+
+		for (i = 0; i < iterations; ++i)
+			op(cxt);
+		elapsed = now_ns() - start;
+
+		if (elapsed >= min_time_ns)
+			break;
+		iterations *= 2;
+	}
+
+	printf("%s,%s,%d,%d,%ld,%.1f\n", kernel, operation, ncols, nrows,
+		   iterations, elapsed / iterations);
+	fflush(stdout);
+}
+
+static void
+op_rg_predict(BenchContext *cxt)
+{
+	cxt->sink += rg_predict(cxt->ncols, cxt->weights, cxt->pool[cxt->next]);
+	cxt->next = (cxt->next + 1) % POOL_SIZE;
+}
+
+static void
+op_rg_learn(BenchContext *cxt)
+{
+	rg_learn(cxt->ncols, cxt->weights, cxt->pool[cxt->next],
+			 cxt->targets[cxt->next]);
+	cxt->next = (cxt->next + 1) % POOL_SIZE;
+}
+
+static void
+op_knn_predict(BenchContext *cxt)
+{
+	cxt->sink += OkNNr_predict(cxt->model, cxt->pool[cxt->next]);
+	cxt->next = (cxt->next + 1) % POOL_SIZE;
+}
+
+static void
+op_knn_learn(BenchContext *cxt)
+{
+	OkNNr_learn(cxt->model, cxt->pool[cxt->next], cxt->targets[cxt->next]);
+	cxt->next = (cxt->next + 1) % POOL_SIZE;
+}
+
+static void
+op_nn_predict(BenchContext *cxt)
+{
+	cxt->sink += nn_predict(cxt->nn, cxt->pool[cxt->next]);
+	cxt->next = (cxt->next + 1) % POOL_SIZE;
+}
+
+static void
+op_nn_learn(BenchContext *cxt)
+{
+	nn_learn(cxt->nn, cxt->pool[cxt->next], cxt->targets[cxt->next], 1);
+	cxt->next = (cxt->next + 1) % POOL_SIZE;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const int ncols_set[] = {1, 4, 16, 64};
+	static const int nrows_set[] = {aqo_K, 300, 3000};
+	BenchContext cxt;
+	double		sink = 0;
+	size_t		i,
+				j;
+
+	if (argc > 2)
+		usage(1);
+	if (argc == 2)
+	{
+		char	   *end;
+		double		min_time_ms;
+
+		if (strcmp(argv[1], "--help") == 0 || strcmp(argv[1], "-h") == 0)
+			usage(0);
+		min_time_ms = strtod(argv[1], &end);
+		if (end == argv[1] || *end != '\0' || !(min_time_ms > 0))
+			usage(1);
+		min_time_ns = min_time_ms * 1000. * 1000.;
+	}
+	srandom(42);
+
+	printf("kernel,operation,ncols,nrows,iterations,ns_per_op\n");
+
+	for (i = 0; i < lengthof(ncols_set); ++i)
+	{
+		context_init(&cxt, ncols_set[i]);
+		run_case("rg", "predict", ncols_set[i], 0, op_rg_predict, &cxt);
+		run_case("rg", "learn", ncols_set[i], 0, op_rg_learn, &cxt);
+		sink += cxt.sink;
+		context_free(&cxt);
+	}
+
+	for (i = 0; i < lengthof(ncols_set); ++i)
+		for (j = 0; j < lengthof(nrows_set); ++j)
+		{
+			context_init(&cxt, ncols_set[i]);
+			fill_model(&cxt, nrows_set[j]);
+			run_case("OkNNr", "predict", ncols_set[i], cxt.model->rows,
+					 op_knn_predict, &cxt);
+			run_case("OkNNr", "learn", ncols_set[i], cxt.model->rows,
+					 op_knn_learn, &cxt);
+			sink += cxt.sink;
+			context_free(&cxt);
+		}
+
+	context_init(&cxt, aqo_hashed_nfeatures);
+	cxt.nn = palloc(sizeof(double) * nn_nparams());
+	nn_init(cxt.nn);
+	run_case("nn", "predict", aqo_hashed_nfeatures, 0, op_nn_predict, &cxt);
+	run_case("nn", "learn", aqo_hashed_nfeatures, 0, op_nn_learn, &cxt);
+	sink += cxt.sink;
+	context_free(&cxt);
+
+	/* Keep the predictions alive for the optimizer */
+	return (sink == 0.12345) ? 1 : 0;
+}
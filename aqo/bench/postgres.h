@@ -0,0 +1,83 @@
+/*
+ * postgres.h
+ *		Minimal replacement of PostgreSQL headers for the standalone benchmark
+ *		of the machine learning models.
+ *
+ * machine_learning.c and neural_network.c need only memory allocation and a
+ * few portability macros from PostgreSQL. This header is found instead of the
+ * real postgres.h when they are built by the ml_bench target of the Makefile,
+ * so the models can be benchmarked without a server.
+ *
+ * Copyright (c) 2016-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  aqo/bench/postgres.h
+ *
+ */
+#ifndef AQO_BENCH_POSTGRES_H
+#define AQO_BENCH_POSTGRES_H
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define Assert(condition)	assert(condition)
+#define Max(x, y)		((x) > (y) ? (x) : (y))
+#define Min(x, y)		((x) < (y) ? (x) : (y))
+#define MAX_RANDOM_VALUE	INT32_MAX
+#define lengthof(array)	(sizeof (array) / sizeof ((array)[0]))
+
+static inline void *
+shim_alloc(size_t size, bool zero)
+{
+	void	   *ptr = zero ? calloc(1, size ? size : 1) : malloc(size ? size : 1);
+
+	if (ptr == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+#define palloc(size)		shim_alloc((size), false)
+#define palloc0(size)		shim_alloc((size), true)
+#define pfree(ptr)			free(ptr)
+
+static inline void *
+repalloc(void *ptr, size_t size)
+{
+	ptr = realloc(ptr, size);
+	if (ptr == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return ptr;
+}
+
+typedef int (*qsort_arg_comparator) (const void *a, const void *b, void *arg);
+
+static qsort_arg_comparator shim_qsort_cmp;
+static void *shim_qsort_arg;
+
+static inline int
+shim_qsort_compare(const void *a, const void *b)
+{
+	return shim_qsort_cmp(a, b, shim_qsort_arg);
+}
+
+/* The benchmark is single-threaded and the models never nest sorts */
+static inline void
+qsort_arg(void *base, size_t nel, size_t elsize,
+		  qsort_arg_comparator cmp, void *arg)
+{
+	shim_qsort_cmp = cmp;
+	shim_qsort_arg = arg;
+	qsort(base, nel, elsize, shim_qsort_compare);
+}
+
+#endif							/* AQO_BENCH_POSTGRES_H */
@@ -20,26 +20,74 @@
 
 /*
  * General method for prediction the cardinality of given relation.
+ * Returns negative value if no prediction is available. The model used and
+ * its confidence in [0, 1] are stored in *details; the time of prediction is
+ * measured only if aqo.show_details is on.
  */
 double
 predict_for_relation(List *restrict_clauses, List *selectivities,
-					 List *relids, int *fss_hash)
+					 List *relids, int64 *fss_hash,
+					 AqoPredictionDetails *details)
 {
-	int		nfeatures;
-	double	*weights;
-	double	*features;
-	double	result;
-	int		rows;
-	int		i;
+	int			nfeatures;
+	double	   *features;
+	double		hashed_features[aqo_hashed_nfeatures];
+	AqoFssModel *model;
+	AqoFssModel *global_model = NULL;
+	AQO_MODEL	kind = AQO_MODEL_NONE;
+	double		result;
+	instr_time	start;
+	instr_time	stat_start;
+	instr_time	details_start;
+
+	TRACE_AQO_PREDICT_START();
+	hook_stats_start(&start);
+	aqo_stat_start(&stat_start);
+	if (aqo_show_details)
+		INSTR_TIME_SET_CURRENT(details_start);
+	aqo_stat_add(AQO_STAT_PREDICTIONS_ATTEMPTED, 1);
 
 	*fss_hash = get_fss_for_object(restrict_clauses, selectivities, relids,
-														&nfeatures, &features);
+								   &nfeatures, &features,
+								   aqo_use_global_model ? hashed_features : NULL);
 
-	if (nfeatures > 0)
-		weights = palloc0(sizeof(*weights) * nfeatures);
+	model = palloc_fss_model(nfeatures);
+	if (load_fss(*fss_hash, nfeatures, model))
+	{
+		kind = aqo_select_model(model, aqo_use_global_model);
 
-	if (load_fss(*fss_hash, nfeatures, matrix, targets, &rows))
-		result = rg_predict(nfeatures, weights, features);
+		/* The neural network is stored in the global model */
+		if (kind == AQO_MODEL_MLP)
+		{
+			global_model = palloc_fss_model(aqo_hashed_nfeatures);
+			if (!load_fss(AQO_GLOBAL_FSS_HASH, aqo_hashed_nfeatures,
+						  global_model) || global_model->nn == NULL)
+				kind = aqo_select_model(model, false);
+		}
+	}
+	else if (aqo_use_global_model)
+	{
+		/*
+		 * The feature subspace is unknown, but the global model was learned
+		 * over the objects of other subspaces of this feature space.
+		 */
+		pfree_fss_model(model);
+		model = palloc_fss_model(aqo_hashed_nfeatures);
+		if (load_fss(AQO_GLOBAL_FSS_HASH, aqo_hashed_nfeatures, model))
+		{
+			kind = aqo_select_model(model, true);
+			features = memcpy(repalloc(features, sizeof(hashed_features)),
+							  hashed_features, sizeof(hashed_features));
+			global_model = model;
+		}
+	}
+
+	if (kind != AQO_MODEL_NONE)
+	{
+		result = aqo_model_predict(kind, model, features,
+								   global_model, hashed_features);
+		details->confidence = aqo_model_confidence(kind, model, features);
+	}
 	else
 	{
 		/*
@@ -49,16 +97,35 @@ predict_for_relation(List *restrict_clauses, List *selectivities,
 		 * knowledge base.
 		 */
 		result = -1;
+		details->confidence = 0.;
 	}
 
+	if (global_model != NULL && global_model != model)
+		pfree_fss_model(global_model);
+	pfree_fss_model(model);
 	pfree(features);
-	if (nfeatures > 0)
+
+	details->kind = kind;
+	details->native_rows = -1.;
+	details->latency = -1.;
+	if (aqo_show_details)
 	{
-		pfree(weights);
+		instr_time	details_end;
+
+		INSTR_TIME_SET_CURRENT(details_end);
+		INSTR_TIME_SUBTRACT(details_end, details_start);
+		details->latency = INSTR_TIME_GET_MILLISEC(details_end);
 	}
+	hook_stats_stop(AQO_HOOK_PREDICT, &start);
+	aqo_stat_add_time(AQO_STAT_PREDICT_TIME, &stat_start);
+	aqo_stat_add(result < 0 ? AQO_STAT_PREDICTIONS_REFUSED :
+				 AQO_STAT_PREDICTIONS_SERVED, 1);
 
-	if (result < 0)
-		return -1;
+	/* A wild prediction must not overflow exp() */
+	if (result < 0 || isnan(result))
+		result = -1;
 	else
-		return clamp_row_est(exp(result));
+		result = clamp_row_est(exp(Min(result, log(AQO_MAX_ROWS))));
+	TRACE_AQO_PREDICT_DONE(*fss_hash, kind, AQO_PROBE_ROWS(result));
+	return result;
 }
@@ -11,10 +11,13 @@
  * absolute relids used in the relation being built and pass this
  * information to predict_for_relation function. Also these hooks compute
  * and pass to predict_for_relation marginal cardinalities for clauses.
- * If predict_for_relation returns non-negative value, then hooks assume it
- * to be true cardinality for given relation. Negative returned value means
- * refusal to predict cardinality. In this case hooks also use default
- * postgreSQL cardinality estimator.
+ * If predict_for_relation returns non-negative value with confidence not less
+ * than aqo.min_confidence, then hooks assume it to be true cardinality for
+ * given relation. Less confident predictions are blended with the estimate of
+ * default postgreSQL cardinality estimator, but the prediction itself is kept
+ * for learning and EXPLAIN. Negative returned value or zero
+ * confidence means refusal to predict cardinality. In this case hooks also use
+ * default postgreSQL cardinality estimator.
  *
  *******************************************************************************
  *
@@ -26,9 +29,27 @@
  */
 
 #include "aqo.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "optimizer/optimizer.h"
 
 double predicted_ppi_rows;
-double fss_ppi_hash;
+int64 fss_ppi_hash;
+AqoPredictionDetails ppi_details;
+
+/*
+ * Backend-local statistics of the hooks: number of calls and total time.
+ * Collected only if aqo.track_hooks is on.
+ */
+static const char *const hook_names[AQO_NHOOKS] = {
+	"set_baserel_rows_estimate",
+	"get_parameterized_baserel_size",
+	"set_joinrel_size_estimates",
+	"get_parameterized_joinrel_size",
+	"predict_for_relation"
+};
+static int64 hook_calls[AQO_NHOOKS];
+static instr_time hook_time[AQO_NHOOKS];
 
 static void call_default_set_baserel_rows_estimate(PlannerInfo *root,
 									   RelOptInfo *rel);
@@ -47,6 +68,27 @@ static double call_default_get_parameterized_joinrel_size(PlannerInfo *root,
 											Path *inner_path,
 											SpecialJoinInfo *sjinfo,
 											List *restrict_clauses);
+static double blend_with_standard(double predicted, double confidence,
+								  double standard);
+static void set_rel_details(RelOptInfo *rel, AqoPredictionDetails *details);
+static void forget_ppi_prediction(void);
+static void set_baserel_rows_estimate_internal(PlannerInfo *root,
+											   RelOptInfo *rel);
+static double get_parameterized_baserel_size_internal(PlannerInfo *root,
+													  RelOptInfo *rel,
+													  List *param_clauses);
+static void set_joinrel_size_estimates_internal(PlannerInfo *root,
+												RelOptInfo *rel,
+												RelOptInfo *outer_rel,
+												RelOptInfo *inner_rel,
+												SpecialJoinInfo *sjinfo,
+												List *restrictlist);
+static double get_parameterized_joinrel_size_internal(PlannerInfo *root,
+													  RelOptInfo *rel,
+													  Path *outer_path,
+													  Path *inner_path,
+													  SpecialJoinInfo *sjinfo,
+													  List *restrict_clauses);
 
 
 /*
@@ -124,20 +166,41 @@ call_default_set_joinrel_size_estimates(PlannerInfo *root, RelOptInfo *rel,
 											restrictlist);
 }
 
+/*
+ * Blends the prediction with the standard estimate in logarithmic scale:
+ * the weight of the prediction grows linearly with its confidence up to
+ * aqo_min_confidence.
+ * Returns negative value if the prediction can't be used at all.
+ */
+static double
+blend_with_standard(double predicted, double confidence, double standard)
+{
+	double		w;
+
+	if (predicted < 0 || confidence <= 0.)
+		return -1.;
+
+	w = (confidence < aqo_min_confidence) ?
+		confidence / aqo_min_confidence : 1.;
+	return clamp_row_est(exp(w * log(predicted) +
+							 (1. - w) * log(standard)));
+}
+
 /*
  * Our hook for setting baserel rows estimate.
  * Extracts clauses, their selectivities and list of relation relids and
  * passes them to predict_for_relation.
  */
-void
-aqo_set_baserel_rows_estimate(PlannerInfo *root, RelOptInfo *rel)
+static void
+set_baserel_rows_estimate_internal(PlannerInfo *root, RelOptInfo *rel)
 {
 	double		predicted;
 	Oid			relid;
 	List	   *relids;
 	List	   *selectivities = NULL;
 	List	*restrict_clauses;
-	int fss = 0;
+	int64		fss = 0;
+	AqoPredictionDetails details;
 
 	if (query_context.use_aqo || query_context.learn_aqo)
 		selectivities = get_selectivities(root, rel->baserestrictinfo, 0,
@@ -156,18 +219,31 @@ aqo_set_baserel_rows_estimate(PlannerInfo *root, RelOptInfo *rel)
 	relids = list_make1_int(relid);
 
 	restrict_clauses = list_copy(rel->baserestrictinfo);
-	predicted = predict_for_relation(restrict_clauses, selectivities, relids, &fss);
+	predicted = predict_for_relation(restrict_clauses, selectivities, relids,
+									 &fss, &details);
 	rel->fss_hash = fss;
 
-	if (predicted >= 0)
+	/* The standard estimate is needed anyway to show it in EXPLAIN */
+	if (aqo_show_details)
 	{
-		rel->rows = predicted;
-		rel->predicted_cardinality = predicted;
+		call_default_set_baserel_rows_estimate(root, rel);
+		details.native_rows = rel->rows;
 	}
+
+	/* Learning and EXPLAIN need the prediction of the model itself */
+	rel->predicted_cardinality = predicted;
+	set_rel_details(rel, &details);
+	if (predicted >= 0 && details.confidence >= aqo_min_confidence)
+		rel->rows = predicted;
 	else
 	{
-		call_default_set_baserel_rows_estimate(root, rel);
-		rel->predicted_cardinality = -1.;
+		double		blended;
+
+		if (!aqo_show_details)
+			call_default_set_baserel_rows_estimate(root, rel);
+		blended = blend_with_standard(predicted, details.confidence, rel->rows);
+		if (blended >= 0)
+			rel->rows = blended;
 	}
 
 	list_free_deep(selectivities);
@@ -176,11 +252,38 @@ aqo_set_baserel_rows_estimate(PlannerInfo *root, RelOptInfo *rel)
 }
 
 
+/*
+ * Stores the details of the prediction in the relation for EXPLAIN.
+ */
+static void
+set_rel_details(RelOptInfo *rel, AqoPredictionDetails *details)
+{
+	rel->predicted_model = details->kind;
+	rel->predicted_confidence = details->confidence;
+	rel->native_cardinality = details->native_rows;
+	rel->prediction_time = details->latency;
+}
+
+/*
+ * The next parameterized path isn't predicted, so it mustn't get the
+ * prediction of the previous one.
+ */
+static void
+forget_ppi_prediction(void)
+{
+	predicted_ppi_rows = -1.;
+	fss_ppi_hash = 0;
+}
+
 void
 ppi_hook(ParamPathInfo *ppi)
 {
 	ppi->predicted_ppi_rows = predicted_ppi_rows;
 	ppi->fss_ppi_hash = fss_ppi_hash;
+	ppi->predicted_ppi_model = ppi_details.kind;
+	ppi->predicted_ppi_confidence = ppi_details.confidence;
+	ppi->native_ppi_rows = ppi_details.native_rows;
+	ppi->ppi_prediction_time = ppi_details.latency;
 }
 
 /*
@@ -188,10 +291,10 @@ ppi_hook(ParamPathInfo *ppi)
  * Extracts clauses (including parametrization ones), their selectivities
  * and list of relation relids and passes them to predict_for_relation.
  */
-double
-aqo_get_parameterized_baserel_size(PlannerInfo *root,
-								   RelOptInfo *rel,
-								   List *param_clauses)
+static double
+get_parameterized_baserel_size_internal(PlannerInfo *root,
+										RelOptInfo *rel,
+										List *param_clauses)
 {
 	double		predicted;
 	Oid			relid = InvalidOid;
@@ -201,10 +304,13 @@ aqo_get_parameterized_baserel_size(PlannerInfo *root,
 	ListCell   *l;
 	ListCell   *l2;
 	int			nargs;
-	int		   *args_hash;
-	int		   *eclass_hash;
-	int			current_hash;
-	int fss = 0;
+	int64	   *args_hash;
+	int64	   *eclass_hash;
+	int64		current_hash;
+	int64		fss = 0;
+	AqoPredictionDetails details;
+	double		standard = -1.;
+	double		blended;
 
 	if (query_context.use_aqo || query_context.learn_aqo)
 	{
@@ -233,22 +339,33 @@ aqo_get_parameterized_baserel_size(PlannerInfo *root,
 			list_free_deep(selectivities);
 			list_free(allclauses);
 		}
+		forget_ppi_prediction();
 		return call_default_get_parameterized_baserel_size(root, rel,
 														   param_clauses);
 	}
 
 	relids = list_make1_int(relid);
 
-	predicted = predict_for_relation(allclauses, selectivities, relids, &fss);
+	predicted = predict_for_relation(allclauses, selectivities, relids,
+									 &fss, &details);
+
+	if (aqo_show_details || predicted < 0 ||
+		details.confidence < aqo_min_confidence)
+		standard = call_default_get_parameterized_baserel_size(root, rel,
+															   param_clauses);
+	if (aqo_show_details)
+		details.native_rows = standard;
 
+	/* Learning and EXPLAIN need the prediction of the model itself */
 	predicted_ppi_rows = predicted;
 	fss_ppi_hash = fss;
+	ppi_details = details;
 
-	if (predicted >= 0)
+	if (predicted >= 0 && details.confidence >= aqo_min_confidence)
 		return predicted;
-	else
-		return call_default_get_parameterized_baserel_size(root, rel,
-														   param_clauses);
+
+	blended = blend_with_standard(predicted, details.confidence, standard);
+	return (blended >= 0) ? blended : standard;
 }
 
 /*
@@ -256,12 +373,12 @@ aqo_get_parameterized_baserel_size(PlannerInfo *root,
  * Extracts clauses, their selectivities and list of relation relids and
  * passes them to predict_for_relation.
  */
-void
-aqo_set_joinrel_size_estimates(PlannerInfo *root, RelOptInfo *rel,
-							   RelOptInfo *outer_rel,
-							   RelOptInfo *inner_rel,
-							   SpecialJoinInfo *sjinfo,
-							   List *restrictlist)
+static void
+set_joinrel_size_estimates_internal(PlannerInfo *root, RelOptInfo *rel,
+									RelOptInfo *outer_rel,
+									RelOptInfo *inner_rel,
+									SpecialJoinInfo *sjinfo,
+									List *restrictlist)
 {
 	double		predicted;
 	List	   *relids;
@@ -272,7 +389,8 @@ aqo_set_joinrel_size_estimates(PlannerInfo *root, RelOptInfo *rel,
 	List	   *inner_selectivities;
 	List	   *outer_selectivities;
 	List	   *current_selectivities = NULL;
-	int fss = 0;
+	int64		fss = 0;
+	AqoPredictionDetails details;
 
 	if (query_context.use_aqo || query_context.learn_aqo)
 		current_selectivities = get_selectivities(root, restrictlist, 0,
@@ -302,22 +420,39 @@ aqo_set_joinrel_size_estimates(PlannerInfo *root, RelOptInfo *rel,
 								list_concat(outer_selectivities,
 											inner_selectivities));
 
-	predicted = predict_for_relation(allclauses, selectivities, relids, &fss);
+	predicted = predict_for_relation(allclauses, selectivities, relids,
+									 &fss, &details);
 	rel->fss_hash = fss;
 
-	if (predicted >= 0)
-	{
-		rel->predicted_cardinality = predicted;
-		rel->rows = predicted;
-	}
-	else
+	/* The standard estimate is needed anyway to show it in EXPLAIN */
+	if (aqo_show_details)
 	{
-		rel->predicted_cardinality = -1;
 		call_default_set_joinrel_size_estimates(root, rel,
 												outer_rel,
 												inner_rel,
 												sjinfo,
 												restrictlist);
+		details.native_rows = rel->rows;
+	}
+
+	/* Learning and EXPLAIN need the prediction of the model itself */
+	rel->predicted_cardinality = predicted;
+	set_rel_details(rel, &details);
+	if (predicted >= 0 && details.confidence >= aqo_min_confidence)
+		rel->rows = predicted;
+	else
+	{
+		double		blended;
+
+		if (!aqo_show_details)
+			call_default_set_joinrel_size_estimates(root, rel,
+													outer_rel,
+													inner_rel,
+													sjinfo,
+													restrictlist);
+		blended = blend_with_standard(predicted, details.confidence, rel->rows);
+		if (blended >= 0)
+			rel->rows = blended;
 	}
 }
 
@@ -326,13 +461,13 @@ aqo_set_joinrel_size_estimates(PlannerInfo *root, RelOptInfo *rel,
  * Extracts clauses (including parametrization ones), their selectivities
  * and list of relation relids and passes them to predict_for_relation.
  */
-double
-aqo_get_parameterized_joinrel_size(PlannerInfo *root,
-								   RelOptInfo *rel,
-								   Path *outer_path,
-								   Path *inner_path,
-								   SpecialJoinInfo *sjinfo,
-								   List *restrict_clauses)
+static double
+get_parameterized_joinrel_size_internal(PlannerInfo *root,
+										RelOptInfo *rel,
+										Path *outer_path,
+										Path *inner_path,
+										SpecialJoinInfo *sjinfo,
+										List *restrict_clauses)
 {
 	double		predicted;
 	List	   *relids;
@@ -343,7 +478,10 @@ aqo_get_parameterized_joinrel_size(PlannerInfo *root,
 	List	   *inner_selectivities;
 	List	   *outer_selectivities;
 	List	   *current_selectivities = NULL;
-	int			fss = 0;
+	int64		fss = 0;
+	AqoPredictionDetails details;
+	double		standard = -1.;
+	double		blended;
 
 	if (query_context.use_aqo || query_context.learn_aqo)
 		current_selectivities = get_selectivities(root, restrict_clauses, 0,
@@ -354,6 +492,7 @@ aqo_get_parameterized_joinrel_size(PlannerInfo *root,
 		if (query_context.learn_aqo)
 			list_free_deep(current_selectivities);
 
+		forget_ppi_prediction();
 		return call_default_get_parameterized_joinrel_size(root, rel,
 														   outer_path,
 														   inner_path,
@@ -370,17 +509,186 @@ aqo_get_parameterized_joinrel_size(PlannerInfo *root,
 								list_concat(outer_selectivities,
 											inner_selectivities));
 
-	predicted = predict_for_relation(allclauses, selectivities, relids, &fss);
+	predicted = predict_for_relation(allclauses, selectivities, relids,
+									 &fss, &details);
 
+	if (aqo_show_details || predicted < 0 ||
+		details.confidence < aqo_min_confidence)
+		standard = call_default_get_parameterized_joinrel_size(root, rel,
+															   outer_path,
+															   inner_path,
+															   sjinfo,
+															   restrict_clauses);
+	if (aqo_show_details)
+		details.native_rows = standard;
+
+	/* Learning and EXPLAIN need the prediction of the model itself */
 	predicted_ppi_rows = predicted;
 	fss_ppi_hash = fss;
+	ppi_details = details;
 
-	if (predicted >= 0)
+	if (predicted >= 0 && details.confidence >= aqo_min_confidence)
 		return predicted;
-	else
-		return call_default_get_parameterized_joinrel_size(root, rel,
-														   outer_path,
-														   inner_path,
-														   sjinfo,
-														   restrict_clauses);
+
+	blended = blend_with_standard(predicted, details.confidence, standard);
+	return (blended >= 0) ? blended : standard;
+}
+
+/*
+ * Starts measurement of the hook call.
+ */
+void
+hook_stats_start(instr_time *start)
+{
+	if (aqo_track_hooks)
+		INSTR_TIME_SET_CURRENT(*start);
+}
+
+/*
+ * Finishes measurement of the hook call started by hook_stats_start.
+ */
+void
+hook_stats_stop(AqoHookId hook, instr_time *start)
+{
+	instr_time	end;
+
+	if (!aqo_track_hooks)
+		return;
+
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_ACCUM_DIFF(hook_time[hook], end, *start);
+	hook_calls[hook]++;
+}
+
+/*
+ * Our hook for setting baserel rows estimate.
+ */
+void
+aqo_set_baserel_rows_estimate(PlannerInfo *root, RelOptInfo *rel)
+{
+	instr_time	start;
+
+	hook_stats_start(&start);
+	set_baserel_rows_estimate_internal(root, rel);
+	hook_stats_stop(AQO_HOOK_BASEREL_ROWS, &start);
+}
+
+/*
+ * Our hook for estimating parameterized baserel rows estimate.
+ */
+double
+aqo_get_parameterized_baserel_size(PlannerInfo *root,
+								   RelOptInfo *rel,
+								   List *param_clauses)
+{
+	instr_time	start;
+	double		result;
+
+	hook_stats_start(&start);
+	result = get_parameterized_baserel_size_internal(root, rel, param_clauses);
+	hook_stats_stop(AQO_HOOK_PARAM_BASEREL_SIZE, &start);
+	return result;
+}
+
+/*
+ * Our hook for setting joinrel rows estimate.
+ */
+void
+aqo_set_joinrel_size_estimates(PlannerInfo *root, RelOptInfo *rel,
+							   RelOptInfo *outer_rel,
+							   RelOptInfo *inner_rel,
+							   SpecialJoinInfo *sjinfo,
+							   List *restrictlist)
+{
+	instr_time	start;
+
+	hook_stats_start(&start);
+	set_joinrel_size_estimates_internal(root, rel, outer_rel, inner_rel,
+										sjinfo, restrictlist);
+	hook_stats_stop(AQO_HOOK_JOINREL_SIZE, &start);
+}
+
+/*
+ * Our hook for estimating parameterized joinrel rows estimate.
+ */
+double
+aqo_get_parameterized_joinrel_size(PlannerInfo *root,
+								   RelOptInfo *rel,
+								   Path *outer_path,
+								   Path *inner_path,
+								   SpecialJoinInfo *sjinfo,
+								   List *restrict_clauses)
+{
+	instr_time	start;
+	double		result;
+
+	hook_stats_start(&start);
+	result = get_parameterized_joinrel_size_internal(root, rel,
+													 outer_path, inner_path,
+													 sjinfo, restrict_clauses);
+	hook_stats_stop(AQO_HOOK_PARAM_JOINREL_SIZE, &start);
+	return result;
+}
+
+PG_FUNCTION_INFO_V1(aqo_hook_stats);
+
+/*
+ * Returns the number of calls and total time in milliseconds of each hook in
+ * this backend.
+ */
+Datum
+aqo_hook_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcontext;
+	int			i;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	for (i = 0; i < AQO_NHOOKS; ++i)
+	{
+		Datum		values[3];
+		bool		nulls[3] = {false, false, false};
+
+		values[0] = CStringGetTextDatum(hook_names[i]);
+		values[1] = Int64GetDatum(hook_calls[i]);
+		values[2] = Float8GetDatum(INSTR_TIME_GET_MILLISEC(hook_time[i]));
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(aqo_hook_stats_reset);
+
+/*
+ * Resets the statistics of the hooks in this backend.
+ */
+Datum
+aqo_hook_stats_reset(PG_FUNCTION_ARGS)
+{
+	int			i;
+
+	for (i = 0; i < AQO_NHOOKS; ++i)
+	{
+		hook_calls[i] = 0;
+		INSTR_TIME_SET_ZERO(hook_time[i]);
+	}
+	PG_RETURN_VOID();
 }
@@ -10,6 +10,14 @@
  * only in the values of their constants. We want query_hash, clause_hash and
  * fss_hash to satisfy this property.
  *
+ * By default relations are identified by their OIDs, so the hashes are valid
+ * only in the cluster where they were computed. If aqo.portable_hashes is on,
+ * schema-qualified names of relations, and of user-defined types, operators
+ * and functions, are hashed instead, so the knowledge base may be moved to
+ * another cluster or survive dump and restore. Built-in objects have the same
+ * OIDs in all clusters of a major version. OIDs of collations are still
+ * hashed as they are.
+ *
  *******************************************************************************
  *
  * Copyright (c) 2016-2020, Postgres Professional
@@ -20,30 +28,109 @@
  */
 
 #include "aqo.h"
-
-static int	get_str_hash(const char *str);
-static int	get_node_hash(Node *node);
-static int	get_int_array_hash(int *arr, int len);
-static int	get_unsorted_unsafe_int_array_hash(int *arr, int len);
-static int	get_unordered_int_list_hash(List *lst);
-
-static int	get_relidslist_hash(List *relidslist);
-static int get_fss_hash(int clauses_hash, int eclasses_hash,
-			 int relidslist_hash);
+#include "access/transam.h"
+#include "utils/hashutils.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/regproc.h"
+#include "utils/syscache.h"
+
+/* Mixes the value into the hash of the jumbled query tree */
+#define JUMBLE(hash, value) \
+	(*(hash) = hash_combine64(*(hash), (uint64) (value)))
+
+static int64 get_jumbled_query_hash(Query *parse);
+static bool jumble_walker(Node *node, uint64 *hash);
+static void jumble_sort_clauses(List *clauses, uint64 *hash);
+static void jumble_grouping_sets(List *sets, uint64 *hash);
+/* Kinds of objects identified by their names in portable hashes */
+typedef enum
+{
+	AQO_OBJECT_RELATION,
+	AQO_OBJECT_TYPE,
+	AQO_OBJECT_OPERATOR,
+	AQO_OBJECT_FUNCTION
+} AqoObjectKind;
+
+/* Fields of the text representation of nodes which hold OIDs of objects */
+static const struct
+{
+	const char *field;
+	AqoObjectKind kind;
+}			oid_fields[] =
+{
+	{":relid ", AQO_OBJECT_RELATION},
+	{":resorigtbl ", AQO_OBJECT_RELATION},
+	{":vartype ", AQO_OBJECT_TYPE},
+	{":consttype ", AQO_OBJECT_TYPE},
+	{":paramtype ", AQO_OBJECT_TYPE},
+	{":aggtype ", AQO_OBJECT_TYPE},
+	{":aggtranstype ", AQO_OBJECT_TYPE},
+	{":wintype ", AQO_OBJECT_TYPE},
+	{":funcresulttype ", AQO_OBJECT_TYPE},
+	{":opresulttype ", AQO_OBJECT_TYPE},
+	{":resulttype ", AQO_OBJECT_TYPE},
+	{":row_typeid ", AQO_OBJECT_TYPE},
+	{":casetype ", AQO_OBJECT_TYPE},
+	{":coalescetype ", AQO_OBJECT_TYPE},
+	{":minmaxtype ", AQO_OBJECT_TYPE},
+	{":array_typeid ", AQO_OBJECT_TYPE},
+	{":element_typeid ", AQO_OBJECT_TYPE},
+	{":opno ", AQO_OBJECT_OPERATOR},
+	{":eqop ", AQO_OBJECT_OPERATOR},
+	{":sortop ", AQO_OBJECT_OPERATOR},
+	{":funcid ", AQO_OBJECT_FUNCTION},
+	{":opfuncid ", AQO_OBJECT_FUNCTION},
+	{":aggfnoid ", AQO_OBJECT_FUNCTION},
+	{":winfnoid ", AQO_OBJECT_FUNCTION}
+};
+
+static int64 get_relid_hash(Oid relid);
+static int64 get_object_hash(AqoObjectKind kind, Oid oid);
+static void relid_hashes_relcache_callback(Datum arg, Oid relid);
+static void relid_hashes_syscache_callback(Datum arg, int cacheid,
+										   uint32 hashvalue);
+static char *replace_oids(char *str);
+static int64 get_str_hash(const char *str);
+static int64 get_node_hash(Node *node);
+static int64 get_int_array_hash64(int *arr, int len);
+static int64 get_int64_array_hash(int64 *arr, int len);
+
+static int64 get_relidslist_hash(List *relidslist);
+static int64 get_fss_hash(int64 clauses_hash, int64 eclasses_hash,
+			 int64 relidslist_hash);
+static void hash_feature(int64 hash, double value, double *features);
+static void get_hashed_features(int n, int64 *clause_hashes, double *log_sels,
+					List *relidslist, int nargs, int64 *eclass_hash,
+					double *features);
 
 static char *replace_patterns(const char *str, const char *start_pattern,
 				 bool (*end_pattern) (char ch));
 static char *remove_consts(const char *str);
 static char *remove_locations(const char *str);
 
-static int	get_id_in_sorted_int_array(int val, int n, int *arr);
-static int get_arg_eclass(int arg_hash, int nargs,
-			   int *args_hash, int *eclass_hash);
+static int	get_id_in_sorted_int64_array(int64 val, int n, int64 *arr);
+
+/* Hash relations by their names rather than OIDs */
+bool		aqo_portable_hashes = false;
 
-static void get_clauselist_args(List *clauselist, int *nargs, int **args_hash);
+/* Cache of hashes of relation names, see get_relid_hash */
+typedef struct
+{
+	Oid			relid;			/* hash key */
+	int64		hash;
+} AqoRelidHash;
+
+static HTAB *relid_hashes = NULL;
+static int64 get_arg_eclass(int64 arg_hash, int nargs,
+			   int64 *args_hash, int64 *eclass_hash);
+
+static void get_clauselist_args(List *clauselist, int *nargs,
+								int64 **args_hash);
 static int	disjoint_set_get_parent(int *p, int v);
 static void disjoint_set_merge_eclasses(int *p, int v1, int v2);
-static int *perform_eclasses_join(List *clauselist, int nargs, int *args_hash);
+static int *perform_eclasses_join(List *clauselist, int nargs,
+								  int64 *args_hash);
 
 static bool is_brace(char ch);
 static bool has_consts(List *lst);
@@ -54,45 +141,287 @@ static bool clause_is_eq_clause(Expr *clause);
  * Computes hash for given query.
  * Hash is supposed to be constant-insensitive.
  * XXX: Hashing depend on Oids of database objects. It is restrict usability of
- * the AQO knowledge base by current database at current Postgres instance.
+ * the AQO knowledge base by current database at current Postgres instance,
+ * unless aqo.portable_hashes replaces OIDs of objects with their names.
  */
-int
+int64
 get_query_hash(Query *parse, const char *query_text)
 {
 	char	   *str_repr;
-	int			hash;
+	int64		hash;
+
+	if (aqo_query_hash_method == AQO_QUERY_HASH_JUMBLE)
+		return get_jumbled_query_hash(parse);
 
 	str_repr = remove_locations(remove_consts(nodeToString(parse)));
-	hash = DatumGetInt32(hash_any((const unsigned char *) str_repr,
-								  strlen(str_repr) * sizeof(*str_repr)));
+	if (aqo_portable_hashes)
+		str_repr = replace_oids(str_repr);
+	hash = DatumGetInt64(hash_any_extended((const unsigned char *) str_repr,
+										   strlen(str_repr) * sizeof(*str_repr),
+										   0));
 	pfree(str_repr);
 
 	return hash;
 }
 
+/*
+ * Jumbles the query tree, ignoring the constants, without the text
+ * representation of the tree. The queryId computed in post-parse analysis,
+ * e. g. by pg_stat_statements, isn't used even if it is there: the hash
+ * must not depend on whether such a module is loaded, or the queries would
+ * get two hashes after the module is loaded or unloaded.
+ */
+static int64
+get_jumbled_query_hash(Query *parse)
+{
+	uint64		hash = 0;
+
+	jumble_walker((Node *) parse, &hash);
+	return (int64) hash;
+}
+
+/*
+ * Mixes the fields which define the query type into the hash: tags of the
+ * nodes, relations, columns, operators and functions, but not the values of
+ * constants and locations.
+ */
+static bool
+jumble_walker(Node *node, uint64 *hash)
+{
+	if (node == NULL)
+	{
+		JUMBLE(hash, 0);
+		return false;
+	}
+
+	JUMBLE(hash, nodeTag(node));
+
+	switch (nodeTag(node))
+	{
+		case T_Query:
+			{
+				Query	   *query = (Query *) node;
+				ListCell   *l;
+
+				JUMBLE(hash, query->commandType);
+				JUMBLE(hash, query->resultRelation);
+				jumble_sort_clauses(query->groupClause, hash);
+				jumble_grouping_sets(query->groupingSets, hash);
+				jumble_sort_clauses(query->distinctClause, hash);
+				jumble_sort_clauses(query->sortClause, hash);
+				foreach(l, query->windowClause)
+				{
+					WindowClause *wc = (WindowClause *) lfirst(l);
+
+					JUMBLE(hash, wc->winref);
+					JUMBLE(hash, wc->frameOptions);
+					jumble_sort_clauses(wc->partitionClause, hash);
+					jumble_sort_clauses(wc->orderClause, hash);
+				}
+				JUMBLE(hash, list_length(query->windowClause));
+
+				/* The walker is called for the range table entries too */
+				return query_tree_walker(query, jumble_walker, (void *) hash,
+										 QTW_EXAMINE_RTES_BEFORE);
+			}
+		case T_RangeTblEntry:
+			{
+				RangeTblEntry *rte = (RangeTblEntry *) node;
+
+				JUMBLE(hash, rte->rtekind);
+				JUMBLE(hash, get_relid_hash(rte->relid));
+				JUMBLE(hash, rte->jointype);
+
+				/* The content of the entry is walked by range_table_walker */
+				return false;
+			}
+		case T_Var:
+			JUMBLE(hash, ((Var *) node)->varno);
+			JUMBLE(hash, ((Var *) node)->varattno);
+			JUMBLE(hash, ((Var *) node)->varlevelsup);
+			break;
+		case T_Const:
+			JUMBLE(hash, get_object_hash(AQO_OBJECT_TYPE,
+										   ((Const *) node)->consttype));
+			break;
+		case T_Param:
+			JUMBLE(hash, ((Param *) node)->paramkind);
+			JUMBLE(hash, ((Param *) node)->paramid);
+			JUMBLE(hash, get_object_hash(AQO_OBJECT_TYPE,
+										   ((Param *) node)->paramtype));
+			break;
+		case T_Aggref:
+			JUMBLE(hash, get_object_hash(AQO_OBJECT_FUNCTION,
+										   ((Aggref *) node)->aggfnoid));
+			break;
+		case T_WindowFunc:
+			JUMBLE(hash, get_object_hash(AQO_OBJECT_FUNCTION,
+										   ((WindowFunc *) node)->winfnoid));
+			break;
+		case T_FuncExpr:
+			JUMBLE(hash, get_object_hash(AQO_OBJECT_FUNCTION,
+										   ((FuncExpr *) node)->funcid));
+			break;
+		case T_OpExpr:
+		case T_DistinctExpr:
+		case T_NullIfExpr:
+			JUMBLE(hash, get_object_hash(AQO_OBJECT_OPERATOR,
+										   ((OpExpr *) node)->opno));
+			break;
+		case T_MinMaxExpr:
+			JUMBLE(hash, ((MinMaxExpr *) node)->op);
+			JUMBLE(hash, get_object_hash(AQO_OBJECT_TYPE,
+										   ((MinMaxExpr *) node)->minmaxtype));
+			break;
+		case T_RowCompareExpr:
+			{
+				RowCompareExpr *rcexpr = (RowCompareExpr *) node;
+				ListCell   *l;
+
+				JUMBLE(hash, rcexpr->rctype);
+				foreach(l, rcexpr->opnos)
+					JUMBLE(hash, get_object_hash(AQO_OBJECT_OPERATOR,
+												   lfirst_oid(l)));
+			}
+			break;
+		case T_ScalarArrayOpExpr:
+			JUMBLE(hash, get_object_hash(AQO_OBJECT_OPERATOR,
+										   ((ScalarArrayOpExpr *) node)->opno));
+			JUMBLE(hash, ((ScalarArrayOpExpr *) node)->useOr);
+			break;
+		case T_BoolExpr:
+			JUMBLE(hash, ((BoolExpr *) node)->boolop);
+			break;
+		case T_SubLink:
+			JUMBLE(hash, ((SubLink *) node)->subLinkType);
+			break;
+		case T_SubPlan:
+			JUMBLE(hash, ((SubPlan *) node)->subLinkType);
+			JUMBLE(hash, get_object_hash(AQO_OBJECT_TYPE,
+										   ((SubPlan *) node)->firstColType));
+			break;
+		case T_CaseExpr:
+			JUMBLE(hash, get_object_hash(AQO_OBJECT_TYPE,
+										   ((CaseExpr *) node)->casetype));
+			break;
+		case T_NullTest:
+			JUMBLE(hash, ((NullTest *) node)->nulltesttype);
+			break;
+		case T_BooleanTest:
+			JUMBLE(hash, ((BooleanTest *) node)->booltesttype);
+			break;
+		case T_RelabelType:
+			JUMBLE(hash, get_object_hash(AQO_OBJECT_TYPE,
+										   ((RelabelType *) node)->resulttype));
+			break;
+		case T_CoerceViaIO:
+			JUMBLE(hash, get_object_hash(AQO_OBJECT_TYPE,
+										   ((CoerceViaIO *) node)->resulttype));
+			break;
+		case T_ArrayCoerceExpr:
+			JUMBLE(hash, get_object_hash(AQO_OBJECT_TYPE,
+										   ((ArrayCoerceExpr *) node)->resulttype));
+			break;
+		case T_CollateExpr:
+			/* OIDs of collations are used even by portable hashes */
+			JUMBLE(hash, ((CollateExpr *) node)->collOid);
+			break;
+		case T_FieldSelect:
+			JUMBLE(hash, ((FieldSelect *) node)->fieldnum);
+			break;
+		case T_TargetEntry:
+			JUMBLE(hash, ((TargetEntry *) node)->resno);
+			JUMBLE(hash, ((TargetEntry *) node)->ressortgroupref);
+			break;
+		case T_RangeTblRef:
+			JUMBLE(hash, ((RangeTblRef *) node)->rtindex);
+			break;
+		case T_JoinExpr:
+			JUMBLE(hash, ((JoinExpr *) node)->jointype);
+			JUMBLE(hash, ((JoinExpr *) node)->rtindex);
+			break;
+		case T_SetOperationStmt:
+			JUMBLE(hash, ((SetOperationStmt *) node)->op);
+			JUMBLE(hash, ((SetOperationStmt *) node)->all);
+			break;
+		default:
+			break;
+	}
+
+	return expression_tree_walker(node, jumble_walker, (void *) hash);
+}
+
+/*
+ * Mixes GROUP BY, DISTINCT or ORDER BY clauses into the hash. They aren't
+ * visited by query_tree_walker.
+ */
+static void
+jumble_sort_clauses(List *clauses, uint64 *hash)
+{
+	ListCell   *l;
+
+	foreach(l, clauses)
+	{
+		SortGroupClause *sgc = (SortGroupClause *) lfirst(l);
+
+		JUMBLE(hash, sgc->tleSortGroupRef);
+		JUMBLE(hash, get_object_hash(AQO_OBJECT_OPERATOR, sgc->sortop));
+		JUMBLE(hash, sgc->nulls_first);
+	}
+	JUMBLE(hash, list_length(clauses));
+}
+
+/*
+ * Mixes GROUPING SETS, ROLLUP or CUBE into the hash. They aren't visited by
+ * query_tree_walker either.
+ */
+static void
+jumble_grouping_sets(List *sets, uint64 *hash)
+{
+	ListCell   *l;
+
+	foreach(l, sets)
+	{
+		GroupingSet *gs = (GroupingSet *) lfirst(l);
+		ListCell   *lc;
+
+		/* The simple set lists references, the others list grouping sets */
+		JUMBLE(hash, gs->kind);
+		if (gs->kind == GROUPING_SET_SIMPLE)
+			foreach(lc, gs->content)
+				JUMBLE(hash, lfirst_int(lc));
+		else
+			jumble_grouping_sets(gs->content, hash);
+		JUMBLE(hash, list_length(gs->content));
+	}
+	JUMBLE(hash, list_length(sets));
+}
+
 /*
  * For given object (clauselist, selectivities, relidslist) creates feature
  * subspace:
  *		sets nfeatures
  *		creates and computes fss_hash
  *		transforms selectivities to features
+ *		if hashed_features is not NULL, fills it with the fixed-width encoding
+ *		of the object (see get_hashed_features)
  */
-int
+int64
 get_fss_for_object(List *clauselist, List *selectivities, List *relidslist,
-				   int *nfeatures, double **features)
+				   int *nfeatures, double **features, double *hashed_features)
 {
 	int			n;
-	int		   *clause_hashes;
-	int		   *sorted_clauses;
+	int64	   *clause_hashes;
+	int64	   *sorted_clauses;
 	int		   *idx;
 	int		   *inverse_idx;
 	bool	   *clause_has_consts;
 	int			nargs;
-	int		   *args_hash;
-	int		   *eclass_hash;
-	int			clauses_hash;
-	int			eclasses_hash;
-	int			relidslist_hash;
+	int64	   *args_hash;
+	int64	   *eclass_hash;
+	int64		clauses_hash;
+	int64		eclasses_hash;
+	int64		relidslist_hash;
 	List	  **args;
 	ListCell   *l;
 	int			i,
@@ -101,7 +430,10 @@ get_fss_for_object(List *clauselist, List *selectivities, List *relidslist,
 				m;
 	int			sh = 0,
 				old_sh;
-	int fss_hash;
+	int64		fss_hash;
+	instr_time	start;
+
+	aqo_stat_start(&start);
 
 	n = list_length(clauselist);
 
@@ -123,7 +455,7 @@ get_fss_for_object(List *clauselist, List *selectivities, List *relidslist,
 		i++;
 	}
 
-	idx = argsort(clause_hashes, n, sizeof(*clause_hashes), int_cmp);
+	idx = argsort(clause_hashes, n, sizeof(*clause_hashes), int64_cmp);
 	inverse_idx = inverse_permutation(idx, n);
 
 	i = 0;
@@ -136,6 +468,21 @@ get_fss_for_object(List *clauselist, List *selectivities, List *relidslist,
 		i++;
 	}
 
+	/*
+	 * The fixed-width encoding is built before duplicated clauses are
+	 * squeezed out, so it sees every clause of the object.
+	 */
+	if (hashed_features != NULL)
+	{
+		double	   *log_sels = palloc(sizeof(*log_sels) * n);
+
+		for (i = 0; i < n; ++i)
+			log_sels[i] = (*features)[inverse_idx[i]];
+		get_hashed_features(n, clause_hashes, log_sels, relidslist,
+							nargs, eclass_hash, hashed_features);
+		pfree(log_sels);
+	}
+
 	for (i = 0; i < n;)
 	{
 		k = 0;
@@ -162,10 +509,10 @@ get_fss_for_object(List *clauselist, List *selectivities, List *relidslist,
 	/*
 	 * Generate feature subspace hash.
 	 * XXX: Remember! that relidslist_hash isn't portable between postgres
-	 * instances.
+	 * instances unless aqo.portable_hashes is on.
 	 */
-	clauses_hash = get_int_array_hash(sorted_clauses, *nfeatures);
-	eclasses_hash = get_int_array_hash(eclass_hash, nargs);
+	clauses_hash = get_int64_array_hash(sorted_clauses, *nfeatures);
+	eclasses_hash = get_int64_array_hash(eclass_hash, nargs);
 	relidslist_hash = get_relidslist_hash(relidslist);
 	fss_hash = get_fss_hash(clauses_hash, eclasses_hash, relidslist_hash);
 
@@ -176,20 +523,81 @@ get_fss_for_object(List *clauselist, List *selectivities, List *relidslist,
 	pfree(clause_has_consts);
 	pfree(args_hash);
 	pfree(eclass_hash);
+
+	aqo_stat_add_time(AQO_STAT_GET_FSS_TIME, &start);
 	return fss_hash;
 }
 
+/*
+ * Maps the object into the vector of aqo_hashed_nfeatures elements, which
+ * does not depend on the feature subspace. So one model may be learned and
+ * used over objects of all feature subspaces.
+ *
+ * We use the hashing trick: each (clause hash, log-selectivity) pair is added
+ * into the bucket chosen by the clause hash with the sign chosen by the other
+ * bits of the same hash, so collisions cancel out on average instead of
+ * accumulating. Each relation of the object is added the same way with the
+ * unit value. The last two elements describe the join graph: the number of
+ * relations and the number of equivalence classes of the object.
+ */
+void
+get_hashed_features(int n, int64 *clause_hashes, double *log_sels,
+					List *relidslist, int nargs, int64 *eclass_hash,
+					double *features)
+{
+	ListCell   *l;
+	int64	   *eclasses;
+	int			neclasses = 0;
+	int			i;
+
+	memset(features, 0, sizeof(*features) * aqo_hashed_nfeatures);
+
+	for (i = 0; i < n; ++i)
+		hash_feature(clause_hashes[i], log_sels[i], features);
+
+	foreach(l, relidslist)
+		hash_feature(DatumGetInt64(hash_uint32_extended(
+							(uint32) get_relid_hash(lfirst_int(l)), 0)),
+					 1., features);
+
+	eclasses = palloc(sizeof(*eclasses) * (nargs + 1));
+	memcpy(eclasses, eclass_hash, sizeof(*eclasses) * nargs);
+	qsort(eclasses, nargs, sizeof(*eclasses), int64_cmp);
+	for (i = 0; i < nargs; ++i)
+		if (i == 0 || eclasses[i] != eclasses[i - 1])
+			neclasses++;
+	pfree(eclasses);
+
+	features[aqo_hashed_nfeatures - 2] = list_length(relidslist);
+	features[aqo_hashed_nfeatures - 1] = neclasses;
+}
+
+/*
+ * Adds signed value into the bucket of the hashed feature vector.
+ * Two last elements of the vector are reserved for the join graph descriptors.
+ */
+void
+hash_feature(int64 hash, double value, double *features)
+{
+	uint64		h = (uint64) hash;
+	int			bucket = h % (aqo_hashed_nfeatures - 2);
+
+	if ((h >> 63) != 0)
+		value = -value;
+	features[bucket] += value;
+}
+
 /*
  * Computes hash for given clause.
  * Hash is supposed to be constant-insensitive.
  * Also args-order-insensitiveness for equal clause is required.
  */
-int
-get_clause_hash(Expr *clause, int nargs, int *args_hash, int *eclass_hash)
+int64
+get_clause_hash(Expr *clause, int nargs, int64 *args_hash, int64 *eclass_hash)
 {
 	Expr	   *cclause;
 	List	  **args = get_clause_args_ptr(clause);
-	int			arg_eclass;
+	int64		arg_eclass;
 	ListCell   *l;
 
 	if (args == NULL)
@@ -203,8 +611,10 @@ get_clause_hash(Expr *clause, int nargs, int *args_hash, int *eclass_hash)
 									nargs, args_hash, eclass_hash);
 		if (arg_eclass != 0)
 		{
+			/* Both halves of the class hash go into the node string */
 			lfirst(l) = makeNode(Param);
-			((Param *) lfirst(l))->paramid = arg_eclass;
+			((Param *) lfirst(l))->paramid = (int) arg_eclass;
+			((Param *) lfirst(l))->paramtypmod = (int) (arg_eclass >> 32);
 		}
 	}
 	if (!clause_is_eq_clause(clause) || has_consts(*args))
@@ -215,74 +625,48 @@ get_clause_hash(Expr *clause, int nargs, int *args_hash, int *eclass_hash)
 /*
  * Computes hash for given string.
  */
-int
+int64
 get_str_hash(const char *str)
 {
-	return DatumGetInt32(hash_any((const unsigned char *) str,
-								  strlen(str) * sizeof(*str)));
+	return DatumGetInt64(hash_any_extended((const unsigned char *) str,
+										   strlen(str) * sizeof(*str), 0));
 }
 
 /*
  * Computes hash for given node.
  */
-int
+int64
 get_node_hash(Node *node)
 {
 	char	   *str;
-	int			hash;
+	int64		hash;
 
 	str = remove_locations(remove_consts(nodeToString(node)));
+	if (aqo_portable_hashes)
+		str = replace_oids(str);
 	hash = get_str_hash(str);
 	pfree(str);
 	return hash;
 }
 
 /*
- * Computes hash for given array of ints.
+ * Computes 64-bit hash for given array of ints.
  */
-int
-get_int_array_hash(int *arr, int len)
+int64
+get_int_array_hash64(int *arr, int len)
 {
-	return DatumGetInt32(hash_any((const unsigned char *) arr,
-								  len * sizeof(*arr)));
+	return DatumGetInt64(hash_any_extended((const unsigned char *) arr,
+										   len * sizeof(*arr), 0));
 }
 
 /*
- * Computes hash for given unsorted array of ints.
- * Sorts given array in-place to compute hash.
- * The hash is order-insensitive.
+ * Computes hash for given array of int64 values.
  */
-int
-get_unsorted_unsafe_int_array_hash(int *arr, int len)
+int64
+get_int64_array_hash(int64 *arr, int len)
 {
-	qsort(arr, len, sizeof(*arr), int_cmp);
-	return get_int_array_hash(arr, len);
-}
-
-/*
- * Returns for an integer list a hash which does not depend on the order
- * of elements.
- *
- * Copies given list into array, sorts it and then computes its hash
- * using 'hash_any'.
- * Frees allocated memory before returning hash.
- */
-int
-get_unordered_int_list_hash(List *lst)
-{
-	int			i = 0;
-	int			len;
-	int		   *arr;
-	ListCell   *l;
-	int			hash;
-
-	len = list_length(lst);
-	arr = palloc(sizeof(*arr) * len);
-	foreach(l, lst)
-		arr[i++] = lfirst_int(l);
-	hash = get_unsorted_unsafe_int_array_hash(arr, len);
-	pfree(arr);
-	return hash;
+	return DatumGetInt64(hash_any_extended((const unsigned char *) arr,
+										   len * sizeof(*arr), 0));
 }
 
 /*
@@ -319,26 +703,224 @@ replace_patterns(const char *str, const char *start_pattern,
  * Computes hash for given feature subspace.
  * Hash is supposed to be clause-order-insensitive.
  */
-int
-get_fss_hash(int clauses_hash, int eclasses_hash, int relidslist_hash)
+int64
+get_fss_hash(int64 clauses_hash, int64 eclasses_hash, int64 relidslist_hash)
 {
-	int			hashes[3];
+	int64		hashes[3];
 
 	hashes[0] = clauses_hash;
 	hashes[1] = eclasses_hash;
 	hashes[2] = relidslist_hash;
-	return DatumGetInt32(hash_any((const unsigned char *) hashes,
-								  3 * sizeof(*hashes)));
+	return DatumGetInt64(hash_any_extended((const unsigned char *) hashes,
+										   3 * sizeof(*hashes), 0));
 }
 
 /*
  * Computes hash for given list of relids.
  * Hash is supposed to be relids-order-insensitive.
  */
-int
+int64
 get_relidslist_hash(List *relidslist)
 {
-	return get_unordered_int_list_hash(relidslist);
+	int			i = 0;
+	int		   *arr;
+	int64	   *hashes;
+	ListCell   *l;
+	int64		hash;
+
+	if (aqo_portable_hashes)
+	{
+		hashes = palloc(sizeof(*hashes) * Max(list_length(relidslist), 1));
+		foreach(l, relidslist)
+			hashes[i++] = get_relid_hash(lfirst_int(l));
+		qsort(hashes, i, sizeof(*hashes), int64_cmp);
+		hash = DatumGetInt64(hash_any_extended((const unsigned char *) hashes,
+											   i * sizeof(*hashes), 0));
+		pfree(hashes);
+		return hash;
+	}
+
+	arr = palloc(sizeof(*arr) * Max(list_length(relidslist), 1));
+	foreach(l, relidslist)
+		arr[i++] = lfirst_int(l);
+	qsort(arr, i, sizeof(*arr), int_cmp);
+	hash = get_int_array_hash64(arr, i);
+	pfree(arr);
+	return hash;
+}
+
+/*
+ * Registers callbacks which invalidate the cache of hashes of relation names.
+ * A relation is renamed with a relcache invalidation, but a schema isn't.
+ */
+void
+init_relid_hashes(void)
+{
+	CacheRegisterRelcacheCallback(relid_hashes_relcache_callback, (Datum) 0);
+	CacheRegisterSyscacheCallback(NAMESPACEOID,
+								  relid_hashes_syscache_callback, (Datum) 0);
+}
+
+static void
+relid_hashes_relcache_callback(Datum arg, Oid relid)
+{
+	if (relid_hashes == NULL)
+		return;
+
+	if (OidIsValid(relid))
+		hash_search(relid_hashes, &relid, HASH_REMOVE, NULL);
+	else
+	{
+		hash_destroy(relid_hashes);
+		relid_hashes = NULL;
+	}
+}
+
+static void
+relid_hashes_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+	if (relid_hashes == NULL)
+		return;
+
+	hash_destroy(relid_hashes);
+	relid_hashes = NULL;
+}
+
+/*
+ * Returns the value identifying the relation in the hashes: its OID, or the
+ * hash of its schema-qualified name if aqo.portable_hashes is on. The names
+ * are cached per relid.
+ */
+static int64
+get_relid_hash(Oid relid)
+{
+	AqoRelidHash *entry;
+	bool		found;
+	char	   *relname;
+	char	   *nspname;
+	char	   *name;
+
+	if (!aqo_portable_hashes)
+		return (int64) relid;
+
+	if (relid_hashes == NULL)
+	{
+		HASHCTL		ctl;
+
+		MemSet(&ctl, 0, sizeof(ctl));
+		ctl.keysize = sizeof(Oid);
+		ctl.entrysize = sizeof(AqoRelidHash);
+		relid_hashes = hash_create("AQO relation name hashes", 64, &ctl,
+								   HASH_ELEM | HASH_BLOBS);
+	}
+
+	entry = (AqoRelidHash *) hash_search(relid_hashes, &relid, HASH_FIND,
+										 &found);
+	if (found)
+		return entry->hash;
+
+	relname = get_rel_name(relid);
+	nspname = relname ? get_namespace_name(get_rel_namespace(relid)) : NULL;
+
+	/* The relation was dropped concurrently */
+	if (relname == NULL || nspname == NULL)
+		return (int64) relid;
+
+	name = quote_qualified_identifier(nspname, relname);
+	entry = (AqoRelidHash *) hash_search(relid_hashes, &relid, HASH_ENTER,
+										 NULL);
+	entry->hash = DatumGetInt64(hash_any_extended((const unsigned char *) name,
+												  strlen(name), 0));
+	pfree(name);
+	pfree(relname);
+	pfree(nspname);
+
+	return entry->hash;
+}
+
+/*
+ * Returns the value identifying the object in the hashes: its OID, or the
+ * hash of its schema-qualified name if aqo.portable_hashes is on and the
+ * object isn't built-in.
+ */
+static int64
+get_object_hash(AqoObjectKind kind, Oid oid)
+{
+	char	   *name;
+	int64		hash;
+
+	if (kind == AQO_OBJECT_RELATION)
+		return get_relid_hash(oid);
+
+	if (!aqo_portable_hashes || oid < FirstNormalObjectId)
+		return (int64) oid;
+
+	/* A concurrently dropped object gets a placeholder name, not an error */
+	switch (kind)
+	{
+		case AQO_OBJECT_TYPE:
+			name = format_type_extended(oid, -1,
+										FORMAT_TYPE_FORCE_QUALIFY |
+										FORMAT_TYPE_ALLOW_INVALID);
+			break;
+		case AQO_OBJECT_OPERATOR:
+			name = format_operator_qualified(oid);
+			break;
+		case AQO_OBJECT_FUNCTION:
+			name = format_procedure_qualified(oid);
+			break;
+		default:
+			elog(ERROR, "unexpected object kind %d", (int) kind);
+			return 0;
+	}
+
+	hash = DatumGetInt64(hash_any_extended((const unsigned char *) name,
+										   strlen(name), 0));
+	pfree(name);
+	return hash;
+}
+
+/*
+ * Returns the copy of the text representation of the node tree in which the
+ * OIDs of relations and of other objects listed in oid_fields are replaced
+ * with the hashes of their names. Frees the given string.
+ */
+static char *
+replace_oids(char *str)
+{
+	StringInfoData buf;
+	char	   *p = str;
+	char	   *s;
+
+	initStringInfo(&buf);
+	while ((s = strchr(p, ':')) != NULL)
+	{
+		char	   *end;
+		Oid			oid;
+		size_t		i;
+
+		for (i = 0; i < lengthof(oid_fields); ++i)
+			if (strncmp(s, oid_fields[i].field,
+						strlen(oid_fields[i].field)) == 0)
+				break;
+
+		s += (i < lengthof(oid_fields)) ? strlen(oid_fields[i].field) : 1;
+		appendBinaryStringInfo(&buf, p, s - p);
+		p = s;
+		if (i == lengthof(oid_fields))
+			continue;
+
+		oid = (Oid) strtoul(s, &end, 10);
+		if (end == s)
+			continue;
+		appendStringInfo(&buf, INT64_FORMAT,
+						 get_object_hash(oid_fields[i].kind, oid));
+		p = end;
+	}
+	appendStringInfoString(&buf, p);
+	pfree(str);
+
+	return buf.data;
 }
 
 /*
@@ -366,16 +948,16 @@ remove_locations(const char *str)
 }
 
 /*
- * Returns index of given value in given sorted integer array
+ * Returns index of given value in given sorted int64 array
  * or -1 if not found.
  */
 int
-get_id_in_sorted_int_array(int val, int n, int *arr)
+get_id_in_sorted_int64_array(int64 val, int n, int64 *arr)
 {
-	int		   *i;
+	int64	   *i;
 	int			di;
 
-	i = bsearch(&val, arr, n, sizeof(*arr), int_cmp);
+	i = bsearch(&val, arr, n, sizeof(*arr), int64_cmp);
 	if (i == NULL)
 		return -1;
 
@@ -388,10 +970,10 @@ get_id_in_sorted_int_array(int val, int n, int *arr)
  * Returns class of equivalence for given argument hash or 0 if such hash
  * does not belong to any equivalence class.
  */
-int
-get_arg_eclass(int arg_hash, int nargs, int *args_hash, int *eclass_hash)
+int64
+get_arg_eclass(int64 arg_hash, int nargs, int64 *args_hash, int64 *eclass_hash)
 {
-	int			di = get_id_in_sorted_int_array(arg_hash, nargs, args_hash);
+	int			di = get_id_in_sorted_int64_array(arg_hash, nargs, args_hash);
 
 	if (di == -1)
 		return 0;
@@ -404,7 +986,7 @@ get_arg_eclass(int arg_hash, int nargs, int *args_hash, int *eclass_hash)
  * of given clauselist.
  */
 void
-get_clauselist_args(List *clauselist, int *nargs, int **args_hash)
+get_clauselist_args(List *clauselist, int *nargs, int64 **args_hash)
 {
 	RestrictInfo *rinfo;
 	List	  **args;
@@ -434,7 +1016,7 @@ get_clauselist_args(List *clauselist, int *nargs, int **args_hash)
 				if (!IsA(lfirst(l2), Const))
 				(*args_hash)[i++] = get_node_hash(lfirst(l2));
 	}
-	qsort(*args_hash, cnt, sizeof(**args_hash), int_cmp);
+	qsort(*args_hash, cnt, sizeof(**args_hash), int64_cmp);
 
 	for (i = 1; i < cnt; ++i)
 		if ((*args_hash)[i - 1] == (*args_hash)[i])
@@ -482,14 +1064,14 @@ disjoint_set_merge_eclasses(int *p, int v1, int v2)
  * Constructs disjoint set on arguments.
  */
 int *
-perform_eclasses_join(List *clauselist, int nargs, int *args_hash)
+perform_eclasses_join(List *clauselist, int nargs, int64 *args_hash)
 {
 	RestrictInfo *rinfo;
 	int		   *p;
 	ListCell   *l,
 			   *l2;
 	List	  **args;
-	int			h2;
+	int64		h2;
 	int			i2,
 				i3;
 
@@ -508,7 +1090,7 @@ perform_eclasses_join(List *clauselist, int nargs, int *args_hash)
 				if (!IsA(lfirst(l2), Const))
 				{
 					h2 = get_node_hash(lfirst(l2));
-					i2 = get_id_in_sorted_int_array(h2, nargs, args_hash);
+					i2 = get_id_in_sorted_int64_array(h2, nargs, args_hash);
 					if (i3 != -1)
 						disjoint_set_merge_eclasses(p, i2, i3);
 					i3 = i2;
@@ -525,38 +1107,45 @@ perform_eclasses_join(List *clauselist, int nargs, int *args_hash)
  * arguments of equivalence clauses of given clauselist.
  */
 void
-get_eclasses(List *clauselist, int *nargs, int **args_hash, int **eclass_hash)
+get_eclasses(List *clauselist, int *nargs, int64 **args_hash,
+			 int64 **eclass_hash)
 {
 	int		   *p;
-	List	  **lsts;
 	int			i,
-				v;
-	int		   *e_hashes;
+				j,
+				v,
+				len;
+	int64	   *members;
+	int64	   *e_hashes;
 
 	get_clauselist_args(clauselist, nargs, args_hash);
 
 	p = perform_eclasses_join(clauselist, *nargs, *args_hash);
 
-	lsts = palloc((*nargs) * sizeof(*lsts));
-	e_hashes = palloc((*nargs) * sizeof(*e_hashes));
-	for (i = 0; i < *nargs; ++i)
-		lsts[i] = NIL;
-
-	for (i = 0; i < *nargs; ++i)
+	/*
+	 * The arguments are sorted, so the members of each class are collected
+	 * in the sorted order, and the hash of the class doesn't depend on the
+	 * order of clauses.
+	 */
+	members = palloc(Max(*nargs, 1) * sizeof(*members));
+	e_hashes = palloc(Max(*nargs, 1) * sizeof(*e_hashes));
+	for (v = 0; v < *nargs; ++v)
 	{
-		v = disjoint_set_get_parent(p, i);
-		lsts[v] = lappend_int(lsts[v], (*args_hash)[i]);
+		if (disjoint_set_get_parent(p, v) != v)
+			continue;
+
+		len = 0;
+		for (j = 0; j < *nargs; ++j)
+			if (disjoint_set_get_parent(p, j) == v)
+				members[len++] = (*args_hash)[j];
+		e_hashes[v] = get_int64_array_hash(members, len);
 	}
-	for (i = 0; i < *nargs; ++i)
-		e_hashes[i] = get_unordered_int_list_hash(lsts[i]);
 
 	*eclass_hash = palloc((*nargs) * sizeof(**eclass_hash));
 	for (i = 0; i < *nargs; ++i)
 		(*eclass_hash)[i] = e_hashes[disjoint_set_get_parent(p, i)];
 
-	for (i = 0; i < *nargs; ++i)
-		list_free(lsts[i]);
-	pfree(lsts);
+	pfree(members);
 	pfree(p);
 	pfree(e_hashes);
 }
@@ -0,0 +1,501 @@
+/*
+ *******************************************************************************
+ *
+ *	EXPORT AND IMPORT OF THE KNOWLEDGE BASE
+ *
+ * aqo_export() writes the content of the AQO service relations into a file,
+ * and aqo_import() replaces the knowledge base with the content of such file,
+ * e. g. to warm-start a fresh server. Rows are stored in the binary format of
+ * their row types, so the import checks the types of all columns. The file
+ * layout is:
+ *
+ *		magic, format version, number of relations
+ *		layout of the models: number of parameters of the neural network,
+ *		number of hashed features, number of models per feature subspace
+ *		for each relation: length and name, then the rows, each one as its
+ *		length and the binary representation; zero length ends the relation
+ *		CRC-32C of all the preceding bytes
+ *
+ * The checksum and the layout are verified before the knowledge base is
+ * changed, and the models of each row of aqo_data are checked against the
+ * number of its features and the layout. Rows are inserted in batches, like
+ * COPY does, so the triggers aren't fired.
+ * Hashes of the knowledge base depend on OIDs of relations, so a file is
+ * valid for another server only if both use aqo.portable_hashes.
+ *
+ *******************************************************************************
+ *
+ * Copyright (c) 2016-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  aqo/import_export.c
+ *
+ */
+
+#include <sys/stat.h>
+
+#include "aqo.h"
+#include "access/heapam.h"
+#include "access/table.h"
+#include "access/tableam.h"
+#include "access/xact.h"
+#include "catalog/pg_authid.h"
+#include "executor/executor.h"
+#include "miscadmin.h"
+#include "port/pg_crc32c.h"
+#include "storage/fd.h"
+#include "utils/acl.h"
+#include "utils/snapmgr.h"
+
+#define AQO_EXPORT_MAGIC		(0x41514F4B)
+#define AQO_EXPORT_VERSION		(2)
+
+/* Number of uint32 values of the header */
+#define AQO_EXPORT_HEADER_SIZE	(6)
+
+/* Number of rows inserted by one call of table_multi_insert */
+#define AQO_IMPORT_BATCH_SIZE	(1000)
+
+/* The relations in the order of import, the referenced one goes first */
+static const char *const kb_relations[] = {
+	"aqo_queries",
+	"aqo_query_texts",
+	"aqo_query_stat",
+	"aqo_data"
+};
+
+#define AQO_KB_NRELATIONS	lengthof(kb_relations)
+
+/* State of the file being written or read */
+typedef struct
+{
+	FILE	   *file;
+	const char *path;
+	pg_crc32c	crc;
+} KbFile;
+
+static void kb_write(KbFile *kf, const void *data, size_t len);
+static void kb_read(KbFile *kf, void *data, size_t len);
+static uint32 kb_read_uint32(KbFile *kf);
+static void kb_verify_checksum(KbFile *kf);
+static int64 export_relation(KbFile *kf, Relation rel);
+static void clear_relation(Relation rel);
+static int64 import_relation(KbFile *kf, Relation rel);
+
+
+static void
+kb_write(KbFile *kf, const void *data, size_t len)
+{
+	if (fwrite(data, 1, len, kf->file) != len)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", kf->path)));
+	COMP_CRC32C(kf->crc, data, len);
+}
+
+static void
+kb_read(KbFile *kf, void *data, size_t len)
+{
+	if (fread(data, 1, len, kf->file) != len)
+	{
+		if (ferror(kf->file))
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m", kf->path)));
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("unexpected end of file \"%s\"", kf->path)));
+	}
+	COMP_CRC32C(kf->crc, data, len);
+}
+
+static uint32
+kb_read_uint32(KbFile *kf)
+{
+	uint32		value;
+
+	kb_read(kf, &value, sizeof(value));
+	return value;
+}
+
+/*
+ * Reads the whole file and checks its trailing checksum, then rewinds it.
+ */
+static void
+kb_verify_checksum(KbFile *kf)
+{
+	struct stat st;
+	char		buf[BLCKSZ];
+	off_t		remains;
+	pg_crc32c	stored;
+
+	if (fstat(fileno(kf->file), &st) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m", kf->path)));
+
+	if (st.st_size < (off_t) (AQO_EXPORT_HEADER_SIZE * sizeof(uint32) +
+							  sizeof(pg_crc32c)))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("file \"%s\" is too short", kf->path)));
+
+	INIT_CRC32C(kf->crc);
+	for (remains = st.st_size - sizeof(pg_crc32c); remains > 0;)
+	{
+		size_t		len = Min(remains, (off_t) sizeof(buf));
+
+		kb_read(kf, buf, len);
+		remains -= len;
+	}
+	FIN_CRC32C(kf->crc);
+
+	if (fread(&stored, sizeof(stored), 1, kf->file) != 1 ||
+		!EQ_CRC32C(stored, kf->crc))
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("checksum mismatch in file \"%s\"", kf->path)));
+
+	rewind(kf->file);
+	INIT_CRC32C(kf->crc);
+}
+
+/*
+ * Writes all visible rows of the relation. Returns the number of rows.
+ */
+static int64
+export_relation(KbFile *kf, Relation rel)
+{
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	const char *name = RelationGetRelationName(rel);
+	uint32		len = strlen(name);
+	TableScanDesc scan;
+	HeapTuple	tuple;
+	Oid			typsend;
+	bool		typisvarlena;
+	FmgrInfo	flinfo;
+	MemoryContext tmpcxt;
+	MemoryContext oldcxt;
+	int64		nrows = 0;
+
+	getTypeBinaryOutputInfo(rel->rd_rel->reltype, &typsend, &typisvarlena);
+	fmgr_info(typsend, &flinfo);
+
+	kb_write(kf, &len, sizeof(len));
+	kb_write(kf, name, len);
+
+	tmpcxt = AllocSetContextCreate(CurrentMemoryContext,
+								   "AQO export",
+								   ALLOCSET_DEFAULT_SIZES);
+
+	scan = table_beginscan(rel, GetActiveSnapshot(), 0, NULL);
+	while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL)
+	{
+		bytea	   *data;
+
+		oldcxt = MemoryContextSwitchTo(tmpcxt);
+		data = SendFunctionCall(&flinfo,
+								heap_copy_tuple_as_datum(tuple, tupdesc));
+		len = VARSIZE(data) - VARHDRSZ;
+		kb_write(kf, &len, sizeof(len));
+		kb_write(kf, VARDATA(data), len);
+		MemoryContextSwitchTo(oldcxt);
+		MemoryContextReset(tmpcxt);
+		nrows++;
+	}
+	table_endscan(scan);
+	MemoryContextDelete(tmpcxt);
+
+	/* The binary representation of a row is never empty */
+	len = 0;
+	kb_write(kf, &len, sizeof(len));
+
+	return nrows;
+}
+
+/*
+ * Deletes all rows of the relation.
+ */
+static void
+clear_relation(Relation rel)
+{
+	TableScanDesc scan;
+	HeapTuple	tuple;
+
+	scan = table_beginscan(rel, SnapshotSelf, 0, NULL);
+	while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL)
+		simple_heap_delete(rel, &tuple->t_self);
+	table_endscan(scan);
+}
+
+/*
+ * Reads the rows of the relation and inserts them in batches, updating the
+ * indexes like COPY FROM does. Returns the number of rows.
+ */
+static int64
+import_relation(KbFile *kf, Relation rel)
+{
+	TupleDesc	tupdesc = RelationGetDescr(rel);
+	const char *name = RelationGetRelationName(rel);
+	uint32		len;
+	char	   *stored_name;
+	Oid			typreceive;
+	Oid			typioparam;
+	FmgrInfo	flinfo;
+	EState	   *estate;
+	ResultRelInfo *resultRelInfo;
+	BulkInsertState bistate;
+	CommandId	cid = GetCurrentCommandId(true);
+	TupleTableSlot *slots[AQO_IMPORT_BATCH_SIZE];
+	MemoryContext batchcxt;
+	MemoryContext oldcxt;
+	bool		is_aqo_data = (strcmp(name, "aqo_data") == 0);
+	int			nslots = 0;
+	int			i;
+	int64		nrows = 0;
+
+	len = kb_read_uint32(kf);
+	if (len > NAMEDATALEN)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid relation name in file \"%s\"", kf->path)));
+	stored_name = palloc0(len + 1);
+	kb_read(kf, stored_name, len);
+	if (strcmp(stored_name, name) != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("file \"%s\" contains relation \"%s\" instead of \"%s\"",
+						kf->path, stored_name, name)));
+	pfree(stored_name);
+
+	getTypeBinaryInputInfo(rel->rd_rel->reltype, &typreceive, &typioparam);
+	fmgr_info(typreceive, &flinfo);
+
+	estate = CreateExecutorState();
+	resultRelInfo = makeNode(ResultRelInfo);
+	InitResultRelInfo(resultRelInfo, rel, 1, NULL, 0);
+	ExecOpenIndices(resultRelInfo, false);
+	estate->es_result_relations = resultRelInfo;
+	estate->es_num_result_relations = 1;
+	estate->es_result_relation_info = resultRelInfo;
+
+	bistate = GetBulkInsertState();
+	for (i = 0; i < AQO_IMPORT_BATCH_SIZE; i++)
+		slots[i] = table_slot_create(rel, NULL);
+
+	batchcxt = AllocSetContextCreate(CurrentMemoryContext,
+									 "AQO import batch",
+									 ALLOCSET_DEFAULT_SIZES);
+
+	for (;;)
+	{
+		StringInfoData buf;
+		HeapTupleData tuple;
+		HeapTupleHeader td;
+		bool		done;
+
+		len = kb_read_uint32(kf);
+		done = (len == 0);
+
+		if (!done)
+		{
+			TupleTableSlot *slot = slots[nslots];
+
+			if (len > MaxAllocSize)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_CORRUPTED),
+						 errmsg("invalid row length in file \"%s\"",
+								kf->path)));
+
+			oldcxt = MemoryContextSwitchTo(batchcxt);
+			initStringInfo(&buf);
+			enlargeStringInfo(&buf, len);
+			kb_read(kf, buf.data, len);
+			buf.len = len;
+			buf.data[len] = '\0';
+
+			/* Checks the number and the types of the columns */
+			td = DatumGetHeapTupleHeader(ReceiveFunctionCall(&flinfo, &buf,
+															 typioparam, -1));
+			if (buf.cursor != buf.len)
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_CORRUPTED),
+						 errmsg("invalid row of relation \"%s\" in file \"%s\"",
+								name, kf->path)));
+
+			tuple.t_len = HeapTupleHeaderGetDatumLength(td);
+			ItemPointerSetInvalid(&tuple.t_self);
+			tuple.t_tableOid = InvalidOid;
+			tuple.t_data = td;
+
+			ExecClearTuple(slot);
+			heap_deform_tuple(&tuple, tupdesc, slot->tts_values,
+							  slot->tts_isnull);
+			if (is_aqo_data &&
+				!aqo_data_row_is_valid(slot->tts_values, slot->tts_isnull))
+				ereport(ERROR,
+						(errcode(ERRCODE_DATA_CORRUPTED),
+						 errmsg("invalid models in row of relation \"%s\" in file \"%s\"",
+								name, kf->path)));
+			ExecStoreVirtualTuple(slot);
+			MemoryContextSwitchTo(oldcxt);
+
+			nslots++;
+			nrows++;
+		}
+
+		if (nslots == AQO_IMPORT_BATCH_SIZE || (done && nslots > 0))
+		{
+			table_multi_insert(rel, slots, nslots, cid, 0, bistate);
+			for (i = 0; i < nslots; i++)
+			{
+				list_free(ExecInsertIndexTuples(slots[i], estate, false,
+												NULL, NIL));
+				ExecClearTuple(slots[i]);
+			}
+			nslots = 0;
+			MemoryContextReset(batchcxt);
+		}
+
+		if (done)
+			break;
+	}
+
+	for (i = 0; i < AQO_IMPORT_BATCH_SIZE; i++)
+		ExecDropSingleTupleTableSlot(slots[i]);
+	FreeBulkInsertState(bistate);
+	MemoryContextDelete(batchcxt);
+	ExecCloseIndices(resultRelInfo);
+	FreeExecutorState(estate);
+
+	return nrows;
+}
+
+PG_FUNCTION_INFO_V1(aqo_export);
+
+/*
+ * Writes the knowledge base into the file. Returns the number of rows.
+ */
+Datum
+aqo_export(PG_FUNCTION_ARGS)
+{
+	char	   *path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	KbFile		kf;
+	uint32		header[AQO_EXPORT_HEADER_SIZE] = {
+		AQO_EXPORT_MAGIC, AQO_EXPORT_VERSION, AQO_KB_NRELATIONS,
+		nn_nparams(), aqo_hashed_nfeatures, AQO_NMODELS
+	};
+	int64		nrows = 0;
+	int			i;
+
+	if (!is_member_of_role(GetUserId(), DEFAULT_ROLE_WRITE_SERVER_FILES))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser or a member of the pg_write_server_files role to export the AQO knowledge base")));
+
+	if (!is_absolute_path(path))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_NAME),
+				 errmsg("relative path not allowed for aqo_export")));
+
+	kf.path = path;
+	kf.file = AllocateFile(path, PG_BINARY_W);
+	if (kf.file == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\" for writing: %m", path)));
+
+	INIT_CRC32C(kf.crc);
+	kb_write(&kf, header, sizeof(header));
+
+	for (i = 0; i < AQO_KB_NRELATIONS; i++)
+	{
+		Relation	rel;
+
+		rel = table_openrv(makeRangeVar("public", (char *) kb_relations[i], -1),
+						   AccessShareLock);
+		nrows += export_relation(&kf, rel);
+		table_close(rel, AccessShareLock);
+	}
+
+	FIN_CRC32C(kf.crc);
+	if (fwrite(&kf.crc, sizeof(kf.crc), 1, kf.file) != 1 || FreeFile(kf.file))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", path)));
+
+	PG_RETURN_INT64(nrows);
+}
+
+PG_FUNCTION_INFO_V1(aqo_import);
+
+/*
+ * Replaces the knowledge base with the content of the file written by
+ * aqo_export. Returns the number of rows.
+ */
+Datum
+aqo_import(PG_FUNCTION_ARGS)
+{
+	char	   *path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	KbFile		kf;
+	Relation	rels[AQO_KB_NRELATIONS];
+	int64		nrows = 0;
+	int			i;
+
+	if (!is_member_of_role(GetUserId(), DEFAULT_ROLE_READ_SERVER_FILES))
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("must be superuser or a member of the pg_read_server_files role to import the AQO knowledge base")));
+
+	kf.path = path;
+	kf.file = AllocateFile(path, PG_BINARY_R);
+	if (kf.file == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\" for reading: %m", path)));
+
+	kb_verify_checksum(&kf);
+
+	if (kb_read_uint32(&kf) != AQO_EXPORT_MAGIC)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("file \"%s\" isn't an AQO knowledge base", path)));
+	if (kb_read_uint32(&kf) != AQO_EXPORT_VERSION ||
+		kb_read_uint32(&kf) != AQO_KB_NRELATIONS)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("unsupported format version of file \"%s\"", path)));
+	if (kb_read_uint32(&kf) != (uint32) nn_nparams() ||
+		kb_read_uint32(&kf) != aqo_hashed_nfeatures ||
+		kb_read_uint32(&kf) != AQO_NMODELS)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("file \"%s\" has other layout of models", path),
+				 errdetail("The file was written by another version of AQO.")));
+
+	/* Concurrent learning must not interleave with the import */
+	for (i = 0; i < AQO_KB_NRELATIONS; i++)
+		rels[i] = table_openrv(makeRangeVar("public", (char *) kb_relations[i],
+											-1),
+							   ShareRowExclusiveLock);
+
+	for (i = AQO_KB_NRELATIONS - 1; i >= 0; i--)
+		clear_relation(rels[i]);
+	CommandCounterIncrement();
+
+	for (i = 0; i < AQO_KB_NRELATIONS; i++)
+		nrows += import_relation(&kf, rels[i]);
+
+	for (i = 0; i < AQO_KB_NRELATIONS; i++)
+		table_close(rels[i], NoLock);
+	FreeFile(kf.file);
+
+	CommandCounterIncrement();
+
+	/* aqo_queries and aqo_data were changed without their triggers */
+	invalidate_query_settings_cache();
+	shared_models_invalidate_all();
+	invalidate_fss_models_cache();
+
+	PG_RETURN_INT64(nrows);
+}
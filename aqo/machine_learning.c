@@ -6,9 +6,20 @@
  * This module does not know anything about DBMS, cardinalities and all other
  * stuff. It learns matrices, predicts values and is quite happy.
  * The proposed method is designed for working with limited number of objects.
- * It is guaranteed that number of rows in the matrix will not exceed aqo_K
- * setting after learning procedure. This property also allows to adapt to
- * workloads which properties are slowly changed.
+ * It is guaranteed that number of rows in the matrix will not exceed
+ * aqo.knn_capacity setting after learning procedure. This property also allows
+ * to adapt to workloads which properties are slowly changed. Many stored
+ * objects with few features are indexed by k-d tree, so the neighbors search
+ * is sub-linear and the capacity may be large. Otherwise the linear scan is
+ * faster. Objects moved by learning are searched linearly, and the tree is
+ * rebuilt only when there are many of them.
+ *
+ * Each feature subspace is served by several models learned over the same
+ * objects: ridge regression, k-nearest neighbors regression and the neural
+ * network shared by all feature subspaces of the feature space. For each
+ * feature subspace we track the running error of each model and predict with
+ * the cheapest model whose error is within aqo.model_selection_tolerance of
+ * the best one.
  *
  *******************************************************************************
  *
@@ -19,46 +30,878 @@
  *
  */
 
-#include "aqo.h"
+#include "machine_learning.h"
+
+/*
+ * This parameter tell us that the new learning sample object has very small
+ * distance from one whose features stored in matrix already.
+ * In this case we will not to add new line in matrix, but will modify this
+ * nearest neighbor features and cardinality with linear smoothing by
+ * learning_rate coefficient.
+ */
+const double	object_selection_threshold = 0.1;
+const double	learning_rate = 1e-1;
+
+/* The number of nearest neighbors which will be chosen for ML-operations */
+int			aqo_k = 3;
+
+/* Number of gradient descent steps of the neural network per object */
+#define NN_LEARN_ITERATIONS	(10)
 
+/*
+ * The k-d tree is used only for so many objects and less features, as
+ * measured by bench/ml_bench.c. The tree is rebuilt when more than the
+ * fraction of the objects have moved out of their regions.
+ */
+#define KD_MIN_ROWS			(64)
+#define KD_MAX_COLS			(12)
+#define KD_MOVED_FRACTION	(8)
+
+static double fs_distance(double *a, double *b, int len);
+static double fs_similarity(double dist);
+static double compute_weights(double *distances, int nneighbors, double *w);
+
+static bool kd_contains(AqoFssModel *model, int row);
+static bool model_is_ready(AQO_MODEL kind, AqoFssModel *model, bool use_nn);
+static double model_cost(AQO_MODEL kind, AqoFssModel *model);
+
+
+/*
+ * Computes L2-distance between two given vectors.
+ */
 double
-rg_predict(int ncols, double *weights, double *features)
+fs_distance(double *a, double *b, int len)
+{
+	double		res = 0;
+	int			i;
+
+	for (i = 0; i < len; ++i)
+		res += (a[i] - b[i]) * (a[i] - b[i]);
+	if (len != 0)
+		res = sqrt(res / len);
+	return res;
+}
+
+/*
+ * Returns similarity between objects based on distance between them.
+ */
+double
+fs_similarity(double dist)
+{
+	return 1.0 / (0.001 + dist);
+}
+
+/*
+ * Compute weights of the nearest neighbors necessary for both prediction and
+ * learning.
+ * Returns the sum of the weights.
+ */
+double
+compute_weights(double *distances, int nneighbors, double *w)
+{
+	double	w_sum = 0;
+	int		j;
+
+	for (j = 0; j < nneighbors; ++j)
+	{
+		w[j] = fs_similarity(distances[j]);
+		w_sum += w[j];
+	}
+	return w_sum;
+}
+
+/*
+ * Inserts the row into the list of k nearest neighbors sorted by distance.
+ */
+static void
+knn_insert(int k, int *idx, double *distances, int *n, int row, double dist)
+{
+	int			i;
+
+	if (*n == k && dist >= distances[k - 1])
+		return;
+
+	i = (*n < k) ? (*n)++ : k - 1;
+	for (; i > 0 && distances[i - 1] > dist; --i)
+	{
+		idx[i] = idx[i - 1];
+		distances[i] = distances[i - 1];
+	}
+	idx[i] = row;
+	distances[i] = dist;
+}
+
+/*
+ * Searches the k-d subtree for the k nearest neighbors of the object.
+ * The subtree on the far side of the split plane is skipped if the plane is
+ * farther than the current k-th neighbor.
+ */
+static void
+kd_search(AqoFssModel *model, int node, int depth, double *features,
+		  int k, int *idx, double *distances, int *n)
+{
+	int			near;
+	int			far;
+	double		diff;
+
+	if (node < 0)
+		return;
+
+	/* The moved objects are checked separately */
+	if (!model->kd_is_moved[node])
+		knn_insert(k, idx, distances, n, node,
+				   fs_distance(model->matrix[node], features, model->ncols));
+
+	if (model->ncols == 0)
+	{
+		/* All objects are equal, any neighbor will do */
+		kd_search(model, model->kd_left[node], depth + 1, features,
+				  k, idx, distances, n);
+		kd_search(model, model->kd_right[node], depth + 1, features,
+				  k, idx, distances, n);
+		return;
+	}
+
+	diff = features[depth % model->ncols] - model->kd_split[node];
+	near = (diff < 0) ? model->kd_left[node] : model->kd_right[node];
+	far = (diff < 0) ? model->kd_right[node] : model->kd_left[node];
+
+	kd_search(model, near, depth + 1, features, k, idx, distances, n);
+	if (*n < k || fabs(diff) / sqrt(model->ncols) < distances[*n - 1])
+		kd_search(model, far, depth + 1, features, k, idx, distances, n);
+}
+
+/*
+ * Finds at most k nearest stored objects. Their indexes and distances are
+ * returned in idx and distances sorted by distance.
+ * Returns the number of found neighbors.
+ */
+static int
+knn_search(AqoFssModel *model, double *features, int k,
+		   int *idx, double *distances)
 {
-    int i;
+	int			n = 0;
+	int			i;
 
-    double res = 0;
+	if (model->kd_root < 0)
+	{
+		for (i = 0; i < model->rows; ++i)
+			knn_insert(k, idx, distances, &n, i,
+					   fs_distance(model->matrix[i], features, model->ncols));
+		return n;
+	}
+
+	kd_search(model, model->kd_root, 0, features, k, idx, distances, &n);
+	for (i = 0; i < model->kd_nmoved; ++i)
+		knn_insert(k, idx, distances, &n, model->kd_moved[i],
+				   fs_distance(model->matrix[model->kd_moved[i]], features,
+							   model->ncols));
+	return n;
+}
+
+/*
+ * Is the k-d tree faster than the linear scan for the model?
+ */
+bool
+kd_is_useful(AqoFssModel *model)
+{
+	return model->rows >= KD_MIN_ROWS && model->ncols > 0 &&
+		   model->ncols <= KD_MAX_COLS;
+}
+
+/*
+ * Notes that learning has changed features of the object. If it has left
+ * the region of its node, it is searched linearly; if there are too many
+ * such objects, the tree is rebuilt.
+ */
+static void
+kd_moved(AqoFssModel *model, int row)
+{
+	if (model->kd_root < 0 || model->kd_is_moved[row] || kd_contains(model, row))
+		return;
+
+	model->kd_is_moved[row] = true;
+	model->kd_moved[model->kd_nmoved++] = row;
+	if (model->kd_nmoved > model->rows / KD_MOVED_FRACTION)
+		kd_build(model);
+}
+
+/*
+ * Adds the row into the k-d tree.
+ * Returns depth of the new node.
+ */
+static int
+kd_insert(AqoFssModel *model, int row)
+{
+	double	   *features = model->matrix[row];
+	int			ncols = model->ncols;
+	int			depth = 0;
+	int		   *link = &model->kd_root;
+
+	while (*link >= 0)
+	{
+		int			node = *link;
+
+		if (ncols > 0 && features[depth % ncols] < model->kd_split[node])
+			link = &model->kd_left[node];
+		else
+			link = &model->kd_right[node];
+		depth++;
+	}
+
+	*link = row;
+	model->kd_left[row] = -1;
+	model->kd_right[row] = -1;
+	model->kd_split[row] = (ncols > 0) ? features[depth % ncols] : 0.;
+	return depth;
+}
+
+/*
+ * Checks that the moved row is still reachable by its features, i. e. the
+ * k-d tree is valid.
+ */
+static bool
+kd_contains(AqoFssModel *model, int row)
+{
+	double	   *features = model->matrix[row];
+	int			ncols = model->ncols;
+	int			depth = 0;
+	int			node = model->kd_root;
+
+	while (node >= 0 && node != row)
+	{
+		if (ncols > 0 && features[depth % ncols] < model->kd_split[node])
+			node = model->kd_left[node];
+		else
+			node = model->kd_right[node];
+		depth++;
+	}
+	return node == row;
+}
+
+typedef struct
+{
+	AqoFssModel *model;
+	int			dim;
+} kd_sort_context;
+
+static int
+kd_compare(const void *a, const void *b, void *arg)
+{
+	kd_sort_context *cxt = (kd_sort_context *) arg;
+	double		fa = cxt->model->matrix[*(const int *) a][cxt->dim];
+	double		fb = cxt->model->matrix[*(const int *) b][cxt->dim];
+
+	return (fa > fb) - (fa < fb);
+}
+
+/*
+ * Builds balanced k-d subtree of the rows and returns its root.
+ */
+static int
+kd_build_subtree(AqoFssModel *model, int *rows, int nrows, int depth)
+{
+	kd_sort_context cxt;
+	int			mid = nrows / 2;
+	int			node;
+
+	if (nrows == 0)
+		return -1;
+
+	if (model->ncols > 0)
+	{
+		double	   *features;
+
+		cxt.model = model;
+		cxt.dim = depth % model->ncols;
+		qsort_arg(rows, nrows, sizeof(*rows), kd_compare, &cxt);
+
+		/* Objects equal to the split value must go to the right subtree */
+		features = model->matrix[rows[mid]];
+		while (mid > 0 &&
+			   model->matrix[rows[mid - 1]][cxt.dim] == features[cxt.dim])
+			mid--;
+	}
+
+	node = rows[mid];
+	model->kd_split[node] = (model->ncols > 0) ?
+							model->matrix[node][depth % model->ncols] : 0.;
+	model->kd_left[node] = kd_build_subtree(model, rows, mid, depth + 1);
+	model->kd_right[node] = kd_build_subtree(model, rows + mid + 1,
+											 nrows - mid - 1, depth + 1);
+	return node;
+}
+
+/*
+ * Rebuilds balanced k-d tree over all stored objects, or drops it if the
+ * linear scan is faster.
+ */
+void
+kd_build(AqoFssModel *model)
+{
+	int		   *rows;
+	int			i;
+
+	for (i = 0; i < model->kd_nmoved; ++i)
+		model->kd_is_moved[model->kd_moved[i]] = false;
+	model->kd_nmoved = 0;
+
+	if (!kd_is_useful(model))
+	{
+		model->kd_root = -1;
+		return;
+	}
+
+	rows = palloc(sizeof(*rows) * model->rows);
+	for (i = 0; i < model->rows; ++i)
+		rows[i] = i;
+	model->kd_root = kd_build_subtree(model, rows, model->rows, 0);
+	pfree(rows);
+}
+
+/*
+ * With given models, and features makes prediction for current object.
+ *
+ * Returns negative value in the case of refusal to make a prediction, because
+ * positive targets are assumed.
+ */
+double
+OkNNr_predict(AqoFssModel *model, double *features)
+{
+	int			idx[aqo_K];
+	double		distances[aqo_K];
+	double		w[aqo_K];
+	double		w_sum;
+	double		result = 0;
+	int			n;
+	int			i;
+
+	n = knn_search(model, features, aqo_k, idx, distances);
+
+	/* this should never happen */
+	if (n == 0)
+		return -1;
+
+	w_sum = compute_weights(distances, n, w);
+	for (i = 0; i < n; ++i)
+		result += model->targets[idx[i]] * w[i] / w_sum;
+
+	if (result < 0)
+		result = 0;
+
+	return result;
+}
+
+/*
+ * Returns the distance from the object to the nearest stored one or -1 if
+ * nothing is stored.
+ */
+double
+OkNNr_nearest_distance(AqoFssModel *model, double *features)
+{
+	int			idx;
+	double		distance;
 
-    for (i=0;i<ncols;i++){
-        res = res + features[i] * weights[i];
-    }
-    res = res + weights[ncols];
-    return res;
+	if (knn_search(model, features, 1, &idx, &distance) == 0)
+		return -1;
+	return distance;
 }
 
+/*
+ * Modifies stored objects of the model using features and target value of
+ * new object.
+ * Returns the new number of stored objects.
+ */
+int
+OkNNr_learn(AqoFssModel *model, double *features, double target)
+{
+	int			nfeatures = model->ncols;
+	int			idx[aqo_K];
+	double		distances[aqo_K];
+	int			n;
+	int			i,
+				j;
+	int			mid; /* index of row with minimum distance value */
+
+	n = knn_search(model, features, aqo_k, idx, distances);
+	mid = (n > 0) ? idx[0] : -1;
+
+	/*
+	 * We do not want to add new very similar neighbor. And we can't
+	 * replace data for the neighbor to avoid some fluctuations.
+	 * We will change it's row with linear smoothing by learning_rate.
+	 */
+	if (n > 0 && distances[0] < object_selection_threshold)
+	{
+		for (j = 0; j < nfeatures; ++j)
+			model->matrix[mid][j] += learning_rate *
+									 (features[j] - model->matrix[mid][j]);
+		model->targets[mid] += learning_rate * (target - model->targets[mid]);
+
+		kd_moved(model, mid);
+		return model->rows;
+	}
+
+	if (model->rows < aqo_knn_capacity)
+	{
+		/* We can't reached limit of stored neighbors */
+		int			row = model->rows;
+
+		fss_model_reserve(model, row + 1);
+		for (j = 0; j < nfeatures; ++j)
+			model->matrix[row][j] = features[j];
+		model->targets[row] = target;
+		model->kd_is_moved[row] = false;
+		model->rows++;
+
+		/*
+		 * The tree is built when there are enough objects for it, and is
+		 * rebuilt if the insertion order was unlucky.
+		 */
+		if (model->kd_root < 0)
+		{
+			if (kd_is_useful(model))
+				kd_build(model);
+		}
+		else if (kd_insert(model, row) >
+				 2 * (int) ceil(log2(model->rows + 1)) + 2)
+			kd_build(model);
+
+		return model->rows;
+	}
+	else
+	{
+		double	*feature;
+		double	avg_target = 0;
+		double	tc_coef; /* Target correction coefficient */
+		double	fc_coef; /* Feature correction coefficient */
+		double	w[aqo_K];
+		double	w_sum;
+
+		/*
+		 * We reaches limit of stored neighbors and can't simply add new line
+		 * at the matrix. Also, we can't simply delete one of the stored
+		 * neighbors.
+		 */
+
+		/*
+		 * Compute weight for each nearest neighbor and total weight
+		 * of all nearest neighbor.
+		 */
+		w_sum = compute_weights(distances, n, w);
+
+		/*
+		 * Compute average value for target by nearest neighbors.
+		 * Semantics of coef1: it is defined distance between new object and
+		 * this superposition value (with linear smoothing).
+		 * */
+		for (i = 0; i < n; ++i)
+			avg_target += model->targets[idx[i]] * w[i] / w_sum;
+		tc_coef = learning_rate * (avg_target - target);
+
+		/* Modify targets and features of each nearest neighbor row. */
+		for (i = 0; i < n; ++i)
+		{
+			fc_coef = tc_coef * (model->targets[idx[i]] - avg_target) *
+				w[i] * w[i] / sqrt(nfeatures) / w_sum;
+
+			model->targets[idx[i]] -= tc_coef * w[i] / w_sum;
+			for (j = 0; j < nfeatures; ++j)
+			{
+				feature = model->matrix[idx[i]];
+				feature[j] -= fc_coef * (features[j] - feature[j]) /
+					distances[i];
+			}
+		}
+
+		/* The neighbors have moved */
+		for (i = 0; i < n; ++i)
+			kd_moved(model, idx[i]);
+	}
+
+	return model->rows;
+}
+
+/*
+ * Predicts target value of the object with the linear model.
+ * 'weights' has ncols + 1 elements, the last one is the intercept.
+ */
+double
+rg_predict(int ncols, double *weights, double *features)
+{
+	double	res = 0;
+	int		i;
+
+	for (i = 0; i < ncols; ++i)
+		res += features[i] * weights[i];
+	res += weights[ncols];
+	return res;
+}
+
+/*
+ * Updates weights of the linear model by gradient descent steps over
+ * the ridge loss on the given object.
+ * Returns the number of features.
+ */
 int
-rg_learn(int nfeatures, double *weights,
-			double *features, double target)
-{
-	double *tgrad = malloc((nfeatures+1) * sizeof(double));
-    	double htheta;
-    	double err;
-    	int j,k;
-
-    	for (k=0;k<100;k++){
-              htheta = 0;
-              for (j=0;j<nfeatures;j++){
-                 htheta = htheta + features[j]*weights[j];
-              }
-              htheta = htheta + weights[nfeatures];
-	      err = htheta - target;
-              for (j=0;j<nfeatures;j++){
-                 tgrad[j] = 2*err*features[j]+2*0.001*weights[j];
-                 weights[j] = weights[j] - 0.001*tgrad[j];
-              }
-              tgrad[nfeatures] = 2*err+2*0.001*weights[nfeatures];
-              weights[nfeatures] = weights[nfeatures] - 0.001*tgrad[nfeatures];
-           }
-
-
-	return nfeatures;
+rg_learn(int ncols, double *weights, double *features, double target)
+{
+	double	htheta;
+	double	err;
+	int		j,
+			k;
+
+	for (k = 0; k < 100; ++k)
+	{
+		htheta = rg_predict(ncols, weights, features);
+		err = htheta - target;
+		for (j = 0; j < ncols; ++j)
+			weights[j] -= 0.001 * (2 * err * features[j] + 2 * 0.001 * weights[j]);
+		weights[ncols] -= 0.001 * (2 * err + 2 * 0.001 * weights[ncols]);
+	}
+
+	return ncols;
+}
+
+/*****************************************************************************
+ *
+ *	MODEL SELECTION
+ *
+ *****************************************************************************/
+
+/*
+ * Allocates empty models of the feature subspace with ncols features.
+ */
+AqoFssModel *
+palloc_fss_model(int ncols)
+{
+	AqoFssModel *model = palloc0(sizeof(AqoFssModel));
+	int			i;
+
+	model->ncols = ncols;
+	model->rows = 0;
+	model->capacity = 0;
+	model->kd_root = -1;
+	model->kd_nmoved = 0;
+	fss_model_reserve(model, Min(aqo_knn_capacity, aqo_K));
+	model->weights = palloc0(sizeof(*model->weights) * (ncols + 1));
+	model->nn = NULL;
+	for (i = 0; i < AQO_NMODELS; ++i)
+		model->errors[i] = -1.;
+
+	return model;
+}
+
+/*
+ * Frees models of the feature subspace.
+ */
+void
+pfree_fss_model(AqoFssModel *model)
+{
+	int			i;
+
+	for (i = 0; i < model->capacity; ++i)
+		pfree(model->matrix[i]);
+	pfree(model->matrix);
+	pfree(model->targets);
+	pfree(model->kd_left);
+	pfree(model->kd_right);
+	pfree(model->kd_split);
+	pfree(model->kd_moved);
+	pfree(model->kd_is_moved);
+	pfree(model->weights);
+	if (model->nn != NULL)
+		pfree(model->nn);
+	pfree(model);
+}
+
+/*
+ * Copies models of the feature subspace into the models allocated by
+ * palloc_fss_model() for the same number of features.
+ */
+void
+copy_fss_model(AqoFssModel *dst, AqoFssModel *src)
+{
+	int			i;
+
+	Assert(dst->ncols == src->ncols);
+
+	fss_model_reserve(dst, src->rows);
+	for (i = 0; i < src->rows; ++i)
+		memcpy(dst->matrix[i], src->matrix[i],
+			   sizeof(**src->matrix) * src->ncols);
+	memcpy(dst->targets, src->targets, sizeof(*src->targets) * src->rows);
+	dst->rows = src->rows;
+
+	memcpy(dst->kd_left, src->kd_left, sizeof(*src->kd_left) * src->rows);
+	memcpy(dst->kd_right, src->kd_right, sizeof(*src->kd_right) * src->rows);
+	memcpy(dst->kd_split, src->kd_split, sizeof(*src->kd_split) * src->rows);
+	memcpy(dst->kd_moved, src->kd_moved,
+		   sizeof(*src->kd_moved) * src->kd_nmoved);
+	memcpy(dst->kd_is_moved, src->kd_is_moved,
+		   sizeof(*src->kd_is_moved) * src->rows);
+	dst->kd_root = src->kd_root;
+	dst->kd_nmoved = src->kd_nmoved;
+
+	memcpy(dst->weights, src->weights, sizeof(*src->weights) * (src->ncols + 1));
+	if (src->nn != NULL)
+	{
+		if (dst->nn == NULL)
+			dst->nn = palloc(sizeof(*dst->nn) * nn_nparams());
+		memcpy(dst->nn, src->nn, sizeof(*src->nn) * nn_nparams());
+	}
+	else if (dst->nn != NULL)
+	{
+		pfree(dst->nn);
+		dst->nn = NULL;
+	}
+	memcpy(dst->errors, src->errors, sizeof(src->errors));
+}
+
+/*
+ * Makes room for at least nrows stored objects.
+ */
+void
+fss_model_reserve(AqoFssModel *model, int nrows)
+{
+	int			capacity = Max(model->capacity, 1);
+	int			i;
+
+	if (model->matrix != NULL && nrows <= model->capacity)
+		return;
+
+	while (capacity < nrows)
+		capacity *= 2;
+
+	if (model->matrix == NULL)
+	{
+		model->matrix = palloc(sizeof(*model->matrix) * capacity);
+		model->targets = palloc(sizeof(*model->targets) * capacity);
+		model->kd_left = palloc(sizeof(*model->kd_left) * capacity);
+		model->kd_right = palloc(sizeof(*model->kd_right) * capacity);
+		model->kd_split = palloc(sizeof(*model->kd_split) * capacity);
+		model->kd_moved = palloc(sizeof(*model->kd_moved) * capacity);
+		model->kd_is_moved = palloc(sizeof(*model->kd_is_moved) * capacity);
+	}
+	else
+	{
+		model->matrix = repalloc(model->matrix,
+								 sizeof(*model->matrix) * capacity);
+		model->targets = repalloc(model->targets,
+								  sizeof(*model->targets) * capacity);
+		model->kd_left = repalloc(model->kd_left,
+								  sizeof(*model->kd_left) * capacity);
+		model->kd_right = repalloc(model->kd_right,
+								   sizeof(*model->kd_right) * capacity);
+		model->kd_split = repalloc(model->kd_split,
+								   sizeof(*model->kd_split) * capacity);
+		model->kd_moved = repalloc(model->kd_moved,
+								   sizeof(*model->kd_moved) * capacity);
+		model->kd_is_moved = repalloc(model->kd_is_moved,
+									  sizeof(*model->kd_is_moved) * capacity);
+	}
+
+	/* Objects without features still need a valid pointer */
+	for (i = model->capacity; i < capacity; ++i)
+	{
+		model->matrix[i] = palloc0(sizeof(**model->matrix) *
+								   Max(model->ncols, 1));
+		model->kd_is_moved[i] = false;
+	}
+	model->capacity = capacity;
+}
+
+/*
+ * Checks whether the model of given kind has learned something.
+ * The neural network is stored separately, so for a feature subspace we only
+ * know it was available if its error was measured.
+ */
+bool
+model_is_ready(AQO_MODEL kind, AqoFssModel *model, bool use_nn)
+{
+	switch (kind)
+	{
+		case AQO_MODEL_RIDGE:
+		case AQO_MODEL_KNN:
+			/* Both are learned on each object stored in the matrix */
+			return model->rows > 0;
+		case AQO_MODEL_MLP:
+			return use_nn && (model->nn != NULL ||
+							  model->errors[AQO_MODEL_MLP] >= 0);
+		default:
+			return false;
+	}
+}
+
+/*
+ * Returns the number of multiplications needed to predict with the model.
+ */
+double
+model_cost(AQO_MODEL kind, AqoFssModel *model)
+{
+	switch (kind)
+	{
+		case AQO_MODEL_RIDGE:
+			return model->ncols + 1;
+		case AQO_MODEL_KNN:
+			/* Search in the k-d tree visits about aqo_k + log(rows) nodes */
+			return (aqo_k + log2(model->rows + 1)) * (model->ncols + 1);
+		case AQO_MODEL_MLP:
+			return nn_nparams();
+		default:
+			return DBL_MAX;
+	}
+}
+
+/*
+ * Chooses the model to predict for the feature subspace: the cheapest one
+ * among models with running error within aqo_model_selection_tolerance of the
+ * best running error. If no error is known yet, prefers k-NN which is the
+ * most reliable on a few objects.
+ * 'use_nn' says whether the neural network may be used.
+ * Returns AQO_MODEL_NONE if no model is ready.
+ */
+AQO_MODEL
+aqo_select_model(AqoFssModel *model, bool use_nn)
+{
+	AQO_MODEL	kind;
+	AQO_MODEL	result = AQO_MODEL_NONE;
+	double		best_error = -1.;
+	double		min_cost = DBL_MAX;
+
+	for (kind = 0; kind < AQO_NMODELS; ++kind)
+		if (model_is_ready(kind, model, use_nn) && model->errors[kind] >= 0 &&
+			(best_error < 0 || model->errors[kind] < best_error))
+			best_error = model->errors[kind];
+
+	if (best_error < 0)
+	{
+		if (model_is_ready(AQO_MODEL_KNN, model, use_nn))
+			return AQO_MODEL_KNN;
+		for (kind = 0; kind < AQO_NMODELS; ++kind)
+			if (model_is_ready(kind, model, use_nn))
+				return kind;
+		return AQO_MODEL_NONE;
+	}
+
+	for (kind = 0; kind < AQO_NMODELS; ++kind)
+	{
+		double		cost;
+
+		if (!model_is_ready(kind, model, use_nn) || model->errors[kind] < 0 ||
+			model->errors[kind] > best_error + aqo_model_selection_tolerance)
+			continue;
+
+		cost = model_cost(kind, model);
+		if (cost < min_cost)
+		{
+			min_cost = cost;
+			result = kind;
+		}
+	}
+
+	return result;
+}
+
+/*
+ * Returns confidence in [0, 1] of the prediction of the model for the object.
+ *
+ * It is the product of three factors:
+ * - the number of objects learned, relative to aqo_k;
+ * - the proximity of the object to the nearest stored object: all our models
+ *   interpolate well and extrapolate poorly. It is the only measure of the
+ *   distance to the learning set we can afford for the ridge regression,
+ *   which does not keep its Gram matrix to compute the leverage;
+ * - the running error of the model on this feature subspace, if known.
+ */
+double
+aqo_model_confidence(AQO_MODEL kind, AqoFssModel *model, double *features)
+{
+	double		confidence;
+
+	if (kind == AQO_MODEL_NONE || model->rows == 0)
+		return 0.;
+
+	confidence = (double) model->rows / (model->rows + aqo_k);
+
+	/* The neural network generalizes over the whole feature space */
+	if (kind != AQO_MODEL_MLP)
+		confidence *= exp(-OkNNr_nearest_distance(model, features));
+
+	if (model->errors[kind] >= 0)
+		confidence /= 1. + model->errors[kind];
+
+	return confidence;
+}
+
+/*
+ * Predicts target value of the object with the model of given kind.
+ * The neural network is taken from nn_model and uses hashed features of the
+ * object.
+ */
+double
+aqo_model_predict(AQO_MODEL kind, AqoFssModel *model, double *features,
+				  AqoFssModel *nn_model, double *hashed_features)
+{
+	switch (kind)
+	{
+		case AQO_MODEL_RIDGE:
+			return rg_predict(model->ncols, model->weights, features);
+		case AQO_MODEL_KNN:
+			return OkNNr_predict(model, features);
+		case AQO_MODEL_MLP:
+			Assert(nn_model != NULL && nn_model->nn != NULL);
+			return nn_predict(nn_model->nn, hashed_features);
+		default:
+			return -1;
+	}
+}
+
+/*
+ * Learns all models of the feature subspace on the given object.
+ *
+ * Before learning, each ready model predicts the object, and its running error
+ * is updated with linear smoothing by learning_rate. The neural network is
+ * learned only if 'model' itself holds it, i. e. it is the global model of the
+ * feature space; otherwise nn_model (may be NULL) is used only to measure
+ * the error of the network on the objects of this feature subspace.
+ */
+void
+aqo_model_learn(AqoFssModel *model, double *features,
+				AqoFssModel *nn_model, double *hashed_features, double target)
+{
+	AQO_MODEL	kind;
+	bool		use_nn = (nn_model != NULL && nn_model->nn != NULL);
+
+	for (kind = 0; kind < AQO_NMODELS; ++kind)
+	{
+		double		err;
+		bool		ready;
+
+		/* The network may be new for this feature subspace */
+		ready = (kind == AQO_MODEL_MLP) ? use_nn :
+										  model_is_ready(kind, model, false);
+		if (!ready)
+			continue;
+
+		err = fabs(aqo_model_predict(kind, model, features,
+									 nn_model, hashed_features) - target);
+		if (model->errors[kind] < 0)
+			model->errors[kind] = err;
+		else
+			model->errors[kind] += learning_rate * (err - model->errors[kind]);
+	}
+
+	rg_learn(model->ncols, model->weights, features, target);
+	model->rows = OkNNr_learn(model, features, target);
+
+	if (nn_model == model)
+	{
+		if (model->nn == NULL)
+		{
+			model->nn = palloc(sizeof(*model->nn) * nn_nparams());
+			nn_init(model->nn);
+		}
+		nn_learn(model->nn, hashed_features, target, NN_LEARN_ITERATIONS);
+	}
 }
@@ -0,0 +1,122 @@
+/*
+ * machine_learning.h
+ *		Machine learning models of adaptive query optimization.
+ *
+ * The models do not depend on anything in PostgreSQL but memory allocation
+ * and a few portability macros, so this header is shared by the extension and
+ * the standalone benchmark of the models (see bench/ml_bench.c).
+ *
+ * Copyright (c) 2016-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  aqo/machine_learning.h
+ *
+ */
+#ifndef AQO_MACHINE_LEARNING_H
+#define AQO_MACHINE_LEARNING_H
+
+#include <float.h>
+#include <math.h>
+
+#include "postgres.h"
+
+/* Machine learning parameters */
+extern const double object_selection_threshold;
+extern const double learning_rate;
+extern int	aqo_k;
+extern double aqo_model_selection_tolerance;
+extern int	aqo_knn_capacity;
+
+/* Default max number of matrix rows - max number of possible neighbors. */
+#define	aqo_K	(30)
+
+/* Default of aqo.model_selection_tolerance */
+#define AQO_DEFAULT_MODEL_SELECTION_TOLERANCE	(0.1)
+
+/* Upper limit of aqo.knn_capacity */
+#define AQO_KNN_MAX_CAPACITY	(8192)
+
+/*
+ * Width of the feature vector of the global model. It is the same for all
+ * feature subspaces and matches the input layer of the neural network.
+ */
+#define aqo_hashed_nfeatures	(15)
+
+/* Machine learning models which may serve a feature subspace */
+typedef enum
+{
+	AQO_MODEL_NONE = -1,
+	/* Ridge regression over the features of the subspace */
+	AQO_MODEL_RIDGE,
+	/* k-nearest neighbors regression over the features of the subspace */
+	AQO_MODEL_KNN,
+	/* Neural network over the hashed features, shared by the feature space */
+	AQO_MODEL_MLP,
+	AQO_NMODELS
+}	AQO_MODEL;
+
+/*
+ * Models of the feature subspace as stored in aqo_data.
+ * All models are learned on the same objects. The running error of each model
+ * on this feature subspace is used to choose the model for prediction.
+ */
+typedef struct AqoFssModel
+{
+	int			ncols;			/* number of features */
+	int			rows;			/* number of objects stored for k-NN */
+	int			capacity;		/* number of allocated rows */
+	double	  **matrix;			/* features of the stored objects */
+	double	   *targets;		/* targets of the stored objects */
+
+	/*
+	 * k-d tree over the stored objects. Each object is a node of the tree;
+	 * objects of the left subtree of the node at depth d have feature
+	 * d % ncols less than kd_split of the node, objects of the right subtree
+	 * have it not less. The objects moved by learning out of the region of
+	 * their node are listed in kd_moved and searched linearly until the tree
+	 * is rebuilt. kd_root is -1 if there is no tree, see kd_build().
+	 */
+	int			kd_root;
+	int		   *kd_left;
+	int		   *kd_right;
+	double	   *kd_split;
+	int			kd_nmoved;
+	int		   *kd_moved;
+	bool	   *kd_is_moved;
+
+	double	   *weights;		/* ncols + 1 weights of the ridge regression */
+	double	   *nn;				/* neural network, only in the global model */
+	double		errors[AQO_NMODELS];	/* negative if not measured yet */
+} AqoFssModel;
+
+/* Machine learning techniques */
+extern double OkNNr_predict(AqoFssModel *model, double *features);
+extern int OkNNr_learn(AqoFssModel *model, double *features, double target);
+extern double OkNNr_nearest_distance(AqoFssModel *model, double *features);
+extern double rg_predict(int ncols, double *weights, double *features);
+extern int rg_learn(int ncols, double *weights,
+			double *features, double target);
+extern int nn_nparams(void);
+extern void nn_init(double *params);
+extern double nn_predict(double *params, double *features);
+extern void nn_learn(double *params, double *features, double target,
+					 int niters);
+
+/* Model selection */
+extern AqoFssModel *palloc_fss_model(int ncols);
+extern void pfree_fss_model(AqoFssModel *model);
+extern void copy_fss_model(AqoFssModel *dst, AqoFssModel *src);
+extern void fss_model_reserve(AqoFssModel *model, int nrows);
+extern bool kd_is_useful(AqoFssModel *model);
+extern void kd_build(AqoFssModel *model);
+extern AQO_MODEL aqo_select_model(AqoFssModel *model, bool use_nn);
+extern double aqo_model_confidence(AQO_MODEL kind, AqoFssModel *model,
+								   double *features);
+extern double aqo_model_predict(AQO_MODEL kind, AqoFssModel *model,
+								double *features, AqoFssModel *nn_model,
+								double *hashed_features);
+extern void aqo_model_learn(AqoFssModel *model, double *features,
+							AqoFssModel *nn_model, double *hashed_features,
+							double target);
+
+#endif							/* AQO_MACHINE_LEARNING_H */
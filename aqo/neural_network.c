@@ -0,0 +1,238 @@
+/*
+ *******************************************************************************
+ *
+ *	NEURAL NETWORK
+ *
+ * Multilayer perceptron with two hidden layers and Leaky ReLU activations.
+ * Like machine_learning.c, this module does not know anything about DBMS.
+ * The input of the network is the fixed-width vector of hashed features (see
+ * get_fss_for_object), so one network serves all feature subspaces of the
+ * feature space.
+ *
+ * All parameters of the network are kept in one flat array of nn_nparams()
+ * elements, which is convenient to store and to load it as a whole.
+ *
+ *******************************************************************************
+ *
+ * Copyright (c) 2016-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  aqo/neural_network.c
+ *
+ */
+
+#include "machine_learning.h"
+
+#define WIDTH_0 aqo_hashed_nfeatures	/* size of the input vector */
+#define WIDTH_1 100		/* size of the output of the first layer */
+#define WIDTH_2 100		/* size of the output of the second layer */
+#define lr 0.0001		/* learning rate */
+#define slope 0.3		/* parameter of Leaky ReLU activation */
+
+/* Layout of the network parameters in the flat array */
+typedef struct NeuralNet
+{
+	double	   *W1;		/* WIDTH_1 x WIDTH_0 */
+	double	   *b1;		/* WIDTH_1 */
+	double	   *W2;		/* WIDTH_2 x WIDTH_1 */
+	double	   *b2;		/* WIDTH_2 */
+	double	   *W3;		/* WIDTH_2 */
+	double	   *b3;		/* 1 */
+} NeuralNet;
+
+static void nn_attach(NeuralNet *nn, double *params);
+static double nn_forward(NeuralNet *nn, double *features,
+						 double *out1, double *out2,
+						 double *out3, double *out4);
+static double leaky_relu(double x);
+static double uniform(double stdv);
+
+
+/*
+ * Returns the number of parameters of the network.
+ */
+int
+nn_nparams(void)
+{
+	return WIDTH_1 * WIDTH_0 + WIDTH_1 +
+		   WIDTH_2 * WIDTH_1 + WIDTH_2 +
+		   WIDTH_2 + 1;
+}
+
+/*
+ * Sets up pointers to the layers of the network inside the flat array.
+ */
+void
+nn_attach(NeuralNet *nn, double *params)
+{
+	nn->W1 = params;
+	nn->b1 = nn->W1 + WIDTH_1 * WIDTH_0;
+	nn->W2 = nn->b1 + WIDTH_1;
+	nn->b2 = nn->W2 + WIDTH_2 * WIDTH_1;
+	nn->W3 = nn->b2 + WIDTH_2;
+	nn->b3 = nn->W3 + WIDTH_2;
+}
+
+/*
+ * Returns random value uniformly distributed in [-stdv, stdv].
+ */
+double
+uniform(double stdv)
+{
+	return 2. * stdv * (random() / (double) MAX_RANDOM_VALUE) - stdv;
+}
+
+double
+leaky_relu(double x)
+{
+	return (x < x * slope) ? x * slope : x;
+}
+
+/*
+ * Initializes weights (standard Xavier
+ * http://proceedings.mlr.press/v9/glorot10a/glorot10a.pdf).
+ */
+void
+nn_init(double *params)
+{
+	NeuralNet	nn;
+	double		stdv;
+	int			i;
+
+	nn_attach(&nn, params);
+
+	stdv = 1. / sqrt(WIDTH_0);
+	for (i = 0; i < WIDTH_1 * WIDTH_0; ++i)
+		nn.W1[i] = uniform(stdv);
+	for (i = 0; i < WIDTH_1; ++i)
+		nn.b1[i] = uniform(stdv);
+
+	stdv = 1. / sqrt(WIDTH_1);
+	for (i = 0; i < WIDTH_2 * WIDTH_1; ++i)
+		nn.W2[i] = uniform(stdv);
+	for (i = 0; i < WIDTH_2; ++i)
+		nn.b2[i] = uniform(stdv);
+
+	stdv = 1. / sqrt(WIDTH_2);
+	for (i = 0; i < WIDTH_2; ++i)
+		nn.W3[i] = uniform(stdv);
+	*nn.b3 = uniform(stdv);
+}
+
+/*
+ * Forward pass. Stores outputs of the layers before (out1, out3) and after
+ * (out2, out4) activations for the backward pass.
+ */
+double
+nn_forward(NeuralNet *nn, double *features,
+		   double *out1, double *out2, double *out3, double *out4)
+{
+	double		out5;
+	int			i,
+				j;
+
+	for (i = 0; i < WIDTH_1; ++i)
+	{
+		out1[i] = nn->b1[i];
+		for (j = 0; j < WIDTH_0; ++j)
+			out1[i] += features[j] * nn->W1[i * WIDTH_0 + j];
+		out2[i] = leaky_relu(out1[i]);
+	}
+
+	for (i = 0; i < WIDTH_2; ++i)
+	{
+		out3[i] = nn->b2[i];
+		for (j = 0; j < WIDTH_1; ++j)
+			out3[i] += out2[j] * nn->W2[i * WIDTH_1 + j];
+		out4[i] = leaky_relu(out3[i]);
+	}
+
+	/* final result (one number) */
+	out5 = *nn->b3;
+	for (j = 0; j < WIDTH_2; ++j)
+		out5 += out4[j] * nn->W3[j];
+	return out5;
+}
+
+/*
+ * Predicts target value of the object with given network parameters.
+ */
+double
+nn_predict(double *params, double *features)
+{
+	NeuralNet	nn;
+	double		out1[WIDTH_1];
+	double		out2[WIDTH_1];
+	double		out3[WIDTH_2];
+	double		out4[WIDTH_2];
+
+	nn_attach(&nn, params);
+	return nn_forward(&nn, features, out1, out2, out3, out4);
+}
+
+/*
+ * Makes niters steps of stochastic gradient descent over the squared loss
+ * on the given object.
+ */
+void
+nn_learn(double *params, double *features, double target, int niters)
+{
+	NeuralNet	nn;
+	double		out1[WIDTH_1];
+	double		out2[WIDTH_1];
+	double		out3[WIDTH_2];
+	double		out4[WIDTH_2];
+	double		dp2[WIDTH_2];
+	double		dp3[WIDTH_1];
+	double		dp1;
+	int			i,
+				j,
+				k;
+
+	nn_attach(&nn, params);
+
+	for (k = 0; k < niters; ++k)
+	{
+		/* derivative of the loss w.r.t. the output of forward pass */
+		dp1 = 2. * (nn_forward(&nn, features, out1, out2, out3, out4) - target);
+
+		/* derivative of the loss w.r.t. the output of the second layer */
+		for (i = 0; i < WIDTH_2; ++i)
+		{
+			dp2[i] = dp1 * nn.W3[i];
+			if (out3[i] < slope * out3[i])
+				dp2[i] *= slope;
+		}
+
+		/* derivative of the loss w.r.t. the output of the first layer */
+		for (j = 0; j < WIDTH_1; ++j)
+		{
+			dp3[j] = 0.;
+			for (i = 0; i < WIDTH_2; ++i)
+				dp3[j] += dp2[i] * nn.W2[i * WIDTH_1 + j];
+			if (out1[j] < slope * out1[j])
+				dp3[j] *= slope;
+		}
+
+		/* updating the weights in the third layer */
+		for (i = 0; i < WIDTH_2; ++i)
+			nn.W3[i] -= lr * dp1 * out4[i];
+		*nn.b3 -= lr * dp1;
+
+		/* updating the weights in the second layer */
+		for (i = 0; i < WIDTH_2; ++i)
+		{
+			for (j = 0; j < WIDTH_1; ++j)
+				nn.W2[i * WIDTH_1 + j] -= lr * dp2[i] * out2[j];
+			nn.b2[i] -= lr * dp2[i];
+		}
+
+		/* updating the weights in the first layer */
+		for (i = 0; i < WIDTH_1; ++i)
+		{
+			for (j = 0; j < WIDTH_0; ++j)
+				nn.W1[i * WIDTH_0 + j] -= lr * dp3[i] * features[j];
+			nn.b1[i] -= lr * dp3[i];
+		}
+	}
+}
@@ -18,8 +18,12 @@
 
 #include "aqo.h"
 #include "access/parallel.h"
+#include "access/xlog.h"
 #include "optimizer/optimizer.h"
+#include "utils/plancache.h"
+#include "utils/portal.h"
 #include "utils/queryenvironment.h"
+#include "utils/timestamp.h"
 
 typedef struct
 {
@@ -29,9 +33,86 @@ typedef struct
 	bool learn;
 } aqo_obj_stat;
 
+/*
+ * Clauses of a plan node of a failed query. The plan doesn't survive the
+ * abort of the transaction, so they are copied out of it.
+ */
+typedef struct
+{
+	List	   *clauses;
+	List	   *relids;
+	JoinType	jointype;
+	bool		was_parametrized;
+	List	   *selectivities;	/* restored when the node is learned */
+} AqoPendingNode;
+
+/*
+ * Object of a failed query which is learned later. Its clauses are the ones
+ * of the nodes of its subtree, which are stored one after another.
+ */
+typedef struct
+{
+	int			first_node;
+	int			last_node;		/* the node of the object itself */
+	double		target;
+} AqoPendingSample;
+
+/* Failed query which objects are learned later */
+typedef struct
+{
+	int64		fspace_hash;
+	List	   *selectivity_cache;
+	List	   *nodes;			/* AqoPendingNode in the order of the walk */
+	List	   *samples;		/* AqoPendingSample */
+} AqoFailedQuery;
+
+/* Object learned by the global model of the feature space */
+typedef struct
+{
+	int64		fspace_hash;
+	double		features[aqo_hashed_nfeatures];
+	double		target;
+} AqoGlobalObject;
+
+/* Max number of objects of failed queries waiting to be learned */
+#define AQO_MAX_PENDING_SAMPLES	(1000)
+
 static double cardinality_sum_errors;
 static int	cardinality_num_objects;
 
+/*
+ * Queries failed in this backend. The knowledge base can't be updated and
+ * even the catalog can't be read in the aborted transaction, so only plain
+ * data of the plan nodes are collected in failed_queries_context. Features
+ * and hashes of the objects are computed at the planning of the next query.
+ */
+static List *failed_queries = NIL;
+static int	npending_samples = 0;
+static MemoryContext failed_queries_context = NULL;
+
+/*
+ * Objects of the global models. The row of the global model is large, so it
+ * is updated once with all objects of the query rather than for each node,
+ * see learn_global_objects(). The objects left by an error are learned with
+ * the next ones.
+ */
+static List *global_objects = NIL;
+static MemoryContext global_objects_context = NULL;
+
+/*
+ * A learned node of the query diverged from its prediction by more than
+ * aqo.replan_threshold, so the cached plans must be built again.
+ */
+static bool plan_diverged = false;
+
+/*
+ * The cached plans are invalidated at most once per this interval in ms, so
+ * a workload of diverged plans doesn't replan the backend on each execution.
+ */
+#define AQO_REPLAN_MIN_INTERVAL		(10000)
+
+static TimestampTz last_replan_time = 0;
+
 /* It is needed to recognize stored Query-related aqo data in the query
  * environment field.
  */
@@ -40,10 +121,12 @@ static char *PlanStateInfo = "PlanStateInfo";
 
 
 /* Query execution statistics collecting utilities */
-static void atomic_fss_learn_step(int fss_hash, int ncols,
-					  double *weights,
-					  double *features, double target);
-static void learn_sample(List *clauselist,
+static void atomic_fss_learn_step(int64 fss_hash, AqoFssModel *model,
+					  double *features, AqoFssModel *nn_model,
+					  double *hashed_features, double target);
+static double get_node_rows(PlanState *ps);
+static double get_node_predicted(Plan *plan);
+static int64 learn_sample(List *clauselist,
 			 List *selectivities,
 			 List *relidslist,
 			 double true_cardinality,
@@ -52,6 +135,11 @@ static List *restore_selectivities(List *clauselist,
 					  List *relidslist,
 					  JoinType join_type,
 					  bool was_parametrized);
+static void check_divergence(double predicted, double rows);
+static bool stash_failed_node(PlanState *p, void *context);
+static void learn_failed_query(AqoFailedQuery *query);
+static void replan_if_diverged(QueryDesc *queryDesc);
+static void learn_on_error(QueryDesc *queryDesc);
 static void update_query_stat_row(double *et, int *et_size,
 					  double *pt, int *pt_size,
 					  double *ce, int *ce_size,
@@ -65,29 +153,209 @@ static bool ExtractFromQueryContext(QueryDesc *queryDesc);
 static void RemoveFromQueryContext(QueryDesc *queryDesc);
 
 
+/*
+ * This is the critical section: only one runner is allowed to be inside this
+ * function for one feature subspace.
+ * model is just preallocated memory for computations.
+ */
 static void
-atomic_fss_learn_step(int fss_hash, int ncols,
-					  double *weights,
-					  double *features, double target)
+atomic_fss_learn_step(int64 fss_hash, AqoFssModel *model, double *features,
+					  AqoFssModel *nn_model, double *hashed_features,
+					  double target)
 {
+	/* If nothing is loaded, the models are learned from scratch */
+	if (model != nn_model)
+		load_fss(fss_hash, model->ncols, model);
+
+	aqo_model_learn(model, features, nn_model, hashed_features, target);
+	update_fss(fss_hash, model);
+}
+
+/*
+ * Returns the number of rows produced by the node per loop, summed over the
+ * leader and all parallel workers which executed it.
+ * When the workers finish, the leader accumulates their instrumentation into
+ * its own, so the totals of the node are exact. Each participant executes the
+ * node the same number of times, so the number of loops of the whole node is
+ * the total number of loops divided by the number of participants.
+ */
+static double
+get_node_rows(PlanState *ps)
+{
+	double		nparticipants = 1.;
+
+	Assert(ps->instrument && ps->instrument->nloops > 0.);
+
+	if (ps->worker_instrument && IsParallelTuplesProcessing(ps->plan))
+	{
+		double		wnloops = 0.;
+		int			i;
+
+		nparticipants = 0.;
+		for (i = 0; i < ps->worker_instrument->num_workers; i++)
+		{
+			double		l = ps->worker_instrument->instrument[i].nloops;
+
+			if (l <= 0)
+				continue;
+
+			wnloops += l;
+			nparticipants += 1.;
+		}
+
+		Assert(ps->instrument->nloops >= wnloops);
+
+		/* The leader executed the node too */
+		if (ps->instrument->nloops - wnloops > 0.5)
+			nparticipants += 1.;
+	}
+
+	return ps->instrument->ntuples * nparticipants / ps->instrument->nloops;
+}
+
+/*
+ * Returns the cardinality of the plan node predicted at the planning, summed
+ * over all parallel workers, and clamped to be not less than 1.
+ */
+static double
+get_node_predicted(Plan *plan)
+{
+	double		predicted;
+
+	if (plan->predicted_cardinality > 0.)
+		predicted = plan->predicted_cardinality;
+	else if (IsParallelTuplesProcessing(plan))
+		predicted = plan->plan_rows *
+			get_parallel_divisor(plan->path_parallel_workers);
+	else
+		predicted = plan->plan_rows;
 
-	update_fss(fss_hash, ncols, weights);
+	/* It is needed for correct exp(result) calculation. */
+	return clamp_row_est(predicted);
+}
+
+/*
+ * Learns the models of the feature subspace and the global model with the
+ * object given by its features and logarithm of its cardinality. The global
+ * model is skipped if the hashed features are NULL. During recovery the
+ * object is spooled for the primary instead.
+ */
+void
+learn_object(int64 fss_hash, int nfeatures, double *features,
+			 double *hashed_features, double target)
+{
+	AqoFssModel *model;
+	AqoFssModel *global_model = NULL;
+
+	if (RecoveryInProgress())
+	{
+		spool_sample(fss_hash, nfeatures, features,
+					 aqo_use_global_model ? hashed_features : NULL, target);
+		return;
+	}
+
+	/* Here should be critical section */
+	if (aqo_use_global_model && hashed_features != NULL)
+	{
+		AqoGlobalObject *object;
+		MemoryContext oldCxt;
+
+		/*
+		 * The global model is loaded first: its neural network is evaluated
+		 * on the object to track its error in the feature subspace. The
+		 * global model itself learns the object later.
+		 */
+		global_model = palloc_fss_model(aqo_hashed_nfeatures);
+		load_fss(AQO_GLOBAL_FSS_HASH, aqo_hashed_nfeatures, global_model);
+
+		if (global_objects_context == NULL)
+			global_objects_context = AllocSetContextCreate(AQOMemoryContext,
+														   "AQO global model objects",
+														   ALLOCSET_DEFAULT_SIZES);
+		oldCxt = MemoryContextSwitchTo(global_objects_context);
+		object = palloc(sizeof(AqoGlobalObject));
+		object->fspace_hash = query_context.fspace_hash;
+		memcpy(object->features, hashed_features, sizeof(object->features));
+		object->target = target;
+		global_objects = lappend(global_objects, object);
+		MemoryContextSwitchTo(oldCxt);
+	}
+
+	model = palloc_fss_model(nfeatures);
+	atomic_fss_learn_step(fss_hash, model, features,
+						  global_model, hashed_features, target);
+	/* Here should be the end of critical section */
+
+	pfree_fss_model(model);
+	if (global_model != NULL)
+		pfree_fss_model(global_model);
+}
+
+/*
+ * Learns the global models with the objects collected by learn_object(). The
+ * model of each feature space is loaded and updated once.
+ */
+void
+learn_global_objects(void)
+{
+	List	   *objects = global_objects;
+	int64		fspace_hash = query_context.fspace_hash;
+	AqoFssModel *model = NULL;
+	ListCell   *lc;
+
+	if (objects == NIL)
+		return;
+
+	/* An error while learning must not make us learn the same again */
+	global_objects = NIL;
+
+	foreach(lc, objects)
+	{
+		AqoGlobalObject *object = (AqoGlobalObject *) lfirst(lc);
+
+		if (model != NULL && object->fspace_hash != query_context.fspace_hash)
+		{
+			update_fss(AQO_GLOBAL_FSS_HASH, model);
+			pfree_fss_model(model);
+			model = NULL;
+		}
+
+		if (model == NULL)
+		{
+			query_context.fspace_hash = object->fspace_hash;
+			model = palloc_fss_model(aqo_hashed_nfeatures);
+			load_fss(AQO_GLOBAL_FSS_HASH, aqo_hashed_nfeatures, model);
+		}
+
+		aqo_model_learn(model, object->features, model, object->features,
+						object->target);
+	}
+
+	update_fss(AQO_GLOBAL_FSS_HASH, model);
+	pfree_fss_model(model);
+	query_context.fspace_hash = fspace_hash;
+
+	MemoryContextReset(global_objects_context);
 }
 
 /*
  * For given object (i. e. clauselist, selectivities, relidslist, predicted and
  * true cardinalities) performs learning procedure.
+ * Returns the hash of feature subspace of the object.
  */
-static void
+static int64
 learn_sample(List *clauselist, List *selectivities, List *relidslist,
 			 double true_cardinality, double predicted_cardinality)
 {
-	int			fss_hash;
+	int64		fss_hash;
 	int			nfeatures;
-	double	  *weights;
 	double	   *features;
+	double		hashed_features[aqo_hashed_nfeatures];
 	double		target;
-	int			i;
+	instr_time	start;
+
+	TRACE_AQO_LEARN_SAMPLE_START();
+	aqo_stat_start(&start);
 
 /*
  * Suppress the optimization for debug purposes.
@@ -100,19 +368,163 @@ learn_sample(List *clauselist, List *selectivities, List *relidslist,
 	target = log(true_cardinality);
 
 	fss_hash = get_fss_for_object(clauselist, selectivities, relidslist,
-					   &nfeatures, &features);
+								  &nfeatures, &features,
+								  aqo_use_global_model ? hashed_features : NULL);
 
-	if (nfeatures > 0)
-		weights = palloc(sizeof(double) * nfeatures);
+	learn_object(fss_hash, nfeatures, features, hashed_features, target);
+	pfree(features);
 
-	/* Here should be critical section */
-	atomic_fss_learn_step(fss_hash, nfeatures, weights, features, target);
-	/* Here should be the end of critical section */
+	aqo_stat_add_time(AQO_STAT_LEARN_TIME, &start);
+	TRACE_AQO_LEARN_SAMPLE_DONE(query_context.fspace_hash, fss_hash,
+								AQO_PROBE_ROWS(true_cardinality),
+								AQO_PROBE_ROWS(predicted_cardinality));
+	return fss_hash;
+}
+
+/*
+ * Collects clauses of the plan nodes of a failed query and their objects to
+ * learn them later. Nothing but copying of memory may be done here.
+ * Nodes may have been interrupted, so the number of rows they have produced
+ * so far is only a lower bound of their cardinality. It tells something only
+ * if the cardinality was underestimated, and other nodes are skipped.
+ * Nodes which have never been executed are skipped too, while the other
+ * nodes of the plan are still learned.
+ */
+static bool
+stash_failed_node(PlanState *p, void *context)
+{
+	AqoFailedQuery *query = (AqoFailedQuery *) context;
+	int			first_node = list_length(query->nodes);
+	AqoPendingNode *node;
+	Instrumentation *instr = p->instrument;
+	double		nloops;
+	double		rows;
+	double		predicted;
+	AqoPendingSample *sample;
+
+	planstate_tree_walker(p, stash_failed_node, context);
+
+	/* See learnOnPlanState */
+	if (!p->plan->had_path)
+		return false;
 
-	if (nfeatures > 0)
-		pfree(weights);
+	node = palloc(sizeof(AqoPendingNode));
+	node->clauses = copyObject(p->plan->path_clauses);
+	node->relids = list_copy(p->plan->path_relids);
+	node->jointype = p->plan->path_jointype;
+	node->was_parametrized = p->plan->was_parametrized;
+	node->selectivities = NIL;
+	query->nodes = lappend(query->nodes, node);
 
-	pfree(features);
+	if (instr == NULL || (p->righttree == NULL && p->lefttree != NULL &&
+						  p->plan->path_clauses == NIL))
+		return false;
+
+	/* Rows of parallel workers are not accumulated by the leader on error */
+	nloops = instr->nloops + (instr->running ? 1. : 0.);
+	if (nloops < 1. || IsParallelTuplesProcessing(p->plan) ||
+		npending_samples >= AQO_MAX_PENDING_SAMPLES)
+		return false;
+
+	rows = clamp_row_est((instr->ntuples + instr->tuplecount) / nloops);
+	predicted = get_node_predicted(p->plan);
+	if (rows <= predicted)
+		return false;
+
+	check_divergence(predicted, rows);
+
+	sample = palloc(sizeof(AqoPendingSample));
+	sample->first_node = first_node;
+	sample->last_node = list_length(query->nodes) - 1;
+	sample->target = log(rows);
+	query->samples = lappend(query->samples, sample);
+	npending_samples++;
+	return false;
+}
+
+/*
+ * Learns the objects of the failed query. The selectivity cache of its
+ * planning is restored to find the selectivities of its clauses.
+ */
+static void
+learn_failed_query(AqoFailedQuery *query)
+{
+	AqoPendingNode **nodes;
+	ListCell   *lc;
+	int			i = 0;
+
+	nodes = palloc(sizeof(*nodes) * Max(list_length(query->nodes), 1));
+	selectivity_cache_set(query->selectivity_cache);
+	foreach(lc, query->nodes)
+	{
+		nodes[i] = (AqoPendingNode *) lfirst(lc);
+		nodes[i]->selectivities = restore_selectivities(nodes[i]->clauses,
+														nodes[i]->relids,
+														nodes[i]->jointype,
+														nodes[i]->was_parametrized);
+		i++;
+	}
+	selectivity_cache_clear();
+
+	query_context.fspace_hash = query->fspace_hash;
+	foreach(lc, query->samples)
+	{
+		AqoPendingSample *sample = (AqoPendingSample *) lfirst(lc);
+		List	   *clauselist = NIL;
+		List	   *selectivities = NIL;
+		int64		fss_hash;
+		int			nfeatures;
+		double	   *features;
+		double		hashed_features[aqo_hashed_nfeatures];
+
+		for (i = sample->first_node; i <= sample->last_node; ++i)
+		{
+			clauselist = list_concat(clauselist,
+									 list_copy(nodes[i]->clauses));
+			selectivities = list_concat(selectivities,
+										list_copy(nodes[i]->selectivities));
+		}
+
+		fss_hash = get_fss_for_object(clauselist, selectivities,
+									  nodes[sample->last_node]->relids,
+									  &nfeatures, &features,
+									  aqo_use_global_model ?
+									  hashed_features : NULL);
+		learn_object(fss_hash, nfeatures, features, hashed_features,
+					 sample->target);
+
+		pfree(features);
+		list_free(clauselist);
+		list_free(selectivities);
+	}
+	pfree(nodes);
+}
+
+/*
+ * Learns the objects collected from the failed queries of this backend.
+ * Called at the planning, when the knowledge base may be updated.
+ */
+void
+learn_pending_samples(void)
+{
+	List	   *queries = failed_queries;
+	int64		fspace_hash = query_context.fspace_hash;
+	ListCell   *lc;
+
+	if (queries == NIL)
+		return;
+
+	/* An error while learning must not make us learn the same again */
+	failed_queries = NIL;
+	npending_samples = 0;
+
+	foreach(lc, queries)
+		learn_failed_query((AqoFailedQuery *) lfirst(lc));
+	query_context.fspace_hash = fspace_hash;
+	learn_global_objects();
+
+	MemoryContextReset(failed_queries_context);
+	flush_spooled_samples();
 }
 
 /*
@@ -130,10 +542,10 @@ restore_selectivities(List *clauselist,
 	int			i = 0;
 	bool		parametrized_sel;
 	int			nargs;
-	int		   *args_hash;
-	int		   *eclass_hash;
+	int64	   *args_hash;
+	int64	   *eclass_hash;
 	double	   *cur_sel;
-	int			cur_hash;
+	int64		cur_hash;
 	int			cur_relid;
 
 	parametrized_sel = was_parametrized && (list_length(relidslist) == 1);
@@ -239,56 +651,18 @@ learnOnPlanState(PlanState *p, void *context)
 			 */
 			ctx->relidslist = list_copy(p->plan->path_relids);
 
-		if (p->instrument && (p->righttree != NULL || p->lefttree == NULL ||
-							  p->plan->path_clauses != NIL))
+		if (p->instrument && (p->righttree != NULL ||
+								   p->lefttree == NULL ||
+								   p->plan->path_clauses != NIL))
 		{
 			double learn_rows = 0.;
 			double predicted = 0.;
+			int64 fss_hash;
 
 			if (p->instrument->nloops > 0.)
 			{
-				/* If we can strongly calculate produced rows, do it. */
-				if (p->worker_instrument && IsParallelTuplesProcessing(p->plan))
-				{
-					double wnloops = 0.;
-					double wntuples = 0.;
-					int i;
-
-					for (i = 0; i < p->worker_instrument->num_workers; i++)
-					{
-						double t = p->worker_instrument->instrument[i].ntuples;
-						double l = p->worker_instrument->instrument[i].nloops;
-
-						if (l <= 0)
-							continue;
-
-						wntuples += t;
-						wnloops += l;
-						learn_rows += t/l;
-					}
-
-					Assert(p->instrument->nloops >= wnloops);
-					Assert(p->instrument->ntuples >= wntuples);
-					if (p->instrument->nloops - wnloops > 0.5)
-						learn_rows += (p->instrument->ntuples - wntuples) /
-											(p->instrument->nloops - wnloops);
-				}
-				else
-					/* This node does not required to sum tuples of each worker
-					 * to calculate produced rows.  */
-					learn_rows = p->instrument->ntuples / p->instrument->nloops;
-
-				if (p->plan->predicted_cardinality > 0.)
-					predicted = p->plan->predicted_cardinality;
-				else if (IsParallelTuplesProcessing(p->plan))
-					predicted = p->plan->plan_rows *
-						get_parallel_divisor(p->plan->path_parallel_workers);
-				else
-					predicted = p->plan->plan_rows;
-
-				/* It is needed for correct exp(result) calculation. */
-				predicted = clamp_row_est(predicted);
-				learn_rows = clamp_row_est(learn_rows);
+				learn_rows = clamp_row_est(get_node_rows(p));
+				predicted = get_node_predicted(p->plan);
 			}
 			else
 			{
@@ -315,9 +689,20 @@ learnOnPlanState(PlanState *p, void *context)
 			 */
 			Assert(p->instrument->nloops >= 1);
 
+			fss_hash = p->plan->fss_hash;
 			if (ctx->learn)
-				learn_sample(SubplanCtx.clauselist, SubplanCtx.selectivities,
-								p->plan->path_relids, learn_rows, predicted);
+			{
+				fss_hash = learn_sample(SubplanCtx.clauselist,
+										SubplanCtx.selectivities,
+										p->plan->path_relids,
+										learn_rows, predicted);
+				check_divergence(predicted, learn_rows);
+			}
+
+			/* The feature subspace isn't known if AQO wasn't used */
+			if (fss_hash != 0)
+				aqo_fss_stat_update(query_context.fspace_hash, fss_hash,
+									predicted, learn_rows);
 		}
 	}
 
@@ -327,6 +712,51 @@ learnOnPlanState(PlanState *p, void *context)
 	return false;
 }
 
+/*
+ * Marks the plan as diverged if q-error of the learned node exceeds
+ * aqo.replan_threshold. Both values are clamped to be not less than 1.
+ */
+static void
+check_divergence(double predicted, double rows)
+{
+	if (aqo_replan_threshold > 0. &&
+		fabs(log(predicted) - log(rows)) > log(aqo_replan_threshold))
+		plan_diverged = true;
+}
+
+/*
+ * Invalidates the cached plans of the backend if the executed generic plan
+ * diverged from its predictions, so prepared statements are planned again
+ * with the knowledge just learned rather than keep the bad generic plan.
+ * Custom plans and the plans which aren't cached are built anew anyway. The
+ * plan cache has no link to the executed query, so all plans are invalidated,
+ * and this is done at most once per AQO_REPLAN_MIN_INTERVAL.
+ */
+static void
+replan_if_diverged(QueryDesc *queryDesc)
+{
+	TimestampTz now;
+
+	if (!plan_diverged)
+		return;
+
+	plan_diverged = false;
+	if (query_context.custom_plan || ActivePortal == NULL ||
+		ActivePortal->cplan == NULL ||
+		!list_member_ptr(ActivePortal->cplan->stmt_list,
+						 queryDesc->plannedstmt))
+		return;
+
+	now = GetCurrentTimestamp();
+	if (!TimestampDifferenceExceeds(last_replan_time, now,
+									AQO_REPLAN_MIN_INTERVAL))
+		return;
+
+	last_replan_time = now;
+	elog(DEBUG1, "AQO: the generic plan diverged from the predictions, invalidate cached plans");
+	ResetPlanCache();
+}
+
 /*
  * Updates given row of query statistics.
  */
@@ -402,6 +832,9 @@ aqo_ExecutorStart(QueryDesc *queryDesc, int eflags)
 		StoreToQueryContext(queryDesc);
 	}
 
+	/* The generic plan may be executed again without planning */
+	query_context.custom_plan = false;
+
 	if (prev_ExecutorStart_hook)
 		prev_ExecutorStart_hook(queryDesc, eflags);
 	else
@@ -412,6 +845,86 @@ aqo_ExecutorStart(QueryDesc *queryDesc, int eflags)
 		StorePlanInternals(queryDesc);
 }
 
+/*
+ * Collects objects of the failed query to learn them later.
+ */
+static void
+learn_on_error(QueryDesc *queryDesc)
+{
+	MemoryContext oldCxt;
+	MemoryContext queryCxt;
+	AqoFailedQuery *query;
+
+	if (!ExtractFromQueryContext(queryDesc))
+		return;
+
+	plan_diverged = false;
+	if (query_context.learn_aqo && queryDesc->planstate != NULL &&
+		npending_samples < AQO_MAX_PENDING_SAMPLES)
+	{
+		if (failed_queries_context == NULL)
+			failed_queries_context = AllocSetContextCreate(AQOMemoryContext,
+														   "AQO failed queries",
+														   ALLOCSET_DEFAULT_SIZES);
+		queryCxt = AllocSetContextCreate(failed_queries_context,
+										 "AQO failed query",
+										 ALLOCSET_SMALL_SIZES);
+		oldCxt = MemoryContextSwitchTo(queryCxt);
+
+		query = palloc(sizeof(AqoFailedQuery));
+		query->fspace_hash = query_context.fspace_hash;
+		query->selectivity_cache = selectivity_cache_copy();
+		query->nodes = NIL;
+		query->samples = NIL;
+		stash_failed_node(queryDesc->planstate, (void *) query);
+
+		MemoryContextSwitchTo(failed_queries_context);
+		if (query->samples != NIL)
+			failed_queries = lappend(failed_queries, query);
+		else
+			MemoryContextDelete(queryCxt);
+		MemoryContextSwitchTo(oldCxt);
+	}
+
+	/* The objects will be learned at the next planning */
+	replan_if_diverged(queryDesc);
+
+	/* ExecutorEnd isn't called for the failed query */
+	RemoveFromQueryContext(queryDesc);
+}
+
+/*
+ * Runs the executor. If the query fails, e. g. it is cancelled by
+ * statement_timeout, the rows produced by its nodes so far are collected to
+ * learn the underestimated ones later: such queries are often the ones which
+ * run long because of a bad estimate.
+ */
+void
+aqo_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count,
+				bool execute_once)
+{
+	MemoryContext oldcontext = CurrentMemoryContext;
+
+	PG_TRY();
+	{
+		if (prev_ExecutorRun_hook)
+			prev_ExecutorRun_hook(queryDesc, direction, count, execute_once);
+		else
+			standard_ExecutorRun(queryDesc, direction, count, execute_once);
+	}
+	PG_CATCH();
+	{
+		if (aqo_learn_on_error &&
+			get_ENR(queryDesc->queryEnv, AQOPrivateData) != NULL)
+		{
+			MemoryContextSwitchTo(oldcontext);
+			learn_on_error(queryDesc);
+		}
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
 /*
  * General hook which runs before ExecutorEnd and collects query execution
  * cardinality statistics.
@@ -428,6 +941,7 @@ aqo_ExecutorEnd(QueryDesc *queryDesc)
 
 	cardinality_sum_errors = 0.;
 	cardinality_num_objects = 0;
+	plan_diverged = false;
 
 	if (!ExtractFromQueryContext(queryDesc))
 		/* AQO keep all query-related preferences at the query context.
@@ -448,15 +962,27 @@ aqo_ExecutorEnd(QueryDesc *queryDesc)
 		query_context.collect_stat = false;
 	}
 
+	/*
+	 * Instrumentation of parallel workers is accumulated into the nodes of
+	 * the leader when the workers are shut down. It is done at the end of
+	 * the execution only if the plan is executed once, so for cursors we
+	 * shut them down here, before learning.
+	 */
+	if (query_context.learn_aqo || query_context.collect_stat)
+		ExecShutdownNode(queryDesc->planstate);
+
 	if ((query_context.learn_aqo || query_context.collect_stat) &&
 		!HasNeverExecutedNodes(queryDesc->planstate, NULL))
 	{
 		aqo_obj_stat ctx = {NIL, NIL, NIL, query_context.learn_aqo};
 
 		learnOnPlanState(queryDesc->planstate, (void *) &ctx);
+		learn_global_objects();
 		list_free(ctx.clauselist);
 		list_free(ctx.relidslist);
 		list_free(ctx.selectivities);
+		replan_if_diverged(queryDesc);
+		flush_spooled_samples();
 	}
 
 	if (query_context.collect_stat)
@@ -571,11 +1097,19 @@ aqo_copy_generic_path_info(PlannerInfo *root, Plan *dest, Path *src)
 	{
 		dest->predicted_cardinality = src->param_info->predicted_ppi_rows;
 		dest->fss_hash = src->param_info->fss_ppi_hash;
+		dest->predicted_model = src->param_info->predicted_ppi_model;
+		dest->predicted_confidence = src->param_info->predicted_ppi_confidence;
+		dest->native_cardinality = src->param_info->native_ppi_rows;
+		dest->prediction_time = src->param_info->ppi_prediction_time;
 	}
 	else
 	{
 		dest->predicted_cardinality = src->parent->predicted_cardinality;
 		dest->fss_hash = src->parent->fss_hash;
+		dest->predicted_model = src->parent->predicted_model;
+		dest->predicted_confidence = src->parent->predicted_confidence;
+		dest->native_cardinality = src->parent->native_cardinality;
+		dest->prediction_time = src->parent->prediction_time;
 	}
 
 	dest->had_path = true;
@@ -704,9 +1238,8 @@ void print_into_explain(PlannedStmt *plannedstmt, IntoClause *into,
 		prev_ExplainOnePlan_hook(plannedstmt, into, es, queryString,
 								params, planduration, queryEnv);
 
-#ifdef AQO_EXPLAIN
-	/* Report to user about aqo state only in verbose mode */
-	if (es->verbose)
+	/* Report to user about aqo state only if asked for */
+	if (aqo_show_details)
 	{
 		ExplainPropertyBool("Using aqo", query_context.use_aqo, es);
 
@@ -746,5 +1279,92 @@ void print_into_explain(PlannedStmt *plannedstmt, IntoClause *into,
 			ExplainPropertyInteger("JOINS", NULL, njoins, es);
 		}
 	}
-#endif
+}
+
+/*
+ * Prints the prediction of AQO for the plan node: the predicted cardinality
+ * and the standard estimate, the model used, its confidence and time of
+ * prediction. With ANALYZE the error of prediction is printed too.
+ * The details are taken from the plan node, so they belong to the planning
+ * which built the plan, even if it was cached. The standard estimate and the
+ * time are known only if aqo.show_details was on during that planning.
+ */
+void
+print_node_explain(ExplainState *es, PlanState *ps, Plan *plan)
+{
+	static const char *const model_names[AQO_NMODELS] = {
+		"ridge", "k-NN", "MLP"
+	};
+	AQO_MODEL	kind;
+	bool		has_details;
+	bool		has_error = false;
+	double		error = 0.;
+
+	if (prev_ExplainOneNode_hook)
+		prev_ExplainOneNode_hook(es, ps, plan);
+
+	if (!aqo_show_details || plan == NULL || !plan->had_path)
+		return;
+
+	/* The feature subspace isn't known if AQO wasn't used */
+	has_details = (plan->fss_hash != 0);
+	kind = (AQO_MODEL) plan->predicted_model;
+
+	if (es->analyze && plan->predicted_cardinality > 0. &&
+		ps->instrument && ps->instrument->nloops > 0)
+	{
+		double		rows = get_node_rows(ps);
+
+		error = 100. * (plan->predicted_cardinality - rows) /
+				plan->predicted_cardinality;
+		has_error = true;
+	}
+
+	if (es->format == EXPLAIN_FORMAT_TEXT)
+	{
+		appendStringInfoSpaces(es->str, es->indent * 2);
+		appendStringInfo(es->str, "AQO: fss=" INT64_FORMAT, plan->fss_hash);
+		if (plan->predicted_cardinality > 0.)
+			appendStringInfo(es->str, " rows=%.0f",
+							 plan->predicted_cardinality);
+		else
+			appendStringInfoString(es->str, " not used");
+		if (has_details)
+		{
+			if (plan->native_cardinality >= 0.)
+				appendStringInfo(es->str, " native=%.0f",
+								 plan->native_cardinality);
+			if (kind != AQO_MODEL_NONE)
+				appendStringInfo(es->str, " model=%s confidence=%.2f",
+								 model_names[kind], plan->predicted_confidence);
+			if (plan->prediction_time >= 0.)
+				appendStringInfo(es->str, " time=%.3f", plan->prediction_time);
+		}
+		if (has_error)
+			appendStringInfo(es->str, " error=%.0f%%", error);
+		appendStringInfoChar(es->str, '\n');
+		return;
+	}
+
+	ExplainPropertyInteger("AQO fss hash", NULL, plan->fss_hash, es);
+	if (plan->predicted_cardinality > 0.)
+		ExplainPropertyFloat("AQO Rows", NULL,
+							 plan->predicted_cardinality, 0, es);
+	if (has_details)
+	{
+		if (plan->native_cardinality >= 0.)
+			ExplainPropertyFloat("AQO Native Rows", NULL,
+								 plan->native_cardinality, 0, es);
+		if (kind != AQO_MODEL_NONE)
+		{
+			ExplainPropertyText("AQO Model", model_names[kind], es);
+			ExplainPropertyFloat("AQO Confidence", NULL,
+								 plan->predicted_confidence, 2, es);
+		}
+		if (plan->prediction_time >= 0.)
+			ExplainPropertyFloat("AQO Prediction Time", "ms",
+								 plan->prediction_time, 3, es);
+	}
+	if (has_error)
+		ExplainPropertyFloat("AQO Error", "%", error, 0, es);
 }
@@ -58,9 +58,24 @@
 
 #include "aqo.h"
 #include "access/parallel.h"
-#include "access/table.h"
+#include "access/xlog.h"
 #include "commands/extension.h"
+#include "utils/inval.h"
 
+/*
+ * Whether the extension is created in the database. It is looked up in
+ * pg_extension only after a relcache invalidation: PG12 has no syscache of
+ * pg_extension, but creation and dropping of the extension create and drop
+ * its tables, which invalidates the relcache.
+ */
+static bool aqo_extension_exists = false;
+static bool aqo_extension_exists_valid = false;
+
+static PlannedStmt *aqo_planner_internal(Query *parse,
+										 int cursorOptions,
+										 ParamListInfo boundParams);
+static bool is_aqo_extension_created(void);
+static void aqo_extension_relcache_callback(Datum arg, Oid relid);
 static bool isQueryUsingSystemRelation(Query *query);
 static bool isQueryUsingSystemRelation_walker(Node *node, void *context);
 
@@ -86,6 +101,42 @@ get_query_text(ParseState *pstate, Query *query)
 		prev_post_parse_analyze_hook(pstate, query);
 }
 
+/*
+ * Registers the callback which invalidates the cached presence of the
+ * extension.
+ */
+void
+init_extension_cache(void)
+{
+	CacheRegisterRelcacheCallback(aqo_extension_relcache_callback,
+								  (Datum) 0);
+}
+
+/*
+ * Any relcache invalidation may mean the extension was created or dropped.
+ * DDL is rare compared to planning, so we needn't be more precise.
+ */
+static void
+aqo_extension_relcache_callback(Datum arg, Oid relid)
+{
+	aqo_extension_exists_valid = false;
+}
+
+/*
+ * Returns whether the extension is created in the current database.
+ */
+static bool
+is_aqo_extension_created(void)
+{
+	if (!aqo_extension_exists_valid)
+	{
+		aqo_extension_exists = OidIsValid(get_extension_oid("aqo", true));
+		aqo_extension_exists_valid = true;
+	}
+
+	return aqo_extension_exists;
+}
+
 /*
  * Calls standard query planner or its previous hook.
  */
@@ -100,6 +151,24 @@ call_default_planner(Query *parse,
 		return standard_planner(parse, cursorOptions, boundParams);
 }
 
+/*
+ * Our planner hook. Wraps the planning into trace points.
+ */
+PlannedStmt *
+aqo_planner(Query *parse,
+			int cursorOptions,
+			ParamListInfo boundParams)
+{
+	PlannedStmt *stmt;
+
+	TRACE_AQO_PLANNER_START(query_text);
+	stmt = aqo_planner_internal(parse, cursorOptions, boundParams);
+	query_context.custom_plan = (boundParams != NULL);
+	TRACE_AQO_PLANNER_DONE(query_context.query_hash, query_context.use_aqo,
+						   query_context.learn_aqo);
+	return stmt;
+}
+
 /*
  * Before query optimization we determine machine learning settings
  * for the query.
@@ -108,14 +177,17 @@ call_default_planner(Query *parse,
  * Creates an entry in aqo_queries for new type of query if it is
  * necessary, i. e. AQO mode is "intelligent".
  */
-PlannedStmt *
-aqo_planner(Query *parse,
-			int cursorOptions,
-			ParamListInfo boundParams)
+static PlannedStmt *
+aqo_planner_internal(Query *parse,
+					 int cursorOptions,
+					 ParamListInfo boundParams)
 {
+	QuerySettings settings;
+	bool		cached;
 	bool		query_is_stored;
-	Datum		query_params[5];
-	bool		query_nulls[5] = {false, false, false, false, false};
+	bool		in_recovery = RecoveryInProgress();
+	int			mode = aqo_mode;
+	bool		collect_stat = force_collect_stat && !in_recovery;
 
 	selectivity_cache_clear();
 
@@ -126,33 +198,54 @@ aqo_planner(Query *parse,
 	  */
 	if ((parse->commandType != CMD_SELECT && parse->commandType != CMD_INSERT &&
 		parse->commandType != CMD_UPDATE && parse->commandType != CMD_DELETE) ||
-		get_extension_oid("aqo", true) == InvalidOid ||
+		!is_aqo_extension_created() ||
 		creating_extension ||
 		IsParallelWorker() ||
-		(aqo_mode == AQO_MODE_DISABLED && !force_collect_stat) ||
-		isQueryUsingSystemRelation(parse) ||
-		RecoveryInProgress())
+		(aqo_mode == AQO_MODE_DISABLED && !collect_stat) ||
+		isQueryUsingSystemRelation(parse))
 	{
 		disable_aqo_for_query();
 		return call_default_planner(parse, cursorOptions, boundParams);
 	}
 
+	/*
+	 * The knowledge base can't be changed on a hot standby, so it is used
+	 * like in the frozen mode. Objects may still be learned for the primary,
+	 * see spool.c.
+	 */
+	if (in_recovery)
+		mode = AQO_MODE_FROZEN;
+
+	/* The knowledge base can be updated now */
+	learn_pending_samples();
+
 	INSTR_TIME_SET_CURRENT(query_context.query_starttime);
 
 	query_context.query_hash = get_query_hash(parse, query_text);
 
-	if (query_is_deactivated(query_context.query_hash))
+	/*
+	 * The query missing in the cache is looked up again if it may be added
+	 * now: another backend may have added it already.
+	 */
+	cached = get_query_settings(query_context.query_hash,
+								mode == AQO_MODE_INTELLIGENT ||
+								mode == AQO_MODE_LEARN ||
+								collect_stat,
+								&settings);
+
+	/* Don't spend time on the deactivated queries */
+	if (cached && settings.stored && !settings.learn_aqo &&
+		!settings.use_aqo && !settings.auto_tuning)
 	{
 		disable_aqo_for_query();
 		return call_default_planner(parse, cursorOptions, boundParams);
 	}
 
-	query_is_stored = find_query(query_context.query_hash, &query_params[0],
-															&query_nulls[0]);
+	query_is_stored = settings.stored;
 
 	if (!query_is_stored)
 	{
-		switch (aqo_mode)
+		switch (mode)
 		{
 			case AQO_MODE_INTELLIGENT:
 				query_context.adding_query = true;
@@ -195,11 +288,11 @@ aqo_planner(Query *parse,
 				query_context.fspace_hash = query_context.query_hash;
 				break;
 			default:
-				elog(ERROR, "unrecognized mode in AQO: %d", aqo_mode);
+				elog(ERROR, "unrecognized mode in AQO: %d", mode);
 				break;
 		}
 
-		if (query_context.adding_query || force_collect_stat)
+		if (query_context.adding_query || collect_stat)
 		{
 			add_query(query_context.query_hash, query_context.learn_aqo,
 					  query_context.use_aqo, query_context.fspace_hash,
@@ -210,28 +303,26 @@ aqo_planner(Query *parse,
 	else
 	{
 		query_context.adding_query = false;
-		query_context.learn_aqo = DatumGetBool(query_params[1]);
-		query_context.use_aqo = DatumGetBool(query_params[2]);
-		query_context.fspace_hash = DatumGetInt32(query_params[3]);
-		query_context.auto_tuning = DatumGetBool(query_params[4]);
+		query_context.learn_aqo = settings.learn_aqo;
+		query_context.use_aqo = settings.use_aqo;
+		query_context.fspace_hash = settings.fspace_hash;
+		query_context.auto_tuning = settings.auto_tuning;
 		query_context.collect_stat = query_context.auto_tuning;
 
-		if (!query_context.learn_aqo && !query_context.use_aqo &&
-			!query_context.auto_tuning)
-			add_deactivated_query(query_context.query_hash);
-
 		/*
 		 * That we can do if query exists in database.
 		 * Additional preference changes, based on AQO mode.
 		 */
-		switch (aqo_mode)
+		switch (mode)
 		{
 		case AQO_MODE_FROZEN:
 			/*
 			 * In this mode we will suppress all writings to the knowledge base.
 			 * AQO will be used for all known queries, if it is not suppressed.
+			 * A hot standby still learns if the objects are spooled.
 			 */
-			query_context.learn_aqo = false;
+			query_context.learn_aqo = in_recovery && aqo_spool_enabled() &&
+				settings.learn_aqo;
 			query_context.auto_tuning = false;
 			query_context.collect_stat = false;
 			break;
@@ -253,7 +344,7 @@ aqo_planner(Query *parse,
 			break;
 
 		default:
-			elog(ERROR, "Unrecognized aqo mode %d", aqo_mode);
+			elog(ERROR, "Unrecognized aqo mode %d", mode);
 		}
 	}
 
@@ -264,7 +355,7 @@ aqo_planner(Query *parse,
 	if (aqo_mode == AQO_MODE_DISABLED)
 		disable_aqo_for_query();
 
-	if (force_collect_stat)
+	if (collect_stat)
 	{
 		/*
 		 * If this GUC is set, AQO will analyze query results and collect
@@ -315,15 +406,13 @@ isQueryUsingSystemRelation_walker(Node *node, void *context)
 		{
 			RangeTblEntry *rte = lfirst(rtable);
 
-			if (rte->rtekind == RTE_RELATION)
-			{
-				Relation	rel = table_open(rte->relid, AccessShareLock);
-				bool		is_catalog = IsCatalogRelation(rel);
-
-				table_close(rel, AccessShareLock);
-				if (is_catalog)
-					return true;
-			}
+			/*
+			 * Catalog relations are recognized by OID, so the relation
+			 * needn't be opened and locked.
+			 */
+			if (rte->rtekind == RTE_RELATION &&
+				IsCatalogRelationOid(rte->relid))
+				return true;
 		}
 
 		return query_tree_walker(query,
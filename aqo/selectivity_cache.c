@@ -20,7 +20,7 @@
 
 typedef struct
 {
-	int			clause_hash;
+	int64		clause_hash;
 	int			relid;
 	int			global_relid;
 	double		selectivity;
@@ -33,7 +33,7 @@ List	   *objects = NIL;
  * of the clause.
  */
 void
-cache_selectivity(int clause_hash,
+cache_selectivity(int64 clause_hash,
 				  int relid,
 				  int global_relid,
 				  double selectivity)
@@ -64,7 +64,7 @@ cache_selectivity(int clause_hash,
  * Restores selectivity for given clause_hash and global_relid.
  */
 double *
-selectivity_cache_find_global_relid(int clause_hash, int global_relid)
+selectivity_cache_find_global_relid(int64 clause_hash, int global_relid)
 {
 	ListCell   *l;
 	Entry	   *cur_element;
@@ -81,6 +81,35 @@ selectivity_cache_find_global_relid(int clause_hash, int global_relid)
 	return NULL;
 }
 
+/*
+ * Returns the copy of the selectivity cache allocated in the current memory
+ * context, which may outlive the planning.
+ */
+List *
+selectivity_cache_copy(void)
+{
+	List	   *res = NIL;
+	ListCell   *l;
+
+	foreach(l, objects)
+	{
+		Entry	   *cur_element = palloc(sizeof(*cur_element));
+
+		memcpy(cur_element, lfirst(l), sizeof(*cur_element));
+		res = lappend(res, cur_element);
+	}
+	return res;
+}
+
+/*
+ * Replaces the selectivity cache with the copy made before.
+ */
+void
+selectivity_cache_set(List *entries)
+{
+	objects = entries;
+}
+
 /*
  * Clears selectivity cache.
  */
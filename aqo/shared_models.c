@@ -0,0 +1,817 @@
+/*
+ *******************************************************************************
+ *
+ *	SHARED KNOWLEDGE BASE
+ *
+ * Databases with the same schema learn the same feature subspaces, but each
+ * one keeps its own aqo_data. If aqo.shared_models is set, the models are
+ * also kept in a cluster-wide store: every learned model is published there,
+ * and every database uses the published model, so all the databases learn
+ * together. The store is used only with aqo.portable_hashes, because hashes
+ * based on OIDs of relations of different databases mean nothing to each
+ * other.
+ *
+ * The store is a file in the data directory which the postmaster maps into
+ * memory at startup, so the backends inherit the mapping and the models are
+ * served at once, without loading them. The file is a header followed by
+ * a fixed number of slots, twice aqo.shared_models, and the entries are
+ * placed by open addressing with linear probing. The following entries are
+ * shifted back into the slot of the removed one, so there are no tombstones.
+ * The operating system writes the changed pages back, and the file is synced
+ * at shutdown. Each entry has a checksum, so an entry torn by a crash of the
+ * system is ignored. The backends of Windows don't inherit the mapping, so
+ * the store isn't supported there.
+ *
+ * The models learned by a transaction are published when it commits, and
+ * until then the transaction itself uses its aqo_data. Deletion of models
+ * from aqo_data, by the user or by aqo_import(), removes them from the store
+ * at once and again at the commit. Each removal advances the epoch of the
+ * removed key, and emptying the store advances the epochs of all keys. The
+ * model is published only if the epoch of its key hasn't changed since the
+ * transaction looked it up, so the removed model can't come back from
+ * a concurrent transaction, while removals of other keys don't hold back the
+ * publication. The epochs are kept per bucket of keys, so a removal also
+ * holds back the few keys of the same bucket.
+ *
+ * An entry has room for a fixed number of features and objects, the models
+ * which don't fit and the global model aren't shared: the entry is removed
+ * when the model outgrows it. New models aren't published when the store is
+ * full; aqo_shared_models_reset() empties it.
+ *
+ *******************************************************************************
+ *
+ * Copyright (c) 2016-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  aqo/shared_models.c
+ *
+ */
+
+#ifndef WIN32
+#include <sys/mman.h>
+#endif
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aqo.h"
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "commands/trigger.h"
+#include "miscadmin.h"
+#include "port/pg_crc32c.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "utils/hashutils.h"
+#include "utils/memutils.h"
+
+#define AQO_SHARED_MODELS_FILE		"aqo_shared_models.map"
+#define AQO_SHARED_MODELS_MAGIC		(0x41514F4E)
+
+/* Room of an entry of the store */
+#define AQO_SHARED_MAX_COLS		(32)
+#define AQO_SHARED_MAX_ROWS		(aqo_K)
+
+/* Number of buckets of keys with their own removal epochs */
+#define AQO_SHARED_EPOCHS		(1024)
+
+typedef struct AqoSharedModelKey
+{
+	int64		fspace_hash;
+	int64		fss_hash;
+} AqoSharedModelKey;
+
+typedef struct AqoSharedModel
+{
+	pg_crc32c	crc;			/* of the rest of the entry */
+	bool		used;
+	AqoSharedModelKey key;
+	int			ncols;
+	int			rows;
+	int			kd_root;
+	int			kd_left[AQO_SHARED_MAX_ROWS];
+	int			kd_right[AQO_SHARED_MAX_ROWS];
+	double		kd_split[AQO_SHARED_MAX_ROWS];
+	double		targets[AQO_SHARED_MAX_ROWS];
+	double		matrix[AQO_SHARED_MAX_ROWS][AQO_SHARED_MAX_COLS];
+	double		weights[AQO_SHARED_MAX_COLS + 1];
+	double		errors[AQO_NMODELS];
+} AqoSharedModel;
+
+/* The file of other layout is created anew */
+typedef struct AqoSharedModelsHeader
+{
+	uint32		magic;
+	uint32		entrysize;
+	uint32		nslots;
+	uint32		nentries;		/* number of used slots */
+	uint64		generation;		/* advanced when the store is emptied */
+	uint64		epochs[AQO_SHARED_EPOCHS];	/* advanced by removals of keys */
+} AqoSharedModelsHeader;
+
+/* The change of the store made at the commit of the transaction */
+typedef struct AqoPendingModel
+{
+	bool		remove;			/* remove the entry rather than publish it */
+	uint64		epoch;			/* of the key when the model was read */
+	AqoSharedModel entry;
+} AqoPendingModel;
+
+/* The epoch of the key when the transaction first looked it up */
+typedef struct AqoSeenModel
+{
+	AqoSharedModelKey key;
+	uint64		epoch;
+} AqoSeenModel;
+
+#define AQO_SHARED_MODELS_SLOTS(header) \
+	((AqoSharedModel *) ((char *) (header) + \
+						 MAXALIGN(sizeof(AqoSharedModelsHeader))))
+
+/* Max number of models in the store, 0 disables it */
+int			aqo_shared_models_max = 0;
+
+static LWLock *shared_models_lock = NULL;
+static AqoSharedModelsHeader *shared_models = NULL;
+#ifndef WIN32
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#endif
+
+/* Changes of the store by the current transaction, in TopTransactionContext */
+static List *pending_models = NIL;
+static bool pending_reset = false;
+
+/* Keys looked up by the current transaction, in TopTransactionContext */
+static List *seen_models = NIL;
+
+#ifndef WIN32
+static void shared_models_shmem_startup(void);
+static void shared_models_shmem_shutdown(int code, Datum arg);
+static void shared_models_map(void);
+#endif
+static bool shared_models_enabled(int64 fss_hash);
+static pg_crc32c shared_model_crc(AqoSharedModel *entry);
+static uint64 shared_model_key_hash(AqoSharedModelKey *key);
+static uint32 shared_model_slot(AqoSharedModelKey *key);
+static uint64 shared_model_epoch(AqoSharedModelKey *key);
+static void shared_model_seen(AqoSharedModelKey *key);
+static uint64 shared_model_seen_epoch(AqoSharedModelKey *key);
+static AqoSharedModel *shared_model_lookup(AqoSharedModelKey *key);
+static void shared_model_remove(AqoSharedModel *entry);
+static void shared_models_clear(void);
+static AqoPendingModel *pending_model(AqoSharedModelKey *key);
+static AqoPendingModel *pending_model_enter(AqoSharedModelKey *key);
+static void shared_models_invalidate(AqoSharedModelKey *key);
+static void shared_models_xact_callback(XactEvent event, void *arg);
+static void shared_models_subxact_callback(SubXactEvent event,
+										   SubTransactionId mySubid,
+										   SubTransactionId parentSubid,
+										   void *arg);
+
+
+/*
+ * Requests the lock of the store. Must be called from _PG_init.
+ */
+void
+shared_models_init(void)
+{
+	if (!process_shared_preload_libraries_in_progress ||
+		aqo_shared_models_max <= 0)
+		return;
+
+#ifndef WIN32
+	RequestNamedLWLockTranche("aqo_shared_models", 1);
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = shared_models_shmem_startup;
+#endif
+
+	RegisterXactCallback(shared_models_xact_callback, NULL);
+	RegisterSubXactCallback(shared_models_subxact_callback, NULL);
+}
+
+/*
+ * GUC check hook of aqo.shared_models.
+ */
+bool
+check_shared_models_max(int *newval, void **extra, GucSource source)
+{
+#ifdef WIN32
+	if (*newval != 0)
+	{
+		GUC_check_errdetail("aqo.shared_models is not supported on Windows.");
+		return false;
+	}
+#endif
+	return true;
+}
+
+#ifndef WIN32
+/*
+ * Attaches to the lock and maps the file, unless the mapping was inherited
+ * from the postmaster. The postmaster syncs the file at shutdown.
+ */
+static void
+shared_models_shmem_startup(void)
+{
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	shared_models_lock = &(GetNamedLWLockTranche("aqo_shared_models"))->lock;
+
+	if (shared_models == NULL)
+		shared_models_map();
+
+	if (!IsUnderPostmaster && shared_models != NULL)
+		on_shmem_exit(shared_models_shmem_shutdown, (Datum) 0);
+}
+
+/*
+ * Syncs the file at the postmaster shutdown.
+ */
+static void
+shared_models_shmem_shutdown(int code, Datum arg)
+{
+	Size		size = MAXALIGN(sizeof(AqoSharedModelsHeader)) +
+					   sizeof(AqoSharedModel) * shared_models->nslots;
+
+	/* After a crash the operating system still writes the pages back */
+	if (code)
+		return;
+
+	if (msync(shared_models, size, MS_SYNC) != 0)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not sync file \"%s\": %m",
+						AQO_SHARED_MODELS_FILE)));
+}
+
+/*
+ * Maps the file of the store, creating it if it doesn't exist or has other
+ * layout. Failures are only logged and leave the store disabled: the models
+ * are also kept in aqo_data of the databases.
+ */
+static void
+shared_models_map(void)
+{
+	uint32		nslots = (uint32) aqo_shared_models_max * 2;
+	Size		size = MAXALIGN(sizeof(AqoSharedModelsHeader)) +
+					   sizeof(AqoSharedModel) * (Size) nslots;
+	AqoSharedModelsHeader *header;
+	struct stat st;
+	bool		valid = false;
+	int			fd;
+
+	fd = BasicOpenFile(AQO_SHARED_MODELS_FILE, O_RDWR | O_CREAT | PG_BINARY);
+	if (fd < 0)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\": %m",
+						AQO_SHARED_MODELS_FILE)));
+		return;
+	}
+
+	if (fstat(fd, &st) == 0 && st.st_size == (off_t) size)
+	{
+		AqoSharedModelsHeader temp;
+
+		valid = (read(fd, &temp, sizeof(temp)) == sizeof(temp) &&
+				 temp.magic == AQO_SHARED_MODELS_MAGIC &&
+				 temp.entrysize == sizeof(AqoSharedModel) &&
+				 temp.nslots == nslots && temp.nentries <= nslots);
+	}
+
+	/* The file is truncated to zero-fill the slots */
+	if (!valid &&
+		(ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t) size) != 0))
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not resize file \"%s\": %m",
+						AQO_SHARED_MODELS_FILE)));
+		close(fd);
+		return;
+	}
+
+	header = (AqoSharedModelsHeader *) mmap(NULL, size,
+											PROT_READ | PROT_WRITE,
+											MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED)
+	{
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not map file \"%s\": %m",
+						AQO_SHARED_MODELS_FILE)));
+		return;
+	}
+
+	if (!valid)
+	{
+		header->magic = AQO_SHARED_MODELS_MAGIC;
+		header->entrysize = sizeof(AqoSharedModel);
+		header->nslots = nslots;
+		header->nentries = 0;
+		header->generation = 0;
+		MemSet(header->epochs, 0, sizeof(header->epochs));
+	}
+
+	shared_models = header;
+}
+
+#endif							/* not WIN32 */
+
+static bool
+shared_models_enabled(int64 fss_hash)
+{
+	return shared_models != NULL && aqo_portable_hashes &&
+		   fss_hash != AQO_GLOBAL_FSS_HASH;
+}
+
+static pg_crc32c
+shared_model_crc(AqoSharedModel *entry)
+{
+	pg_crc32c	crc;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, (char *) entry + sizeof(pg_crc32c),
+				sizeof(AqoSharedModel) - sizeof(pg_crc32c));
+	FIN_CRC32C(crc);
+	return crc;
+}
+
+static uint64
+shared_model_key_hash(AqoSharedModelKey *key)
+{
+	return hash_combine64((uint64) key->fspace_hash, (uint64) key->fss_hash);
+}
+
+/*
+ * Returns the home slot of the key.
+ */
+static uint32
+shared_model_slot(AqoSharedModelKey *key)
+{
+	return shared_model_key_hash(key) % shared_models->nslots;
+}
+
+/*
+ * Returns the removal epoch of the key. The caller must hold the lock.
+ */
+static uint64
+shared_model_epoch(AqoSharedModelKey *key)
+{
+	return shared_models->generation +
+		   shared_models->epochs[shared_model_key_hash(key) % AQO_SHARED_EPOCHS];
+}
+
+/*
+ * Remembers the epoch of the key when the current transaction looks it up
+ * for the first time. The caller must hold the lock.
+ */
+static void
+shared_model_seen(AqoSharedModelKey *key)
+{
+	AqoSeenModel *seen;
+	MemoryContext oldCxt;
+	ListCell   *lc;
+
+	foreach(lc, seen_models)
+	{
+		seen = (AqoSeenModel *) lfirst(lc);
+		if (seen->key.fspace_hash == key->fspace_hash &&
+			seen->key.fss_hash == key->fss_hash)
+			return;
+	}
+
+	oldCxt = MemoryContextSwitchTo(TopTransactionContext);
+	seen = palloc(sizeof(AqoSeenModel));
+	seen->key = *key;
+	seen->epoch = shared_model_epoch(key);
+	seen_models = lappend(seen_models, seen);
+	MemoryContextSwitchTo(oldCxt);
+}
+
+/*
+ * Returns the epoch of the key when the current transaction looked it up, or
+ * the current one if it didn't.
+ */
+static uint64
+shared_model_seen_epoch(AqoSharedModelKey *key)
+{
+	uint64		epoch;
+	ListCell   *lc;
+
+	foreach(lc, seen_models)
+	{
+		AqoSeenModel *seen = (AqoSeenModel *) lfirst(lc);
+
+		if (seen->key.fspace_hash == key->fspace_hash &&
+			seen->key.fss_hash == key->fss_hash)
+			return seen->epoch;
+	}
+
+	LWLockAcquire(shared_models_lock, LW_SHARED);
+	epoch = shared_model_epoch(key);
+	LWLockRelease(shared_models_lock);
+	return epoch;
+}
+
+/*
+ * Returns the slot of the key: the used one or the free one where the key
+ * would be placed. The store always has free slots, so the probing stops.
+ * The caller must hold the lock.
+ */
+static AqoSharedModel *
+shared_model_lookup(AqoSharedModelKey *key)
+{
+	AqoSharedModel *slots = AQO_SHARED_MODELS_SLOTS(shared_models);
+	uint32		nslots = shared_models->nslots;
+	uint32		i = shared_model_slot(key);
+
+	while (slots[i].used &&
+		   (slots[i].key.fspace_hash != key->fspace_hash ||
+			slots[i].key.fss_hash != key->fss_hash))
+		i = (i + 1) % nslots;
+
+	return &slots[i];
+}
+
+/*
+ * Frees the used slot. The following entries of the probing sequence which
+ * can't be found past the freed slot are moved into it. The caller must hold
+ * the lock exclusively.
+ */
+static void
+shared_model_remove(AqoSharedModel *entry)
+{
+	AqoSharedModel *slots = AQO_SHARED_MODELS_SLOTS(shared_models);
+	uint32		nslots = shared_models->nslots;
+	uint32		i = entry - slots;
+	uint32		j = i;
+
+	shared_models->epochs[shared_model_key_hash(&entry->key) %
+						  AQO_SHARED_EPOCHS]++;
+
+	for (;;)
+	{
+		uint32		home;
+
+		j = (j + 1) % nslots;
+		if (!slots[j].used)
+			break;
+
+		/* The entry stays if its home slot is cyclically within (i, j] */
+		home = shared_model_slot(&slots[j].key);
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+
+		slots[i] = slots[j];
+		i = j;
+	}
+
+	MemSet(&slots[i], 0, sizeof(AqoSharedModel));
+	shared_models->nentries--;
+}
+
+/*
+ * Removes all entries. The caller must hold the lock exclusively.
+ */
+static void
+shared_models_clear(void)
+{
+	MemSet(AQO_SHARED_MODELS_SLOTS(shared_models), 0,
+		   sizeof(AqoSharedModel) * shared_models->nslots);
+	shared_models->nentries = 0;
+	shared_models->generation++;
+}
+
+/*
+ * Returns the change of the entry of the key made by the current transaction,
+ * or NULL.
+ */
+static AqoPendingModel *
+pending_model(AqoSharedModelKey *key)
+{
+	ListCell   *lc;
+
+	foreach(lc, pending_models)
+	{
+		AqoPendingModel *pending = (AqoPendingModel *) lfirst(lc);
+
+		if (pending->entry.key.fspace_hash == key->fspace_hash &&
+			pending->entry.key.fss_hash == key->fss_hash)
+			return pending;
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns the change of the entry of the key made by the current transaction,
+ * adding a new one if there is none.
+ */
+static AqoPendingModel *
+pending_model_enter(AqoSharedModelKey *key)
+{
+	AqoPendingModel *pending = pending_model(key);
+	MemoryContext oldCxt;
+
+	if (pending != NULL)
+		return pending;
+
+	oldCxt = MemoryContextSwitchTo(TopTransactionContext);
+	pending = palloc0(sizeof(AqoPendingModel));
+	pending->entry.key = *key;
+	pending_models = lappend(pending_models, pending);
+	MemoryContextSwitchTo(oldCxt);
+
+	return pending;
+}
+
+/*
+ * Copies the published model of the feature subspace into the model
+ * allocated by palloc_fss_model(ncols). Returns false if there is none, or if
+ * the current transaction has changed the model, so it is in aqo_data.
+ */
+bool
+shared_model_load(int64 fspace_hash, int64 fss_hash, int ncols,
+				  AqoFssModel *model)
+{
+	AqoSharedModelKey key;
+	AqoSharedModel *entry;
+	int			i;
+
+	if (!shared_models_enabled(fss_hash))
+		return false;
+
+	key.fspace_hash = fspace_hash;
+	key.fss_hash = fss_hash;
+
+	LWLockAcquire(shared_models_lock, LW_SHARED);
+	shared_model_seen(&key);
+	if (pending_reset || pending_model(&key) != NULL)
+	{
+		LWLockRelease(shared_models_lock);
+		return false;
+	}
+
+	entry = shared_model_lookup(&key);
+	if (!entry->used || entry->ncols != ncols ||
+		entry->rows < 0 || entry->rows > AQO_SHARED_MAX_ROWS ||
+		entry->crc != shared_model_crc(entry))
+	{
+		LWLockRelease(shared_models_lock);
+		return false;
+	}
+
+	fss_model_reserve(model, entry->rows);
+	model->rows = entry->rows;
+	model->kd_root = entry->kd_root;
+	for (i = 0; i < entry->rows; ++i)
+		memcpy(model->matrix[i], entry->matrix[i], sizeof(double) * ncols);
+	memcpy(model->targets, entry->targets, sizeof(double) * entry->rows);
+	memcpy(model->kd_left, entry->kd_left, sizeof(int) * entry->rows);
+	memcpy(model->kd_right, entry->kd_right, sizeof(int) * entry->rows);
+	memcpy(model->kd_split, entry->kd_split, sizeof(double) * entry->rows);
+	memcpy(model->weights, entry->weights, sizeof(double) * (ncols + 1));
+	memcpy(model->errors, entry->errors, sizeof(model->errors));
+	LWLockRelease(shared_models_lock);
+
+	if (model->kd_root < 0)
+		kd_build(model);
+
+	return true;
+}
+
+/*
+ * Publishes the model of the feature subspace, if it fits into an entry, when
+ * the current transaction commits. Otherwise the entry is removed then.
+ */
+void
+shared_model_store(int64 fspace_hash, int64 fss_hash, AqoFssModel *model)
+{
+	AqoSharedModelKey key;
+	AqoPendingModel *pending;
+	AqoSharedModel *entry;
+	int			ncols = model->ncols;
+	int			i;
+
+	if (!shared_models_enabled(fss_hash))
+		return;
+
+	key.fspace_hash = fspace_hash;
+	key.fss_hash = fss_hash;
+
+	pending = pending_model_enter(&key);
+
+	pending->remove = (ncols > AQO_SHARED_MAX_COLS ||
+					   model->rows > AQO_SHARED_MAX_ROWS);
+	pending->epoch = shared_model_seen_epoch(&key);
+	if (pending->remove)
+		return;
+
+	entry = &pending->entry;
+	entry->used = true;
+	entry->ncols = ncols;
+	entry->rows = model->rows;
+	/* The moved objects aren't stored, so the tree is rebuilt by the reader */
+	entry->kd_root = model->kd_nmoved > 0 ? -1 : model->kd_root;
+	for (i = 0; i < model->rows; ++i)
+		memcpy(entry->matrix[i], model->matrix[i], sizeof(double) * ncols);
+	memcpy(entry->targets, model->targets, sizeof(double) * model->rows);
+	memcpy(entry->kd_left, model->kd_left, sizeof(int) * model->rows);
+	memcpy(entry->kd_right, model->kd_right, sizeof(int) * model->rows);
+	memcpy(entry->kd_split, model->kd_split, sizeof(double) * model->rows);
+	memcpy(entry->weights, model->weights, sizeof(double) * (ncols + 1));
+	memcpy(entry->errors, model->errors, sizeof(entry->errors));
+	entry->crc = shared_model_crc(entry);
+}
+
+/*
+ * Removes the model of the key, or all models if key is NULL, from the store
+ * at once and again when the current transaction commits.
+ */
+static void
+shared_models_invalidate(AqoSharedModelKey *key)
+{
+	AqoPendingModel *pending;
+	AqoSharedModel *entry;
+
+	if (shared_models == NULL)
+		return;
+
+	LWLockAcquire(shared_models_lock, LW_EXCLUSIVE);
+	if (key == NULL)
+		shared_models_clear();
+	else
+	{
+		entry = shared_model_lookup(key);
+		if (entry->used)
+			shared_model_remove(entry);
+	}
+	LWLockRelease(shared_models_lock);
+
+	if (key == NULL)
+	{
+		pending_reset = true;
+		return;
+	}
+
+	pending = pending_model_enter(key);
+	pending->remove = true;
+}
+
+/*
+ * Removes all models from the store. Used by aqo_import(), which bypasses
+ * triggers of aqo_data.
+ */
+void
+shared_models_invalidate_all(void)
+{
+	shared_models_invalidate(NULL);
+}
+
+/*
+ * Applies the changes of the store made by the transaction when it commits.
+ * The prepared transaction is committed by another backend, so at PREPARE
+ * the changed entries are only removed. The changes of the aborted
+ * transaction are forgotten.
+ */
+static void
+shared_models_xact_callback(XactEvent event, void *arg)
+{
+	bool		publish;
+	ListCell   *lc;
+
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+			publish = true;
+			break;
+		case XACT_EVENT_PREPARE:
+			publish = false;
+			break;
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+			pending_models = NIL;
+			seen_models = NIL;
+			pending_reset = false;
+			return;
+		default:
+			return;
+	}
+
+	/* The list itself is freed with TopTransactionContext */
+	seen_models = NIL;
+
+	if (shared_models == NULL || (pending_models == NIL && !pending_reset))
+		return;
+
+	LWLockAcquire(shared_models_lock, LW_EXCLUSIVE);
+	if (pending_reset)
+		shared_models_clear();
+
+	foreach(lc, pending_models)
+	{
+		AqoPendingModel *pending = (AqoPendingModel *) lfirst(lc);
+		AqoSharedModel *entry = shared_model_lookup(&pending->entry.key);
+
+		if (pending->remove || !publish)
+		{
+			if (entry->used)
+				shared_model_remove(entry);
+			continue;
+		}
+
+		/* The model may have been removed since it was read */
+		if (pending->epoch != shared_model_epoch(&pending->entry.key) ||
+			(!entry->used &&
+			 shared_models->nentries >= aqo_shared_models_max))
+			continue;
+
+		if (!entry->used)
+			shared_models->nentries++;
+		*entry = pending->entry;
+	}
+	LWLockRelease(shared_models_lock);
+
+	/* The list itself is freed with TopTransactionContext */
+	pending_models = NIL;
+	pending_reset = false;
+}
+
+/*
+ * The models learned by the aborted subtransaction aren't in aqo_data, so
+ * the transaction only removes their entries.
+ */
+static void
+shared_models_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+							   SubTransactionId parentSubid, void *arg)
+{
+	ListCell   *lc;
+
+	if (event != SUBXACT_EVENT_ABORT_SUB)
+		return;
+
+	foreach(lc, pending_models)
+		((AqoPendingModel *) lfirst(lc))->remove = true;
+}
+
+PG_FUNCTION_INFO_V1(aqo_data_invalidate_shared_models);
+
+/*
+ * Trigger of aqo_data, which removes the models deleted or changed by the
+ * user from the store and from the caches of backends.
+ */
+Datum
+aqo_data_invalidate_shared_models(PG_FUNCTION_ARGS)
+{
+	TriggerData *trigdata = (TriggerData *) fcinfo->context;
+	AqoSharedModelKey key;
+	bool		isnull;
+
+	if (!CALLED_AS_TRIGGER(fcinfo))
+		elog(ERROR, "aqo_data_invalidate_shared_models: not fired by trigger manager");
+
+	invalidate_fss_models_cache();
+
+	if (TRIGGER_FIRED_BY_TRUNCATE(trigdata->tg_event))
+	{
+		shared_models_invalidate(NULL);
+		return PointerGetDatum(NULL);
+	}
+
+	key.fspace_hash = DatumGetInt64(heap_getattr(trigdata->tg_trigtuple, 1,
+												 trigdata->tg_relation->rd_att,
+												 &isnull));
+	key.fss_hash = DatumGetInt64(heap_getattr(trigdata->tg_trigtuple, 2,
+											  trigdata->tg_relation->rd_att,
+											  &isnull));
+	shared_models_invalidate(&key);
+
+	return PointerGetDatum(NULL);
+}
+
+PG_FUNCTION_INFO_V1(aqo_shared_models_reset);
+
+/*
+ * Removes all models from the store. Returns the number of removed models.
+ */
+Datum
+aqo_shared_models_reset(PG_FUNCTION_ARGS)
+{
+	int64		num;
+
+	if (shared_models == NULL)
+		PG_RETURN_INT64(0);
+
+	LWLockAcquire(shared_models_lock, LW_EXCLUSIVE);
+	num = shared_models->nentries;
+	shared_models_clear();
+	LWLockRelease(shared_models_lock);
+
+	PG_RETURN_INT64(num);
+}
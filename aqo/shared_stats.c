@@ -0,0 +1,651 @@
+/*
+ *******************************************************************************
+ *
+ *	SHARED STATISTICS
+ *
+ * Cluster-wide counters of the extension's hot paths: predictions, loads of
+ * feature subspaces, learning and time spent in them. The counters live in
+ * shared memory, so they are available only if the extension is loaded by
+ * shared_preload_libraries; otherwise updates are no-ops and the view shows
+ * nothing. Counters are reset by aqo_stat_reset(), like pg_stat_statements.
+ *
+ * Besides, for each feature subspace a histogram of q-errors of cardinality
+ * estimates is kept: the bucket i counts errors in [2^i, 2^(i+1)). Two moving
+ * averages of the logarithm of q-error, the short-term and the long-term one,
+ * detect the drift: the subspace is marked as drifting when the short-term
+ * error exceeds the long-term one by aqo.drift_threshold. The histograms are
+ * saved into a file at shutdown and every aqo.fss_stats_save_interval
+ * seconds by the backend which notices the interval has elapsed, and are
+ * loaded at startup. The backend copies them under the lock and writes the
+ * copy without it. When there are aqo.fss_stats_max subspaces, the one
+ * updated least recently gives way to the new one.
+ *
+ * The segment also holds the generations of aqo_queries and aqo_data, which
+ * are advanced by each committed change of the table and invalidate the
+ * backend-local caches of query settings and of models.
+ *
+ *******************************************************************************
+ *
+ * Copyright (c) 2016-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  aqo/shared_stats.c
+ *
+ */
+
+#include <unistd.h>
+
+#include "aqo.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/timestamp.h"
+
+#define AQO_FSS_STATS_FILE		PGSTAT_STAT_PERMANENT_DIRECTORY "/aqo_fss_stats.stat"
+#define AQO_FSS_STATS_MAGIC		(0x41514F02)
+
+/* Weights of a new sample in the short-term and long-term moving averages */
+#define AQO_DRIFT_SHORT_ALPHA	(0.2)
+#define AQO_DRIFT_LONG_ALPHA	(0.02)
+
+/* The drift isn't detected until the subspace has so many samples */
+#define AQO_DRIFT_MIN_SAMPLES	(10)
+
+typedef struct AqoSharedStats
+{
+	pg_atomic_uint64 counters[AQO_NSTATS];
+	pg_atomic_uint64 stats_reset;	/* TimestampTz of the last reset */
+	pg_atomic_uint64 queries_generation;	/* see aqo_queries_changed */
+	pg_atomic_uint64 data_generation;	/* see aqo_data_changed */
+
+	LWLock	   *lock;			/* protects the fields below and fss_stats */
+	TimestampTz last_save;		/* last time fss_stats were saved */
+} AqoSharedStats;
+
+typedef struct AqoFssStatKey
+{
+	int64		fspace_hash;
+	int64		fss_hash;
+} AqoFssStatKey;
+
+typedef struct AqoFssStatEntry
+{
+	AqoFssStatKey key;			/* hash key */
+	int64		nsamples;
+	int64		histogram[AQO_FSS_STAT_NBUCKETS];
+	double		short_error;	/* moving averages of log(q-error) */
+	double		long_error;
+	bool		drifting;
+	TimestampTz last_update;
+} AqoFssStatEntry;
+
+/* Max number of feature subspaces with the statistics, 0 disables them */
+int			aqo_fss_stats_max = 5000;
+
+/* Difference of the moving averages of log(q-error) that is the drift */
+double		aqo_drift_threshold = 0.7;
+
+/* Interval in seconds between saves of the statistics, 0 - only at shutdown */
+int			aqo_fss_stats_save_interval = 300;
+
+static AqoSharedStats *aqo_shared_stats = NULL;
+static HTAB *fss_stats = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static void aqo_stat_shmem_startup(void);
+static void aqo_stat_shmem_shutdown(int code, Datum arg);
+static Size aqo_stat_shmem_size(void);
+static void fss_stats_load(void);
+static void fss_stats_save(bool durable);
+static void fss_stats_evict(void);
+
+
+static Size
+aqo_stat_shmem_size(void)
+{
+	Size		size = MAXALIGN(sizeof(AqoSharedStats));
+
+	if (aqo_fss_stats_max > 0)
+		size = add_size(size, hash_estimate_size(aqo_fss_stats_max,
+												 sizeof(AqoFssStatEntry)));
+	return size;
+}
+
+/*
+ * Requests shared memory for the counters. Must be called from _PG_init.
+ */
+void
+aqo_stat_init(void)
+{
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	RequestAddinShmemSpace(aqo_stat_shmem_size());
+	RequestNamedLWLockTranche("aqo", 1);
+
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = aqo_stat_shmem_startup;
+}
+
+/*
+ * Allocates or attaches to the shared counters and the statistics of feature
+ * subspaces. The postmaster loads the latter from the file and saves them
+ * back at shutdown.
+ */
+static void
+aqo_stat_shmem_startup(void)
+{
+	bool		found;
+	int			i;
+
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	aqo_shared_stats = ShmemInitStruct("AQO shared statistics",
+									   sizeof(AqoSharedStats), &found);
+	if (!found)
+	{
+		for (i = 0; i < AQO_NSTATS; ++i)
+			pg_atomic_init_u64(&aqo_shared_stats->counters[i], 0);
+		pg_atomic_init_u64(&aqo_shared_stats->stats_reset,
+						   (uint64) GetCurrentTimestamp());
+		pg_atomic_init_u64(&aqo_shared_stats->queries_generation, 1);
+		pg_atomic_init_u64(&aqo_shared_stats->data_generation, 1);
+		aqo_shared_stats->lock = &(GetNamedLWLockTranche("aqo"))->lock;
+		aqo_shared_stats->last_save = GetCurrentTimestamp();
+	}
+
+	if (aqo_fss_stats_max > 0)
+	{
+		HASHCTL		info;
+
+		MemSet(&info, 0, sizeof(info));
+		info.keysize = sizeof(AqoFssStatKey);
+		info.entrysize = sizeof(AqoFssStatEntry);
+		fss_stats = ShmemInitHash("AQO feature subspace statistics",
+								  aqo_fss_stats_max, aqo_fss_stats_max,
+								  &info, HASH_ELEM | HASH_BLOBS);
+	}
+	LWLockRelease(AddinShmemInitLock);
+
+	if (IsUnderPostmaster || fss_stats == NULL)
+		return;
+
+	fss_stats_load();
+	on_shmem_exit(aqo_stat_shmem_shutdown, (Datum) 0);
+}
+
+/*
+ * Saves the statistics of feature subspaces at the postmaster shutdown.
+ */
+static void
+aqo_stat_shmem_shutdown(int code, Datum arg)
+{
+	/* Don't save the statistics after a crash */
+	if (code)
+		return;
+
+	fss_stats_save(true);
+}
+
+/*
+ * Loads the statistics of feature subspaces from the file, if it exists.
+ * The file of other format or of other version is ignored.
+ */
+static void
+fss_stats_load(void)
+{
+	FILE	   *file;
+	uint32		header;
+	int32		num;
+	int32		i;
+
+	file = AllocateFile(AQO_FSS_STATS_FILE, PG_BINARY_R);
+	if (file == NULL)
+	{
+		if (errno != ENOENT)
+			ereport(LOG,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m",
+							AQO_FSS_STATS_FILE)));
+		return;
+	}
+
+	if (fread(&header, sizeof(uint32), 1, file) != 1 ||
+		header != AQO_FSS_STATS_MAGIC ||
+		fread(&num, sizeof(int32), 1, file) != 1)
+		goto error;
+
+	for (i = 0; i < num && hash_get_num_entries(fss_stats) < aqo_fss_stats_max;
+		 ++i)
+	{
+		AqoFssStatEntry temp;
+		AqoFssStatEntry *entry;
+
+		if (fread(&temp, sizeof(AqoFssStatEntry), 1, file) != 1)
+			goto error;
+
+		entry = (AqoFssStatEntry *) hash_search(fss_stats, &temp.key,
+												HASH_ENTER, NULL);
+		memcpy(entry, &temp, sizeof(AqoFssStatEntry));
+	}
+
+	FreeFile(file);
+	return;
+
+error:
+	ereport(LOG,
+			(errcode(ERRCODE_DATA_CORRUPTED),
+			 errmsg("ignoring invalid data in file \"%s\"",
+					AQO_FSS_STATS_FILE)));
+	FreeFile(file);
+}
+
+/*
+ * Writes the statistics of feature subspaces into the file. They are copied
+ * under the lock, so the queries aren't blocked by the writing. The periodic
+ * save isn't synced to disk to not stall the query which does it, only the
+ * save at shutdown is durable. Failures are only logged: the statistics
+ * aren't worth an error of the query.
+ */
+static void
+fss_stats_save(bool durable)
+{
+	FILE	   *file;
+	uint32		header = AQO_FSS_STATS_MAGIC;
+	int32		num;
+	int32		i = 0;
+	AqoFssStatEntry *entries;
+	HASH_SEQ_STATUS hash_seq;
+	AqoFssStatEntry *entry;
+
+	LWLockAcquire(aqo_shared_stats->lock, LW_SHARED);
+	num = hash_get_num_entries(fss_stats);
+	entries = palloc(sizeof(AqoFssStatEntry) * Max(num, 1));
+	hash_seq_init(&hash_seq, fss_stats);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		memcpy(&entries[i++], entry, sizeof(AqoFssStatEntry));
+	LWLockRelease(aqo_shared_stats->lock);
+
+	file = AllocateFile(AQO_FSS_STATS_FILE ".tmp", PG_BINARY_W);
+	if (file == NULL)
+		goto error;
+
+	if (fwrite(&header, sizeof(uint32), 1, file) != 1 ||
+		fwrite(&num, sizeof(int32), 1, file) != 1 ||
+		(num > 0 &&
+		 fwrite(entries, sizeof(AqoFssStatEntry), num, file) != (size_t) num))
+		goto error;
+
+	if (FreeFile(file))
+	{
+		file = NULL;
+		goto error;
+	}
+	pfree(entries);
+
+	if (durable)
+		(void) durable_rename(AQO_FSS_STATS_FILE ".tmp", AQO_FSS_STATS_FILE,
+							  LOG);
+	else if (rename(AQO_FSS_STATS_FILE ".tmp", AQO_FSS_STATS_FILE) != 0)
+		ereport(LOG,
+				(errcode_for_file_access(),
+				 errmsg("could not rename file \"%s\" to \"%s\": %m",
+						AQO_FSS_STATS_FILE ".tmp", AQO_FSS_STATS_FILE)));
+	return;
+
+error:
+	ereport(LOG,
+			(errcode_for_file_access(),
+			 errmsg("could not write file \"%s\": %m",
+					AQO_FSS_STATS_FILE ".tmp")));
+	if (file)
+		FreeFile(file);
+	unlink(AQO_FSS_STATS_FILE ".tmp");
+	pfree(entries);
+}
+
+/*
+ * Removes the statistics of the feature subspace updated least recently to
+ * make room for a new one. Called under the exclusive lock.
+ */
+static void
+fss_stats_evict(void)
+{
+	HASH_SEQ_STATUS hash_seq;
+	AqoFssStatEntry *entry;
+	AqoFssStatKey victim;
+	TimestampTz oldest = 0;
+	bool		found = false;
+
+	hash_seq_init(&hash_seq, fss_stats);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		if (!found || entry->last_update < oldest)
+		{
+			victim = entry->key;
+			oldest = entry->last_update;
+			found = true;
+		}
+	}
+
+	if (found)
+		hash_search(fss_stats, &victim, HASH_REMOVE, NULL);
+}
+
+/*
+ * Adds the q-error of the cardinality estimate to the statistics of the
+ * feature subspace and updates its drift state. If there are already
+ * aqo.fss_stats_max subspaces, the new one replaces the least recently
+ * updated one.
+ */
+void
+aqo_fss_stat_update(int64 fspace_hash, int64 fss_hash,
+					double predicted, double actual)
+{
+	AqoFssStatKey key;
+	AqoFssStatEntry *entry;
+	double		error;
+	int			bucket;
+	bool		save = false;
+	TimestampTz now;
+
+	if (fss_stats == NULL)
+		return;
+
+	/* Both cardinalities are clamped to be not less than 1 */
+	error = fabs(log(predicted) - log(actual));
+	bucket = (int) Min(error / M_LN2, AQO_FSS_STAT_NBUCKETS - 1);
+
+	MemSet(&key, 0, sizeof(key));
+	key.fspace_hash = fspace_hash;
+	key.fss_hash = fss_hash;
+	now = GetCurrentTimestamp();
+
+	LWLockAcquire(aqo_shared_stats->lock, LW_EXCLUSIVE);
+
+	entry = (AqoFssStatEntry *) hash_search(fss_stats, &key, HASH_FIND, NULL);
+	if (entry == NULL)
+	{
+		if (hash_get_num_entries(fss_stats) >= aqo_fss_stats_max)
+			fss_stats_evict();
+
+		entry = (AqoFssStatEntry *) hash_search(fss_stats, &key,
+												HASH_ENTER, NULL);
+		memset(&entry->nsamples, 0,
+			   sizeof(AqoFssStatEntry) - offsetof(AqoFssStatEntry, nsamples));
+		entry->short_error = error;
+		entry->long_error = error;
+	}
+
+	entry->nsamples++;
+	entry->histogram[bucket]++;
+	entry->short_error += AQO_DRIFT_SHORT_ALPHA * (error - entry->short_error);
+	entry->long_error += AQO_DRIFT_LONG_ALPHA * (error - entry->long_error);
+	entry->drifting = (entry->nsamples >= AQO_DRIFT_MIN_SAMPLES &&
+					   entry->short_error >
+					   entry->long_error + aqo_drift_threshold);
+	entry->last_update = now;
+
+	if (aqo_fss_stats_save_interval > 0 &&
+		TimestampDifferenceExceeds(aqo_shared_stats->last_save, now,
+								   aqo_fss_stats_save_interval * 1000))
+	{
+		aqo_shared_stats->last_save = now;
+		save = true;
+	}
+
+	LWLockRelease(aqo_shared_stats->lock);
+
+	if (save)
+		fss_stats_save(false);
+}
+
+/*
+ * Adds value to the counter.
+ */
+void
+aqo_stat_add(AqoStatCounter counter, uint64 value)
+{
+	if (aqo_shared_stats == NULL)
+		return;
+
+	pg_atomic_fetch_add_u64(&aqo_shared_stats->counters[counter], value);
+}
+
+/*
+ * Starts measurement of time for aqo_stat_add_time.
+ */
+void
+aqo_stat_start(instr_time *start)
+{
+	if (aqo_shared_stats != NULL)
+		INSTR_TIME_SET_CURRENT(*start);
+}
+
+/*
+ * Adds time in microseconds elapsed from aqo_stat_start to the counter.
+ */
+void
+aqo_stat_add_time(AqoStatCounter counter, instr_time *start)
+{
+	instr_time	end;
+
+	if (aqo_shared_stats == NULL)
+		return;
+
+	INSTR_TIME_SET_CURRENT(end);
+	INSTR_TIME_SUBTRACT(end, *start);
+	pg_atomic_fetch_add_u64(&aqo_shared_stats->counters[counter],
+							INSTR_TIME_GET_MICROSEC(end));
+}
+
+/*
+ * Returns the generation of aqo_queries into *generation, or false if there
+ * is no shared memory and caches of other backends can't be invalidated.
+ */
+bool
+aqo_queries_generation(uint64 *generation)
+{
+	if (aqo_shared_stats == NULL)
+		return false;
+
+	*generation = pg_atomic_read_u64(&aqo_shared_stats->queries_generation);
+	return true;
+}
+
+/*
+ * Advances the generation of aqo_queries. Must be called after the change of
+ * the table is committed, so the backends reload the settings they see.
+ */
+void
+aqo_queries_changed(void)
+{
+	if (aqo_shared_stats == NULL)
+		return;
+
+	pg_atomic_fetch_add_u64(&aqo_shared_stats->queries_generation, 1);
+}
+
+/*
+ * Returns the generation of aqo_data into *generation, or false if there is
+ * no shared memory.
+ */
+bool
+aqo_data_generation(uint64 *generation)
+{
+	if (aqo_shared_stats == NULL)
+		return false;
+
+	*generation = pg_atomic_read_u64(&aqo_shared_stats->data_generation);
+	return true;
+}
+
+/*
+ * Advances the generation of aqo_data. Must be called after the change of the
+ * table is committed. Returns the generation before the change.
+ */
+uint64
+aqo_data_changed(void)
+{
+	if (aqo_shared_stats == NULL)
+		return 0;
+
+	return pg_atomic_fetch_add_u64(&aqo_shared_stats->data_generation, 1);
+}
+
+PG_FUNCTION_INFO_V1(aqo_stat);
+
+/*
+ * Returns the shared counters as one row.
+ */
+Datum
+aqo_stat(PG_FUNCTION_ARGS)
+{
+	TupleDesc	tupdesc;
+	Datum		values[AQO_NSTATS + 1];
+	bool		nulls[AQO_NSTATS + 1];
+	int			i;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (aqo_shared_stats == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("AQO shared statistics must be loaded via shared_preload_libraries")));
+
+	for (i = 0; i < AQO_NSTATS; ++i)
+	{
+		values[i] = Int64GetDatum((int64)
+						pg_atomic_read_u64(&aqo_shared_stats->counters[i]));
+		nulls[i] = false;
+	}
+	values[AQO_NSTATS] = TimestampTzGetDatum((TimestampTz)
+						pg_atomic_read_u64(&aqo_shared_stats->stats_reset));
+	nulls[AQO_NSTATS] = false;
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+PG_FUNCTION_INFO_V1(aqo_stat_reset);
+
+/*
+ * Resets the shared counters.
+ */
+Datum
+aqo_stat_reset(PG_FUNCTION_ARGS)
+{
+	int			i;
+
+	if (aqo_shared_stats == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("AQO shared statistics must be loaded via shared_preload_libraries")));
+
+	for (i = 0; i < AQO_NSTATS; ++i)
+		pg_atomic_write_u64(&aqo_shared_stats->counters[i], 0);
+	pg_atomic_write_u64(&aqo_shared_stats->stats_reset,
+						(uint64) GetCurrentTimestamp());
+
+	PG_RETURN_VOID();
+}
+
+PG_FUNCTION_INFO_V1(aqo_fss_stats);
+
+/*
+ * Returns the q-error histogram and the drift state of each tracked feature
+ * subspace.
+ */
+Datum
+aqo_fss_stats(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext oldcontext;
+	HASH_SEQ_STATUS hash_seq;
+	AqoFssStatEntry *entry;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		!(rsinfo->allowedModes & SFRM_Materialize))
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+
+	if (fss_stats == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("AQO feature subspace statistics must be loaded via shared_preload_libraries and aqo.fss_stats_max must be positive")));
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	LWLockAcquire(aqo_shared_stats->lock, LW_SHARED);
+	hash_seq_init(&hash_seq, fss_stats);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+	{
+		Datum		values[8];
+		bool		nulls[8] = {false, false, false, false,
+								false, false, false, false};
+		Datum		buckets[AQO_FSS_STAT_NBUCKETS];
+		int			i;
+
+		for (i = 0; i < AQO_FSS_STAT_NBUCKETS; ++i)
+			buckets[i] = Int64GetDatum(entry->histogram[i]);
+
+		values[0] = Int64GetDatum(entry->key.fspace_hash);
+		values[1] = Int64GetDatum(entry->key.fss_hash);
+		values[2] = Int64GetDatum(entry->nsamples);
+		values[3] = PointerGetDatum(construct_array(buckets,
+													AQO_FSS_STAT_NBUCKETS,
+													INT8OID, 8,
+													FLOAT8PASSBYVAL, 'd'));
+		values[4] = Float8GetDatum(exp(entry->short_error));
+		values[5] = Float8GetDatum(exp(entry->long_error));
+		values[6] = BoolGetDatum(entry->drifting);
+		values[7] = TimestampTzGetDatum(entry->last_update);
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	LWLockRelease(aqo_shared_stats->lock);
+
+	return (Datum) 0;
+}
+
+PG_FUNCTION_INFO_V1(aqo_fss_stats_reset);
+
+/*
+ * Removes the statistics of all feature subspaces.
+ */
+Datum
+aqo_fss_stats_reset(PG_FUNCTION_ARGS)
+{
+	HASH_SEQ_STATUS hash_seq;
+	AqoFssStatEntry *entry;
+
+	if (fss_stats == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("AQO feature subspace statistics must be loaded via shared_preload_libraries and aqo.fss_stats_max must be positive")));
+
+	LWLockAcquire(aqo_shared_stats->lock, LW_EXCLUSIVE);
+	hash_seq_init(&hash_seq, fss_stats);
+	while ((entry = hash_seq_search(&hash_seq)) != NULL)
+		hash_search(fss_stats, &entry->key, HASH_REMOVE, NULL);
+	LWLockRelease(aqo_shared_stats->lock);
+
+	PG_RETURN_VOID();
+}
@@ -0,0 +1,383 @@
+/*
+ *******************************************************************************
+ *
+ *	SPOOL OF LEARNING SAMPLES OF HOT STANDBYS
+ *
+ * The knowledge base can't be changed on a hot standby, so the standby uses
+ * it like the frozen mode does. If aqo.spool_directory is set, the objects
+ * the standby would learn are buffered by the backend and written into that
+ * directory instead. Each flush of the buffer writes a new file under
+ * a temporary name and renames it when it is complete, so a file is never
+ * appended to. The buffer is flushed also when the backend exits. The files
+ * are delivered to the primary by the user, e. g. via shared storage or the
+ * same way as archived WAL, into the directory set by aqo.spool_directory
+ * there, where aqo_spool_ingest() learns the complete files of the current
+ * database. Files being delivered must have the ".tmp" suffix until they
+ * are complete too. The files are removed when the learning transaction
+ * commits.
+ *
+ * Each record of a spool file is the header followed by the features, the
+ * hashed features if they were computed, and CRC-32C of all of that.
+ *
+ *******************************************************************************
+ *
+ * Copyright (c) 2016-2020, Postgres Professional
+ *
+ * IDENTIFICATION
+ *	  aqo/spool.c
+ *
+ */
+
+#include <unistd.h>
+
+#include "aqo.h"
+#include "access/xact.h"
+#include "access/xlog.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "port/pg_crc32c.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+
+#define AQO_SPOOL_MAGIC		(0x41514F53)
+#define AQO_SPOOL_PREFIX	"aqo_spool."
+#define AQO_SPOOL_TMP_SUFFIX	".tmp"
+
+/* Flush the buffered records when they exceed this size */
+#define AQO_SPOOL_FLUSH_SIZE	(64 * 1024)
+
+/* Directory of the spool files, empty disables spooling */
+char	   *aqo_spool_directory = NULL;
+
+typedef struct
+{
+	uint32		magic;
+	int32		nfeatures;
+	int64		fspace_hash;
+	int64		fss_hash;
+	double		target;
+	bool		hashed;			/* are hashed features present? */
+} AqoSpoolRecord;
+
+/* Records not written yet, kept in AQOMemoryContext */
+static StringInfo spool_buffer = NULL;
+
+/* Number of files written by the backend */
+static uint32 spool_nfiles = 0;
+
+/* Files learned by the current transaction, in TopTransactionContext */
+static List *ingested_files = NIL;
+
+static bool read_spool_record(FILE *file, const char *path,
+							  AqoSpoolRecord *record, double **features,
+							  double *hashed_features);
+static int64 ingest_spool_file(const char *path);
+static void spool_xact_callback(XactEvent event, void *arg);
+static void spool_shmem_exit(int code, Datum arg);
+
+
+/*
+ * Registers the callback which removes the learned files. Must be called
+ * from _PG_init.
+ */
+void
+spool_init(void)
+{
+	RegisterXactCallback(spool_xact_callback, NULL);
+}
+
+
+/*
+ * Is the object going to be spooled rather than learned?
+ */
+bool
+aqo_spool_enabled(void)
+{
+	return aqo_spool_directory != NULL && aqo_spool_directory[0] != '\0';
+}
+
+/*
+ * Buffers the object of the feature subspace for the spool file. The hashed
+ * features may be NULL.
+ */
+void
+spool_sample(int64 fss_hash, int nfeatures, double *features,
+			 double *hashed_features, double target)
+{
+	AqoSpoolRecord record;
+	pg_crc32c	crc;
+	MemoryContext oldCxt;
+
+	if (!aqo_spool_enabled())
+		return;
+
+	MemSet(&record, 0, sizeof(record));
+	record.magic = AQO_SPOOL_MAGIC;
+	record.nfeatures = nfeatures;
+	record.fspace_hash = query_context.fspace_hash;
+	record.fss_hash = fss_hash;
+	record.target = target;
+	record.hashed = (hashed_features != NULL);
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, &record, sizeof(record));
+	COMP_CRC32C(crc, features, sizeof(double) * nfeatures);
+	if (record.hashed)
+		COMP_CRC32C(crc, hashed_features,
+					sizeof(double) * aqo_hashed_nfeatures);
+	FIN_CRC32C(crc);
+
+	oldCxt = MemoryContextSwitchTo(AQOMemoryContext);
+	if (spool_buffer == NULL)
+	{
+		spool_buffer = makeStringInfo();
+		before_shmem_exit(spool_shmem_exit, (Datum) 0);
+	}
+	appendBinaryStringInfo(spool_buffer, (char *) &record, sizeof(record));
+	appendBinaryStringInfo(spool_buffer, (char *) features,
+						   sizeof(double) * nfeatures);
+	if (record.hashed)
+		appendBinaryStringInfo(spool_buffer, (char *) hashed_features,
+							   sizeof(double) * aqo_hashed_nfeatures);
+	appendBinaryStringInfo(spool_buffer, (char *) &crc, sizeof(crc));
+	MemoryContextSwitchTo(oldCxt);
+
+	if (spool_buffer->len >= AQO_SPOOL_FLUSH_SIZE)
+		flush_spooled_samples();
+}
+
+/*
+ * Writes the buffered records into a new spool file. The file gets its name
+ * only when it is complete, so it can't be learned partially. A failure
+ * loses the records, but doesn't fail the query.
+ */
+void
+flush_spooled_samples(void)
+{
+	char		path[MAXPGPATH];
+	char		tmppath[MAXPGPATH];
+	FILE	   *file;
+
+	if (spool_buffer == NULL || spool_buffer->len == 0)
+		return;
+
+	if (aqo_spool_enabled())
+	{
+		snprintf(path, MAXPGPATH, "%s/" AQO_SPOOL_PREFIX "%u.%d.%ld.%u",
+				 aqo_spool_directory, MyDatabaseId, MyProcPid,
+				 (long) MyStartTime, spool_nfiles++);
+		snprintf(tmppath, MAXPGPATH, "%s" AQO_SPOOL_TMP_SUFFIX, path);
+
+		file = AllocateFile(tmppath, PG_BINARY_W);
+		if (file == NULL ||
+			fwrite(spool_buffer->data, 1, spool_buffer->len, file) !=
+			spool_buffer->len ||
+			FreeFile(file))
+		{
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("could not write file \"%s\": %m", tmppath)));
+			if (file != NULL)
+				FreeFile(file);
+			unlink(tmppath);
+		}
+		else if (rename(tmppath, path) != 0)
+		{
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("could not rename file \"%s\" to \"%s\": %m",
+							tmppath, path)));
+			unlink(tmppath);
+		}
+	}
+
+	resetStringInfo(spool_buffer);
+}
+
+/*
+ * Writes the records still buffered when the backend exits.
+ */
+static void
+spool_shmem_exit(int code, Datum arg)
+{
+	flush_spooled_samples();
+}
+
+/*
+ * Reads the next record of the spool file. Returns false at the end of the
+ * file or if the rest of the file is invalid.
+ */
+static bool
+read_spool_record(FILE *file, const char *path, AqoSpoolRecord *record,
+				  double **features, double *hashed_features)
+{
+	pg_crc32c	crc;
+	pg_crc32c	stored;
+	size_t		len;
+
+	len = fread(record, 1, sizeof(AqoSpoolRecord), file);
+	if (len == 0 && !ferror(file))
+		return false;
+
+	if (len != sizeof(AqoSpoolRecord) || record->magic != AQO_SPOOL_MAGIC ||
+		record->nfeatures < 0 ||
+		(Size) record->nfeatures > MaxAllocSize / sizeof(double))
+		goto invalid;
+
+	*features = palloc(sizeof(double) * Max(record->nfeatures, 1));
+	if (fread(*features, sizeof(double), record->nfeatures, file) !=
+		record->nfeatures)
+		goto invalid;
+	if (record->hashed &&
+		fread(hashed_features, sizeof(double), aqo_hashed_nfeatures, file) !=
+		aqo_hashed_nfeatures)
+		goto invalid;
+	if (fread(&stored, sizeof(stored), 1, file) != 1)
+		goto invalid;
+
+	INIT_CRC32C(crc);
+	COMP_CRC32C(crc, record, sizeof(AqoSpoolRecord));
+	COMP_CRC32C(crc, *features, sizeof(double) * record->nfeatures);
+	if (record->hashed)
+		COMP_CRC32C(crc, hashed_features,
+					sizeof(double) * aqo_hashed_nfeatures);
+	FIN_CRC32C(crc);
+	if (EQ_CRC32C(crc, stored))
+		return true;
+
+invalid:
+	if (ferror(file))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not read file \"%s\": %m", path)));
+	ereport(LOG,
+			(errcode(ERRCODE_DATA_CORRUPTED),
+			 errmsg("ignoring invalid data in file \"%s\"", path)));
+	return false;
+}
+
+/*
+ * Learns all objects of the spool file. Returns the number of objects.
+ */
+static int64
+ingest_spool_file(const char *path)
+{
+	FILE	   *file;
+	AqoSpoolRecord record;
+	double	   *features;
+	double		hashed_features[aqo_hashed_nfeatures];
+	int64		fspace_hash = query_context.fspace_hash;
+	int64		nsamples = 0;
+
+	file = AllocateFile(path, PG_BINARY_R);
+	if (file == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\" for reading: %m", path)));
+
+	while (read_spool_record(file, path, &record, &features, hashed_features))
+	{
+		query_context.fspace_hash = record.fspace_hash;
+		learn_object(record.fss_hash, record.nfeatures, features,
+					 record.hashed ? hashed_features : NULL, record.target);
+		pfree(features);
+		nsamples++;
+	}
+	query_context.fspace_hash = fspace_hash;
+	learn_global_objects();
+
+	FreeFile(file);
+	return nsamples;
+}
+
+PG_FUNCTION_INFO_V1(aqo_spool_ingest);
+
+/*
+ * Learns the objects spooled by hot standbys in the current database.
+ * Returns the number of learned objects.
+ */
+Datum
+aqo_spool_ingest(PG_FUNCTION_ARGS)
+{
+	DIR		   *dir;
+	struct dirent *de;
+	char		prefix[MAXPGPATH];
+	char		path[MAXPGPATH];
+	MemoryContext oldCxt;
+	int64		nsamples = 0;
+
+	if (RecoveryInProgress())
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("recovery is in progress"),
+				 errhint("Spooled samples can be learned only on the primary.")));
+
+	if (!aqo_spool_enabled())
+		PG_RETURN_INT64(0);
+
+	/* The files of other databases are left for them */
+	snprintf(prefix, MAXPGPATH, AQO_SPOOL_PREFIX "%u.", MyDatabaseId);
+
+	dir = AllocateDir(aqo_spool_directory);
+	while ((de = ReadDir(dir, aqo_spool_directory)) != NULL)
+	{
+		size_t		len = strlen(de->d_name);
+
+		/* Files being written or delivered are learned next time */
+		if (strncmp(de->d_name, prefix, strlen(prefix)) != 0 ||
+			(len >= strlen(AQO_SPOOL_TMP_SUFFIX) &&
+			 strcmp(de->d_name + len - strlen(AQO_SPOOL_TMP_SUFFIX),
+					AQO_SPOOL_TMP_SUFFIX) == 0))
+			continue;
+
+		snprintf(path, MAXPGPATH, "%s/%s", aqo_spool_directory, de->d_name);
+		nsamples += ingest_spool_file(path);
+
+		oldCxt = MemoryContextSwitchTo(TopTransactionContext);
+		ingested_files = lappend(ingested_files, pstrdup(path));
+		MemoryContextSwitchTo(oldCxt);
+	}
+	FreeDir(dir);
+
+	PG_RETURN_INT64(nsamples);
+}
+
+/*
+ * Removes the learned files when the transaction commits, so the files are
+ * learned again if it aborts. The prepared transaction is committed by
+ * another backend, which doesn't know the files, so it isn't allowed.
+ */
+static void
+spool_xact_callback(XactEvent event, void *arg)
+{
+	ListCell   *lc;
+
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+			foreach(lc, ingested_files)
+			{
+				if (unlink((char *) lfirst(lc)) < 0)
+					ereport(WARNING,
+							(errcode_for_file_access(),
+							 errmsg("could not remove file \"%s\": %m",
+									(char *) lfirst(lc))));
+			}
+			break;
+		case XACT_EVENT_PRE_PREPARE:
+			if (ingested_files != NIL)
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("cannot PREPARE a transaction that has called aqo_spool_ingest()")));
+			return;
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+			break;
+		default:
+			return;
+	}
+
+	/* The list itself is freed with TopTransactionContext */
+	ingested_files = NIL;
+}
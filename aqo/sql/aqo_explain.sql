@@ -0,0 +1,62 @@
+CREATE TABLE aqo_test_explain AS
+	SELECT x AS a, x % 10 AS b FROM generate_series(1, 1000) x;
+ANALYZE aqo_test_explain;
+
+CREATE EXTENSION aqo;
+SET aqo.mode = 'learn';
+
+-- Hashes, cardinalities and timings vary, so all numbers are masked
+CREATE FUNCTION aqo_explain(query text) RETURNS SETOF text AS $$
+DECLARE
+	line text;
+BEGIN
+	FOR line IN EXECUTE 'EXPLAIN (ANALYZE, COSTS OFF, TIMING OFF, SUMMARY OFF) ' || query
+	LOOP
+		RETURN NEXT regexp_replace(line, '-?[0-9]+(\.[0-9]+)?', 'N', 'g');
+	END LOOP;
+END;
+$$ LANGUAGE plpgsql;
+
+CREATE FUNCTION aqo_explain_json(query text) RETURNS jsonb AS $$
+DECLARE
+	plan json;
+BEGIN
+	EXECUTE 'EXPLAIN (ANALYZE, FORMAT JSON, COSTS OFF, TIMING OFF, SUMMARY OFF) ' || query INTO plan;
+	RETURN plan;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Nothing is printed unless asked for
+EXPLAIN (COSTS OFF) SELECT * FROM aqo_test_explain WHERE a < 100;
+
+SET aqo.show_details = 'on';
+
+-- The first execution has no model yet, the next one is predicted
+SELECT * FROM aqo_explain('SELECT * FROM aqo_test_explain WHERE a < 100');
+SELECT * FROM aqo_explain('SELECT * FROM aqo_test_explain WHERE a < 100');
+
+-- Other formats print the same details as properties
+CREATE TEMP TABLE aqo_plan AS
+	SELECT aqo_explain_json('SELECT * FROM aqo_test_explain WHERE a < 100') AS p;
+SELECT key FROM aqo_plan, jsonb_object_keys(p->0->'Plan') key
+WHERE key LIKE 'AQO%' ORDER BY key COLLATE "C";
+SELECT p->0->'Using aqo' AS using_aqo, p->0->>'AQO mode' AS aqo_mode,
+	   p->0 ? 'Query hash' AS has_query_hash
+FROM aqo_plan;
+
+-- Details of a cached plan belong to the planning which built it
+RESET aqo.show_details;
+SET plan_cache_mode = 'force_generic_plan';
+PREPARE aqo_stmt(int) AS SELECT count(*) FROM aqo_test_explain WHERE b < $1;
+EXECUTE aqo_stmt(5);
+SET aqo.show_details = 'on';
+SELECT * FROM aqo_explain('EXECUTE aqo_stmt(5)');
+DEALLOCATE aqo_stmt;
+RESET plan_cache_mode;
+
+RESET aqo.show_details;
+DROP TABLE aqo_plan;
+DROP FUNCTION aqo_explain_json(text);
+DROP FUNCTION aqo_explain(text);
+DROP TABLE aqo_test_explain;
+DROP EXTENSION aqo;
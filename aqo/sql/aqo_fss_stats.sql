@@ -0,0 +1,36 @@
+CREATE TABLE aqo_test_fss AS
+	SELECT x AS a, x % 10 AS b FROM generate_series(1, 1000) x;
+ANALYZE aqo_test_fss;
+
+CREATE EXTENSION aqo;
+
+-- Statistics are cluster-wide, so only the queries below must be counted
+SET aqo.mode = 'disabled';
+SELECT aqo_fss_stats_reset();
+
+SET aqo.mode = 'learn';
+SELECT count(*) FROM aqo_test_fss WHERE a < 100 AND b < 5;
+SELECT count(*) FROM aqo_test_fss WHERE a < 100 AND b < 5;
+SELECT count(*) FROM aqo_test_fss WHERE a < 100 AND b < 5;
+SET aqo.mode = 'disabled';
+
+SELECT count(*) > 0 AS has_subspaces,
+	   max(nsamples) >= 3 AS learned,
+	   bool_and((SELECT sum(n) FROM unnest(error_histogram) n) = nsamples)
+		AS histograms_complete,
+	   bool_or(drifting) AS drifting,
+	   bool_and(last_update IS NOT NULL) AS has_update_time
+FROM aqo_fss_stats();
+
+SELECT aqo_fss_stats_reset();
+SELECT count(*) FROM aqo_fss_stats();
+
+-- Only superusers may reset the statistics
+CREATE ROLE regress_aqo_fss_user;
+SET ROLE regress_aqo_fss_user;
+SELECT aqo_fss_stats_reset();  -- fail
+RESET ROLE;
+DROP ROLE regress_aqo_fss_user;
+
+DROP TABLE aqo_test_fss;
+DROP EXTENSION aqo;
@@ -0,0 +1,74 @@
+CREATE TABLE aqo_test_kb AS
+	SELECT x AS a, x % 10 AS b FROM generate_series(1, 1000) x;
+ANALYZE aqo_test_kb;
+
+CREATE EXTENSION aqo;
+
+SET aqo.mode = 'learn';
+SELECT count(*) FROM aqo_test_kb WHERE a < 100;
+SELECT count(*) FROM aqo_test_kb WHERE a < 100 AND b < 5;
+SELECT count(*) FROM aqo_test_kb WHERE a < 100 AND b < 5;
+SELECT count(*) FROM aqo_test_kb t1, aqo_test_kb t2
+WHERE t1.a = t2.a AND t1.b < 5;
+SET aqo.mode = 'disabled';
+
+CREATE TEMP TABLE kb_queries AS SELECT * FROM public.aqo_queries;
+CREATE TEMP TABLE kb_query_texts AS SELECT * FROM public.aqo_query_texts;
+CREATE TEMP TABLE kb_query_stat AS SELECT * FROM public.aqo_query_stat;
+CREATE TEMP TABLE kb_data AS SELECT * FROM public.aqo_data;
+
+-- The file is written by the server, so the path must be absolute
+SELECT aqo_export(current_setting('data_directory') || '/aqo_test_kb.dump')
+	AS exported \gset
+SELECT :exported = (SELECT count(*) FROM kb_queries) +
+				   (SELECT count(*) FROM kb_query_texts) +
+				   (SELECT count(*) FROM kb_query_stat) +
+				   (SELECT count(*) FROM kb_data) AS exported_all,
+	   (SELECT count(*) FROM kb_data) > 0 AS has_models;
+SELECT aqo_export('aqo_test_kb.dump');  -- fail
+
+-- The import replaces the knowledge base
+DELETE FROM public.aqo_data;
+DELETE FROM public.aqo_query_stat;
+DELETE FROM public.aqo_query_texts;
+DELETE FROM public.aqo_queries;
+SELECT aqo_import('aqo_test_kb.dump') = :exported AS imported_all;
+
+SELECT (SELECT count(*) FROM (TABLE kb_queries
+							  EXCEPT ALL TABLE public.aqo_queries) d) AS queries,
+	   (SELECT count(*) FROM (TABLE kb_query_texts
+							  EXCEPT ALL TABLE public.aqo_query_texts) d) AS texts,
+	   (SELECT count(*) FROM (TABLE kb_query_stat
+							  EXCEPT ALL TABLE public.aqo_query_stat) d) AS stat,
+	   (SELECT count(*) FROM (TABLE kb_data
+							  EXCEPT ALL TABLE public.aqo_data) d) AS data;
+
+-- A damaged or missing file doesn't change the knowledge base
+DO $$
+BEGIN
+	EXECUTE format('COPY (SELECT repeat(''x'', 100)) TO %L',
+				   current_setting('data_directory') || '/aqo_test_kb.bad');
+END;
+$$;
+SELECT aqo_import('aqo_test_kb.bad');  -- fail
+SELECT aqo_import('aqo_test_kb.none');  -- fail
+SELECT count(*) = (SELECT count(*) FROM kb_data) AS kept FROM public.aqo_data;
+
+-- The imported models are used
+SELECT aqo_stat_reset();
+SET aqo.mode = 'learn';
+SELECT count(*) FROM aqo_test_kb WHERE a < 100 AND b < 5;
+SET aqo.mode = 'disabled';
+SELECT predictions_served > 0 AS served FROM pg_stat_aqo;
+
+-- Only privileged roles may read and write server files
+CREATE ROLE regress_aqo_kb_user;
+SET ROLE regress_aqo_kb_user;
+SELECT aqo_export('/aqo_test_kb.dump');  -- fail
+SELECT aqo_import('aqo_test_kb.dump');  -- fail
+RESET ROLE;
+DROP ROLE regress_aqo_kb_user;
+
+DROP TABLE kb_queries, kb_query_texts, kb_query_stat, kb_data;
+DROP TABLE aqo_test_kb;
+DROP EXTENSION aqo;
@@ -0,0 +1,28 @@
+CREATE TABLE aqo_test_error AS
+	SELECT x % 100 AS a, x % 100 AS b, x % 100 AS c
+	FROM generate_series(1, 100000) x;
+ANALYZE aqo_test_error;
+
+CREATE EXTENSION aqo;
+SET max_parallel_workers_per_gather = 0;
+
+-- The join is underestimated, so the query runs long and is cancelled
+SET aqo.mode = 'learn';
+SET statement_timeout = '500ms';
+SELECT count(*) FROM aqo_test_error t1, aqo_test_error t2
+WHERE t1.a = t2.a AND t1.b = t2.b AND t1.c = t2.c;  -- fail
+RESET statement_timeout;
+
+-- Nothing can be learned in the aborted transaction
+SET aqo.mode = 'disabled';
+SELECT count(*) FROM public.aqo_data;
+
+-- The rows produced so far are learned at the next planning
+SET aqo.mode = 'frozen';
+SELECT count(*) FROM aqo_test_error WHERE a < 0;
+SET aqo.mode = 'disabled';
+SELECT count(*) > 0 AS learned FROM public.aqo_data;
+
+RESET max_parallel_workers_per_gather;
+DROP TABLE aqo_test_error;
+DROP EXTENSION aqo;
@@ -0,0 +1,84 @@
+CREATE TABLE aqo_test_qh AS
+	SELECT x AS a, x % 10 AS b, x::text AS c FROM generate_series(1, 100) x;
+ANALYZE aqo_test_qh;
+
+CREATE EXTENSION aqo;
+
+-- The frozen mode computes the hash without storing the queries
+SET aqo.mode = 'frozen';
+SET aqo.show_details = 'on';
+SET aqo.query_hash_method = 'jumble';
+
+CREATE FUNCTION aqo_query_hash(query text) RETURNS text AS $$
+DECLARE
+	plan json;
+BEGIN
+	EXECUTE 'EXPLAIN (FORMAT JSON, COSTS OFF) ' || query INTO plan;
+	RETURN plan->0->>'Query hash';
+END;
+$$ LANGUAGE plpgsql;
+
+-- Constants don't change the hash
+SELECT aqo_query_hash('SELECT * FROM aqo_test_qh WHERE a < 1') =
+	   aqo_query_hash('SELECT * FROM aqo_test_qh WHERE a < 2') AS same_type;
+
+-- The fields which aren't expressions do
+SELECT aqo_query_hash('SELECT greatest(a, b) FROM aqo_test_qh') <>
+	   aqo_query_hash('SELECT least(a, b) FROM aqo_test_qh') AS minmax,
+	   aqo_query_hash('SELECT * FROM aqo_test_qh WHERE (a, b) < (1, 2)') <>
+	   aqo_query_hash('SELECT * FROM aqo_test_qh WHERE (a, b) > (1, 2)') AS rowcompare,
+	   aqo_query_hash('SELECT sum(a) OVER (PARTITION BY a) FROM aqo_test_qh') <>
+	   aqo_query_hash('SELECT sum(a) OVER (ORDER BY a) FROM aqo_test_qh') AS window_clause,
+	   aqo_query_hash('SELECT sum(a) OVER (ORDER BY a ROWS UNBOUNDED PRECEDING) FROM aqo_test_qh') <>
+	   aqo_query_hash('SELECT sum(a) OVER (ORDER BY a RANGE UNBOUNDED PRECEDING) FROM aqo_test_qh') AS frame,
+	   aqo_query_hash('SELECT a, b, count(*) FROM aqo_test_qh GROUP BY ROLLUP (a, b)') <>
+	   aqo_query_hash('SELECT a, b, count(*) FROM aqo_test_qh GROUP BY CUBE (a, b)') AS grouping_sets,
+	   aqo_query_hash('SELECT * FROM aqo_test_qh WHERE c < ''x'' COLLATE "C"') <>
+	   aqo_query_hash('SELECT * FROM aqo_test_qh WHERE c < ''x'' COLLATE "POSIX"') AS collation;
+
+-- Portable hashes don't depend on OIDs of relations and functions
+CREATE FUNCTION aqo_qh_f(x int) RETURNS int AS $$
+BEGIN
+	RETURN x;
+END;
+$$ LANGUAGE plpgsql IMMUTABLE;
+SET aqo.portable_hashes = on;
+SELECT aqo_query_hash('SELECT * FROM aqo_test_qh WHERE aqo_qh_f(a) < 1')
+	AS jumbled \gset
+SET aqo.query_hash_method = 'text';
+SELECT aqo_query_hash('SELECT * FROM aqo_test_qh WHERE aqo_qh_f(a) < 1')
+	AS text \gset
+DROP FUNCTION aqo_qh_f(int);
+CREATE FUNCTION aqo_qh_f(x int) RETURNS int AS $$
+BEGIN
+	RETURN x;
+END;
+$$ LANGUAGE plpgsql IMMUTABLE;
+CREATE TABLE aqo_test_qh2 AS TABLE aqo_test_qh;
+DROP TABLE aqo_test_qh;
+ALTER TABLE aqo_test_qh2 RENAME TO aqo_test_qh;
+SELECT aqo_query_hash('SELECT * FROM aqo_test_qh WHERE aqo_qh_f(a) < 1') =
+	   :'text' AS text_portable;
+SET aqo.query_hash_method = 'jumble';
+SELECT aqo_query_hash('SELECT * FROM aqo_test_qh WHERE aqo_qh_f(a) < 1') =
+	   :'jumbled' AS jumble_portable;
+
+-- Otherwise they do
+SET aqo.portable_hashes = off;
+SELECT aqo_query_hash('SELECT * FROM aqo_test_qh WHERE aqo_qh_f(a) < 1')
+	AS jumbled \gset
+DROP FUNCTION aqo_qh_f(int);
+CREATE FUNCTION aqo_qh_f(x int) RETURNS int AS $$
+BEGIN
+	RETURN x;
+END;
+$$ LANGUAGE plpgsql IMMUTABLE;
+SELECT aqo_query_hash('SELECT * FROM aqo_test_qh WHERE aqo_qh_f(a) < 1') <>
+	   :'jumbled' AS oid_based;
+
+RESET aqo.query_hash_method;
+RESET aqo.show_details;
+DROP FUNCTION aqo_qh_f(int);
+DROP FUNCTION aqo_query_hash(text);
+DROP TABLE aqo_test_qh;
+DROP EXTENSION aqo;
@@ -0,0 +1,40 @@
+CREATE TABLE aqo_test_sc AS
+	SELECT x AS a FROM generate_series(1, 100) x;
+ANALYZE aqo_test_sc;
+
+CREATE EXTENSION aqo;
+
+CREATE FUNCTION aqo_using(query text) RETURNS text AS $$
+DECLARE
+	plan json;
+BEGIN
+	EXECUTE 'EXPLAIN (FORMAT JSON, COSTS OFF) ' || query INTO plan;
+	RETURN plan->0->>'Using aqo';
+END;
+$$ LANGUAGE plpgsql;
+
+SET aqo.show_details = 'on';
+SET aqo.mode = 'learn';
+SELECT count(*) FROM aqo_test_sc WHERE a < 10;
+SET aqo.mode = 'controlled';
+SELECT aqo_using('SELECT count(*) FROM aqo_test_sc WHERE a < 10');
+
+-- The cached settings follow the changes of aqo_queries
+BEGIN;
+UPDATE public.aqo_queries SET use_aqo = false WHERE query_hash <> 0;
+SELECT aqo_using('SELECT count(*) FROM aqo_test_sc WHERE a < 10');
+ROLLBACK;
+SELECT aqo_using('SELECT count(*) FROM aqo_test_sc WHERE a < 10');
+
+-- The prepared change is seen when it is committed
+BEGIN;
+UPDATE public.aqo_queries SET use_aqo = false WHERE query_hash <> 0;
+PREPARE TRANSACTION 'aqo_settings_cache';
+SELECT aqo_using('SELECT count(*) FROM aqo_test_sc WHERE a < 10');
+COMMIT PREPARED 'aqo_settings_cache';
+SELECT aqo_using('SELECT count(*) FROM aqo_test_sc WHERE a < 10');
+
+RESET aqo.show_details;
+DROP FUNCTION aqo_using(text);
+DROP TABLE aqo_test_sc;
+DROP EXTENSION aqo;
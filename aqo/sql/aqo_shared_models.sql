@@ -0,0 +1,43 @@
+CREATE TABLE aqo_test_sm AS
+	SELECT x AS a, x % 10 AS b FROM generate_series(1, 1000) x;
+ANALYZE aqo_test_sm;
+
+CREATE EXTENSION aqo;
+
+-- The store is cluster-wide, so only the models below must be counted
+SET aqo.portable_hashes = on;
+SET aqo.mode = 'disabled';
+SELECT aqo_shared_models_reset() >= 0 AS reset;
+
+-- The learned models are published when the transaction commits
+SET aqo.mode = 'learn';
+SELECT count(*) FROM aqo_test_sm WHERE b < 5;
+SET aqo.mode = 'disabled';
+SELECT aqo_shared_models_reset() > 0 AS published;
+
+-- Removal of other models doesn't hold back the publication
+SET aqo.mode = 'learn';
+SELECT count(*) FROM aqo_test_sm WHERE b < 5;
+BEGIN;
+SELECT count(*) FROM aqo_test_sm WHERE a < 100;
+SET LOCAL aqo.mode = 'disabled';
+WITH d AS (
+	DELETE FROM public.aqo_data WHERE fspace_hash =
+		(SELECT query_hash FROM public.aqo_query_texts
+		 WHERE query_text LIKE '%WHERE b < 5%')
+	RETURNING 1)
+SELECT count(*) > 0 AS deleted FROM d;
+COMMIT;
+SET aqo.mode = 'disabled';
+SELECT aqo_shared_models_reset() > 0 AS published;
+
+-- Models deleted from aqo_data are removed from the store
+SET aqo.mode = 'learn';
+SELECT count(*) FROM aqo_test_sm WHERE a < 100;
+SET aqo.mode = 'disabled';
+WITH d AS (DELETE FROM public.aqo_data RETURNING 1)
+SELECT count(*) > 0 AS deleted FROM d;
+SELECT aqo_shared_models_reset() AS remaining;
+
+DROP TABLE aqo_test_sm;
+DROP EXTENSION aqo;
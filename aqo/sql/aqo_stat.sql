@@ -0,0 +1,38 @@
+CREATE TABLE aqo_test_stat AS
+	SELECT x AS a, x % 10 AS b FROM generate_series(1, 1000) x;
+ANALYZE aqo_test_stat;
+
+CREATE EXTENSION aqo;
+
+-- Statistics are cluster-wide, so only the queries below must be counted
+SET aqo.mode = 'disabled';
+SELECT aqo_stat_reset();
+
+SET aqo.mode = 'learn';
+SELECT count(*) FROM aqo_test_stat WHERE a < 100 AND b < 5;
+SELECT count(*) FROM aqo_test_stat WHERE a < 100 AND b < 5;
+SELECT count(*) FROM aqo_test_stat WHERE a < 100 AND b < 5;
+SET aqo.mode = 'disabled';
+
+-- The first execution isn't predicted, the next ones are
+SELECT predictions_attempted > 0 AS attempted,
+	   predictions_served > 0 AS served,
+	   predictions_refused > 0 AS refused,
+	   samples_learned > 0 AS learned,
+	   bytes_written > 0 AS written,
+	   bytes_stored > 0 AS stored,
+	   stats_reset IS NOT NULL AS has_reset_time
+FROM pg_stat_aqo;
+
+SELECT aqo_stat_reset();
+SELECT predictions_attempted, samples_learned FROM pg_stat_aqo;
+
+-- Only superusers may reset the statistics
+CREATE ROLE regress_aqo_stat_user;
+SET ROLE regress_aqo_stat_user;
+SELECT aqo_stat_reset();  -- fail
+RESET ROLE;
+DROP ROLE regress_aqo_stat_user;
+
+DROP TABLE aqo_test_stat;
+DROP EXTENSION aqo;
@@ -0,0 +1,56 @@
+-- Objects of the extension, their signatures and privileges
+CREATE FUNCTION aqo_objects() RETURNS SETOF text AS $$
+	SELECT pg_describe_object(d.classid, d.objid, d.objsubid) ||
+		   coalesce(' returns ' || pg_get_function_result(p.oid) ||
+					' acl ' || coalesce(p.proacl::text, 'default'), '')
+	FROM pg_depend d
+		LEFT JOIN pg_proc p ON d.classid = 'pg_proc'::regclass AND
+							   p.oid = d.objid
+	WHERE d.refclassid = 'pg_extension'::regclass AND d.deptype = 'e' AND
+		  d.refobjid = (SELECT oid FROM pg_extension WHERE extname = 'aqo')
+	UNION ALL
+	SELECT 'column ' || a.attrelid::regclass || '.' || a.attname || ' ' ||
+		   format_type(a.atttypid, a.atttypmod) ||
+		   CASE WHEN a.attnotnull THEN ' not null' ELSE '' END
+	FROM pg_attribute a JOIN pg_class c ON c.oid = a.attrelid
+	WHERE c.relnamespace = 'public'::regnamespace AND
+		  c.relname LIKE 'aqo%' AND a.attnum > 0 AND NOT a.attisdropped
+	UNION ALL
+	SELECT pg_get_triggerdef(t.oid)
+	FROM pg_trigger t JOIN pg_class c ON c.oid = t.tgrelid
+	WHERE c.relnamespace = 'public'::regnamespace AND
+		  c.relname LIKE 'aqo%' AND NOT t.tgisinternal
+	UNION ALL
+	SELECT indexdef FROM pg_indexes
+	WHERE schemaname = 'public' AND tablename LIKE 'aqo%'
+$$ LANGUAGE sql;
+
+SET aqo.mode = 'disabled';
+
+CREATE EXTENSION aqo;
+SELECT extversion FROM pg_extension WHERE extname = 'aqo';
+CREATE TEMP TABLE aqo_installed AS SELECT aqo_objects() AS obj;
+DROP EXTENSION aqo;
+
+-- The update must lead to the same objects as the installation
+CREATE EXTENSION aqo VERSION '1.3';
+ALTER EXTENSION aqo UPDATE TO '1.4';
+SELECT extversion FROM pg_extension WHERE extname = 'aqo';
+CREATE TEMP TABLE aqo_updated AS SELECT aqo_objects() AS obj;
+
+SELECT obj AS missing FROM aqo_installed EXCEPT SELECT obj FROM aqo_updated;
+SELECT obj AS extra FROM aqo_updated EXCEPT SELECT obj FROM aqo_installed;
+
+-- The knowledge base of 1.4 is usable
+CREATE TABLE aqo_test_upgrade AS
+	SELECT x AS a FROM generate_series(1, 100) x;
+SET aqo.mode = 'learn';
+SELECT count(*) FROM aqo_test_upgrade WHERE a < 10;
+SELECT count(*) FROM aqo_test_upgrade WHERE a < 10;
+SET aqo.mode = 'disabled';
+SELECT count(*) > 0 AS learned FROM public.aqo_data;
+
+DROP TABLE aqo_test_upgrade;
+DROP TABLE aqo_installed, aqo_updated;
+DROP FUNCTION aqo_objects();
+DROP EXTENSION aqo;
@@ -20,14 +20,89 @@
 #include "access/heapam.h"
 #include "access/table.h"
 #include "access/tableam.h"
+#include "access/xact.h"
+#include "access/xlog.h"
 
-HTAB *deactivated_queries = NULL;
+/*
+ * Backend-local cache of the settings of queries from aqo_queries, including
+ * the queries which aren't there. It is dropped when the generation of
+ * aqo_queries in shared memory advances. Without shared memory the changes
+ * made by other backends can't be noticed, so only deactivated queries are
+ * cached, as before.
+ */
+static HTAB *query_settings = NULL;
+static uint64 query_settings_generation = 0;
+
+/* The transaction changed aqo_queries, the generation must be advanced */
+static bool query_settings_changed = false;
+
+/*
+ * Backend-local cache of the models of feature subspaces, so they aren't
+ * detoasted and deformed by each load_fss(): with aqo.knn_capacity objects
+ * that is a copy of the whole matrix per prediction. A cached model is still
+ * copied, but without detoasting and checking the arrays. The cache is
+ * dropped when the generation of aqo_data in shared memory advances or
+ * aqo_data is created anew, and when it outgrows AQO_FSS_MODELS_CACHE_SIZE.
+ * Without shared memory nothing is cached.
+ */
+#define AQO_FSS_MODELS_CACHE_SIZE	(64 * 1024 * 1024)
 
-static ArrayType *form_weights(double *weights, int ncols);
-static void deform_vector(Datum datum, double *vector, int *ncols);
+typedef struct FssModelKey
+{
+	int64		fspace_hash;
+	int64		fss_hash;
+} FssModelKey;
+
+typedef struct FssModelEntry
+{
+	FssModelKey key;
+	AqoFssModel *model;
+	Size		size;			/* approximate size of the model */
+} FssModelEntry;
+
+static HTAB *fss_models = NULL;
+static MemoryContext fss_models_context = NULL;
+static Size fss_models_size = 0;
+static uint64 fss_models_generation = 0;
+static Oid	fss_models_index = InvalidOid;
+
+/* The transaction changed aqo_data, the generation must be advanced */
+static bool fss_models_changed = false;
+
+static void reset_query_settings_cache(void);
+static void store_query_settings(QuerySettings *settings);
+static void query_settings_xact_callback(XactEvent event, void *arg);
+static void query_settings_subxact_callback(SubXactEvent event,
+											SubTransactionId mySubid,
+											SubTransactionId parentSubid,
+											void *arg);
+static void reset_fss_models_cache(void);
+static bool fss_models_cache_load(Oid index_oid, int64 fss_hash, int ncols,
+								  AqoFssModel *model);
+static void fss_models_cache_store(Oid index_oid, int64 fss_hash,
+								   AqoFssModel *model);
+static void fss_models_cache_forget(int64 fss_hash);
+static void fss_models_xact_callback(XactEvent event, void *arg);
+static void fss_models_subxact_callback(SubXactEvent event,
+										SubTransactionId mySubid,
+										SubTransactionId parentSubid,
+										void *arg);
+
+static ArrayType *form_matrix(double **matrix, int nrows, int ncols);
+static bool deform_matrix(Datum datum, double **matrix, int nrows, int ncols);
+
+static ArrayType *form_vector(double *vector, int nelems);
+static bool deform_vector(Datum datum, double *vector, int maxelems,
+						  int *nelems);
+static void form_fss_model(AqoFssModel *model, Datum *values, bool *isnull);
+static bool deform_fss_model(AqoFssModel *model, Datum *values, bool *isnull);
+static void clear_fss_model(AqoFssModel *model);
+static ArrayType *form_kd_tree(AqoFssModel *model);
+static bool deform_kd_tree(Datum datum, AqoFssModel *model);
+static int	array_nelems(Datum datum);
 
 #define FormVectorSz(v_name)			(form_vector((v_name), (v_name ## _size)))
-#define DeformVectorSz(datum, v_name)	(deform_vector((datum), (v_name), &(v_name ## _size)))
+#define DeformVectorSz(datum, v_name)	(deform_vector((datum), (v_name), aqo_stat_size, &(v_name ## _size)))
 
 
 static bool my_simple_heap_update(Relation relation,
@@ -48,7 +123,7 @@ static bool my_index_insert(Relation indexRelation,
  * If yes, returns the content of the first line with given hash.
  */
 bool
-find_query(int query_hash,
+find_query(int64 query_hash,
 		   Datum *search_values,
 		   bool *search_nulls)
 {
@@ -87,8 +162,8 @@ find_query(int query_hash,
 	ScanKeyInit(&key,
 				1,
 				BTEqualStrategyNumber,
-				F_INT4EQ,
-				Int32GetDatum(query_hash));
+				F_INT8EQ,
+				Int64GetDatum(query_hash));
 
 	index_rescan(query_index_scan, &key, 1, NULL, 0);
 
@@ -117,8 +192,8 @@ find_query(int query_hash,
  * Returns false if the operation failed, true otherwise.
  */
 bool
-add_query(int query_hash, bool learn_aqo, bool use_aqo,
-		  int fspace_hash, bool auto_tuning)
+add_query(int64 query_hash, bool learn_aqo, bool use_aqo,
+		  int64 fspace_hash, bool auto_tuning)
 {
 	RangeVar   *aqo_queries_table_rv;
 	Relation	aqo_queries_heap;
@@ -131,11 +206,12 @@ add_query(int query_hash, bool learn_aqo, bool use_aqo,
 
 	Relation	query_index_rel;
 	Oid			query_index_rel_oid;
+	QuerySettings settings;
 
-	values[0] = Int32GetDatum(query_hash);
+	values[0] = Int64GetDatum(query_hash);
 	values[1] = BoolGetDatum(learn_aqo);
 	values[2] = BoolGetDatum(use_aqo);
-	values[3] = Int32GetDatum(fspace_hash);
+	values[3] = Int64GetDatum(fspace_hash);
 	values[4] = BoolGetDatum(auto_tuning);
 
 	query_index_rel_oid = RelnameGetRelid("aqo_queries_query_hash_idx");
@@ -176,12 +252,21 @@ add_query(int query_hash, bool learn_aqo, bool use_aqo,
 
 	CommandCounterIncrement();
 
+	settings.query_hash = query_hash;
+	settings.stored = true;
+	settings.learn_aqo = learn_aqo;
+	settings.use_aqo = use_aqo;
+	settings.fspace_hash = fspace_hash;
+	settings.auto_tuning = auto_tuning;
+	store_query_settings(&settings);
+	query_settings_changed = true;
+
 	return true;
 }
 
 bool
-update_query(int query_hash, bool learn_aqo, bool use_aqo,
-			 int fspace_hash, bool auto_tuning)
+update_query(int64 query_hash, bool learn_aqo, bool use_aqo,
+			 int64 fspace_hash, bool auto_tuning)
 {
 	RangeVar   *aqo_queries_table_rv;
 	Relation	aqo_queries_heap;
@@ -203,6 +288,7 @@ update_query(int query_hash, bool learn_aqo, bool use_aqo,
 	Datum		values[5];
 	bool		isnull[5] = { false, false, false, false, false };
 	bool		replace[5] = { false, true, true, true, true };
+	QuerySettings settings;
 
 	query_index_rel_oid = RelnameGetRelid("aqo_queries_query_hash_idx");
 	if (!OidIsValid(query_index_rel_oid))
@@ -224,8 +310,8 @@ update_query(int query_hash, bool learn_aqo, bool use_aqo,
 	ScanKeyInit(&key,
 				1,
 				BTEqualStrategyNumber,
-				F_INT4EQ,
-				Int32GetDatum(query_hash));
+				F_INT8EQ,
+				Int64GetDatum(query_hash));
 
 	index_rescan(query_index_scan, &key, 1, NULL, 0);
 	slot = MakeSingleTupleTableSlot(query_index_scan->heapRelation->rd_att,
@@ -240,7 +326,7 @@ update_query(int query_hash, bool learn_aqo, bool use_aqo,
 
 	values[1] = BoolGetDatum(learn_aqo);
 	values[2] = BoolGetDatum(use_aqo);
-	values[3] = Int32GetDatum(fspace_hash);
+	values[3] = Int64GetDatum(fspace_hash);
 	values[4] = BoolGetDatum(auto_tuning);
 
 	nw_tuple = heap_modify_tuple(tuple, aqo_queries_heap->rd_att,
@@ -270,6 +356,15 @@ update_query(int query_hash, bool learn_aqo, bool use_aqo,
 
 	CommandCounterIncrement();
 
+	settings.query_hash = query_hash;
+	settings.stored = true;
+	settings.learn_aqo = learn_aqo;
+	settings.use_aqo = use_aqo;
+	settings.fspace_hash = fspace_hash;
+	settings.auto_tuning = auto_tuning;
+	store_query_settings(&settings);
+	query_settings_changed = true;
+
 	return true;
 }
 
@@ -278,7 +373,7 @@ update_query(int query_hash, bool learn_aqo, bool use_aqo,
  * Returns false if the operation failed, true otherwise.
  */
 bool
-add_query_text(int query_hash, const char *query_text)
+add_query_text(int64 query_hash, const char *query_text)
 {
 	RangeVar   *aqo_query_texts_table_rv;
 	Relation	aqo_query_texts_heap;
@@ -292,7 +387,7 @@ add_query_text(int query_hash, const char *query_text)
 	Relation	query_index_rel;
 	Oid			query_index_rel_oid;
 
-	values[0] = Int32GetDatum(query_hash);
+	values[0] = Int64GetDatum(query_hash);
 	values[1] = CStringGetTextDatum(query_text);
 
 	query_index_rel_oid = RelnameGetRelid("aqo_query_texts_query_hash_idx");
@@ -345,10 +440,10 @@ add_query_text(int query_hash, const char *query_text)
  *
  * 'fss_hash' is the hash of feature subspace which is supposed to be loaded
  * 'ncols' is the number of clauses in the feature subspace
- * 'weights' is an allocated memory for array of weights
+ * 'model' is an allocated by palloc_fss_model(ncols) memory for the models
  */
 bool
-load_fss(int fss_hash, int ncols, double *weights)
+load_fss(int64 fss_hash, int ncols, AqoFssModel *model)
 {
 	RangeVar   *aqo_data_table_rv;
 	Relation	aqo_data_heap;
@@ -364,18 +459,36 @@ load_fss(int fss_hash, int ncols, double *weights)
 
 	LOCKMODE	lockmode = AccessShareLock;
 
-	Datum		values[5];
-	bool		isnull[5];
+	Datum		values[9];
+	bool		isnull[9];
 
 	bool		success = true;
 
+	TRACE_AQO_LOAD_FSS_START(query_context.fspace_hash, fss_hash);
+
+	/* The model published by any database is the most recent one */
+	if (shared_model_load(query_context.fspace_hash, fss_hash, ncols, model))
+	{
+		aqo_stat_add(AQO_STAT_FSS_LOADS_HIT, 1);
+		TRACE_AQO_LOAD_FSS_DONE(query_context.fspace_hash, fss_hash, true);
+		return true;
+	}
+
 	data_index_rel_oid = RelnameGetRelid("aqo_fss_access_idx");
 	if (!OidIsValid(data_index_rel_oid))
 	{
 		disable_aqo_for_query();
+		TRACE_AQO_LOAD_FSS_DONE(query_context.fspace_hash, fss_hash, false);
 		return false;
 	}
 
+	if (fss_models_cache_load(data_index_rel_oid, fss_hash, ncols, model))
+	{
+		aqo_stat_add(AQO_STAT_FSS_LOADS_HIT, 1);
+		TRACE_AQO_LOAD_FSS_DONE(query_context.fspace_hash, fss_hash, true);
+		return true;
+	}
+
 	aqo_data_table_rv = makeRangeVar("public", "aqo_data", -1);
 	aqo_data_heap = table_openrv(aqo_data_table_rv, lockmode);
 
@@ -389,14 +502,14 @@ load_fss(int fss_hash, int ncols, double *weights)
 	ScanKeyInit(&key[0],
 				1,
 				BTEqualStrategyNumber,
-				F_INT4EQ,
-				Int32GetDatum(query_context.fspace_hash));
+				F_INT8EQ,
+				Int64GetDatum(query_context.fspace_hash));
 
 	ScanKeyInit(&key[1],
 				2,
 				BTEqualStrategyNumber,
-				F_INT4EQ,
-				Int32GetDatum(fss_hash));
+				F_INT8EQ,
+				Int64GetDatum(fss_hash));
 
 	index_rescan(data_index_scan, key, 2, NULL, 0);
 
@@ -412,15 +525,24 @@ load_fss(int fss_hash, int ncols, double *weights)
 
 		if (DatumGetInt32(values[2]) == ncols)
 		{
-			if (ncols > 0)
-				/*
-				 * The case than an object has not any filters and selectivities
-				 */
-				deform_weights(values[3], weights, ncols);
+			if (deform_fss_model(model, values, isnull))
+			{
+				/* Share the model learned before the store was enabled */
+				shared_model_store(query_context.fspace_hash, fss_hash, model);
+				fss_models_cache_store(data_index_rel_oid, fss_hash, model);
+			}
+			else
+			{
+				/* The row is relearned from scratch and overwritten */
+				elog(WARNING, "invalid models for hash (" INT64_FORMAT ", " INT64_FORMAT ") are ignored",
+					 query_context.fspace_hash, fss_hash);
+				clear_fss_model(model);
+				success = false;
+			}
 		}
 		else
 		{
-			elog(WARNING, "unexpected number of features for hash (%d, %d):\
+			elog(WARNING, "unexpected number of features for hash (" INT64_FORMAT ", " INT64_FORMAT "):\
 						   expected %d features, obtained %d",
 						   query_context.fspace_hash,
 						   fss_hash, ncols, DatumGetInt32(values[2]));
@@ -430,11 +552,14 @@ load_fss(int fss_hash, int ncols, double *weights)
 	else
 		success = false;
 
+	aqo_stat_add(success ? AQO_STAT_FSS_LOADS_HIT : AQO_STAT_FSS_LOADS_MISS, 1);
+
 	ExecDropSingleTupleTableSlot(slot);
 	index_endscan(data_index_scan);
 	index_close(data_index_rel, lockmode);
 	table_close(aqo_data_heap, lockmode);
 
+	TRACE_AQO_LOAD_FSS_DONE(query_context.fspace_hash, fss_hash, success);
 	return success;
 }
 
@@ -443,11 +568,10 @@ load_fss(int fss_hash, int ncols, double *weights)
  * Returns false if the operation failed, true otherwise.
  *
  * 'fss_hash' specifies the feature subspace
- * 'nrows' x 'ncols' is the shape of 'matrix'
- * 'targets' is vector of size 'nrows'
+ * 'model' contains the models of the feature subspace
  */
 bool
-update_fss(int fss_hash, int ncols, double *weights)
+update_fss(int64 fss_hash, AqoFssModel *model)
 {
 	RangeVar   *aqo_data_table_rv;
 	Relation	aqo_data_heap;
@@ -467,14 +591,20 @@ update_fss(int fss_hash, int ncols, double *weights)
 	IndexScanDesc data_index_scan;
 	ScanKeyData	key[2];
 
-	Datum		values[5];
-	bool		isnull[5] = { false, false, false, false, false };
-	bool		replace[5] = { false, false, false, true, true };
+	Datum		values[9];
+	bool		isnull[9] = { false, false, false, false, false,
+							  false, false, false, false };
+	bool		replace[9] = { false, false, false, true, true,
+							   true, true, true, true };
+	bool		stored = true;
+
+	TRACE_AQO_UPDATE_FSS_START(query_context.fspace_hash, fss_hash);
 
 	data_index_rel_oid = RelnameGetRelid("aqo_fss_access_idx");
 	if (!OidIsValid(data_index_rel_oid))
 	{
 		disable_aqo_for_query();
+		TRACE_AQO_UPDATE_FSS_DONE(query_context.fspace_hash, fss_hash, false);
 		return false;
 	}
 
@@ -493,14 +623,14 @@ update_fss(int fss_hash, int ncols, double *weights)
 	ScanKeyInit(&key[0],
 				1,
 				BTEqualStrategyNumber,
-				F_INT4EQ,
-				Int32GetDatum(query_context.fspace_hash));
+				F_INT8EQ,
+				Int64GetDatum(query_context.fspace_hash));
 
 	ScanKeyInit(&key[1],
 				2,
 				BTEqualStrategyNumber,
-				F_INT4EQ,
-				Int32GetDatum(fss_hash));
+				F_INT8EQ,
+				Int64GetDatum(fss_hash));
 
 	index_rescan(data_index_scan, key, 2, NULL, 0);
 
@@ -510,14 +640,10 @@ update_fss(int fss_hash, int ncols, double *weights)
 
 	if (!find_ok)
 	{
-		values[0] = Int32GetDatum(query_context.fspace_hash);
-		values[1] = Int32GetDatum(fss_hash);
-		values[2] = Int32GetDatum(ncols);
-
-		if (ncols > 0)
-			values[3] = PointerGetDatum(form_weights(weights, ncols));
-		else
-			isnull[3] = true;
+		values[0] = Int64GetDatum(query_context.fspace_hash);
+		values[1] = Int64GetDatum(fss_hash);
+		values[2] = Int32GetDatum(model->ncols);
+		form_fss_model(model, values, isnull);
 
 		tuple = heap_form_tuple(tuple_desc, values, isnull);
 		PG_TRY();
@@ -533,6 +659,8 @@ update_fss(int fss_hash, int ncols, double *weights)
 			PG_RE_THROW();
 		}
 		PG_END_TRY();
+		aqo_stat_add(AQO_STAT_SAMPLES_LEARNED, 1);
+		aqo_stat_add(AQO_STAT_BYTES_WRITTEN, tuple->t_len);
 	}
 	else
 	{
@@ -540,12 +668,7 @@ update_fss(int fss_hash, int ncols, double *weights)
 		Assert(shouldFree != true);
 		heap_deform_tuple(tuple, aqo_data_heap->rd_att, values, isnull);
 
-		if (ncols > 0)
-			values[3] = PointerGetDatum(form_matrix(matrix, nrows, ncols));
-		else
-			isnull[3] = true;
-
-		values[4] = PointerGetDatum(form_vector(targets, nrows));
+		form_fss_model(model, values, isnull);
 		nw_tuple = heap_modify_tuple(tuple, tuple_desc,
 									 values, isnull, replace);
 		if (my_simple_heap_update(aqo_data_heap, &(nw_tuple->t_self), nw_tuple,
@@ -555,6 +678,8 @@ update_fss(int fss_hash, int ncols, double *weights)
 				my_index_insert(data_index_rel, values, isnull,
 								&(nw_tuple->t_self),
 								aqo_data_heap, UNIQUE_CHECK_YES);
+			aqo_stat_add(AQO_STAT_SAMPLES_LEARNED, 1);
+			aqo_stat_add(AQO_STAT_BYTES_WRITTEN, nw_tuple->t_len);
 		}
 		else
 		{
@@ -565,6 +690,9 @@ update_fss(int fss_hash, int ncols, double *weights)
 			 * of two long, complex, and important queries, so we don't loss
 			 * important data.
 			 */
+			aqo_stat_add(AQO_STAT_SAMPLES_DISCARDED, 1);
+			fss_models_cache_forget(fss_hash);
+			stored = false;
 		}
 	}
 
@@ -574,7 +702,15 @@ update_fss(int fss_hash, int ncols, double *weights)
 	table_close(aqo_data_heap, lockmode);
 
 	CommandCounterIncrement();
+	fss_models_changed = true;
 
+	if (stored)
+	{
+		shared_model_store(query_context.fspace_hash, fss_hash, model);
+		fss_models_cache_store(data_index_rel_oid, fss_hash, model);
+	}
+
+	TRACE_AQO_UPDATE_FSS_DONE(query_context.fspace_hash, fss_hash, stored);
 	return true;
 }
 
@@ -585,7 +721,7 @@ update_fss(int fss_hash, int ncols, double *weights)
  * is not found.
  */
 QueryStat *
-get_aqo_stat(int query_hash)
+get_aqo_stat(int64 query_hash)
 {
 	RangeVar   *aqo_stat_table_rv;
 	Relation	aqo_stat_heap;
@@ -627,8 +763,8 @@ get_aqo_stat(int query_hash)
 	ScanKeyInit(&key,
 				1,
 				BTEqualStrategyNumber,
-				F_INT4EQ,
-				Int32GetDatum(query_hash));
+				F_INT8EQ,
+				Int64GetDatum(query_hash));
 
 	index_rescan(stat_index_scan, &key, 1, NULL, 0);
 
@@ -666,7 +802,7 @@ get_aqo_stat(int query_hash)
  * Executes disable_aqo_for_query if aqo_query_stat is not found.
  */
 void
-update_aqo_stat(int query_hash, QueryStat *stat)
+update_aqo_stat(int64 query_hash, QueryStat *stat)
 {
 	RangeVar   *aqo_stat_table_rv;
 	Relation	aqo_stat_heap;
@@ -716,8 +852,8 @@ update_aqo_stat(int query_hash, QueryStat *stat)
 	ScanKeyInit(&key,
 				1,
 				BTEqualStrategyNumber,
-				F_INT4EQ,
-				Int32GetDatum(query_hash));
+				F_INT8EQ,
+				Int64GetDatum(query_hash));
 
 	index_rescan(stat_index_scan, &key, 1, NULL, 0);
 
@@ -738,7 +874,7 @@ update_aqo_stat(int query_hash, QueryStat *stat)
 
 	if (!find_ok)
 	{
-		values[0] = Int32GetDatum(query_hash);
+		values[0] = Int64GetDatum(query_hash);
 		tuple = heap_form_tuple(tuple_desc, values, isnull);
 		PG_TRY();
 		{
@@ -791,25 +927,379 @@ update_aqo_stat(int query_hash, QueryStat *stat)
 	CommandCounterIncrement();
 }
 
-void
-deform_vector(Datum datum, double *weights, int *ncolumns)
+/*
+ * Fills the model columns of aqo_data tuple.
+ */
+static void
+form_fss_model(AqoFssModel *model, Datum *values, bool *isnull)
+{
+	if (model->ncols > 0 && model->rows > 0)
+	{
+		values[3] = PointerGetDatum(form_matrix(model->matrix, model->rows,
+												model->ncols));
+		isnull[3] = false;
+	}
+	else
+		isnull[3] = true;
+
+	values[4] = PointerGetDatum(form_vector(model->targets, model->rows));
+	isnull[4] = false;
+	values[5] = PointerGetDatum(form_vector(model->weights, model->ncols + 1));
+	isnull[5] = false;
+
+	if (model->nn != NULL)
+	{
+		values[6] = PointerGetDatum(form_vector(model->nn, nn_nparams()));
+		isnull[6] = false;
+	}
+	else
+		isnull[6] = true;
+
+	values[7] = PointerGetDatum(form_vector(model->errors, AQO_NMODELS));
+	isnull[7] = false;
+
+	values[8] = PointerGetDatum(form_kd_tree(model));
+	isnull[8] = false;
+}
+
+/*
+ * Expands the model columns of aqo_data tuple into the model allocated by
+ * palloc_fss_model(ncols). Returns false if the size of any stored array
+ * doesn't match the number of features, the number of objects or the layout
+ * of the models, e. g. if the row was edited by hand or imported.
+ */
+static bool
+deform_fss_model(AqoFssModel *model, Datum *values, bool *isnull)
+{
+	int			ncols = model->ncols;
+	int			nrows = 0;
+	int			nelems;
+
+	model->rows = 0;
+	if (!isnull[4])
+	{
+		nrows = array_nelems(values[4]);
+		if (nrows > AQO_KNN_MAX_CAPACITY)
+			return false;
+		fss_model_reserve(model, nrows);
+		if (!deform_vector(values[4], model->targets, nrows, &model->rows))
+			return false;
+	}
+
+	/* An object without any clauses has no features */
+	if (ncols > 0 && model->rows > 0 &&
+		(isnull[3] ||
+		 !deform_matrix(values[3], model->matrix, model->rows, ncols)))
+		return false;
+
+	/*
+	 * The tree is rebuilt if it wasn't stored with these objects or if the
+	 * objects have become enough for it.
+	 */
+	if (isnull[8] || !deform_kd_tree(values[8], model) ||
+		(model->kd_root < 0 && kd_is_useful(model)))
+		kd_build(model);
+
+	/* Even an object without any clauses has an intercept */
+	if (!isnull[5] &&
+		(!deform_vector(values[5], model->weights, ncols + 1, &nelems) ||
+		 nelems != ncols + 1))
+		return false;
+
+	if (!isnull[6])
+	{
+		if (model->nn == NULL)
+			model->nn = palloc(sizeof(*model->nn) * nn_nparams());
+		if (!deform_vector(values[6], model->nn, nn_nparams(), &nelems) ||
+			nelems != nn_nparams())
+			return false;
+	}
+
+	if (!isnull[7] &&
+		(!deform_vector(values[7], model->errors, AQO_NMODELS, &nelems) ||
+		 nelems != AQO_NMODELS))
+		return false;
+
+	return true;
+}
+
+/*
+ * Checks the models of aqo_data tuple, e. g. the imported one. The k-d tree
+ * is not checked, because the invalid one is rebuilt.
+ */
+bool
+aqo_data_row_is_valid(Datum *values, bool *isnull)
+{
+	AqoFssModel *model;
+	int			ncols;
+	bool		valid;
+
+	if (isnull[0] || isnull[1] || isnull[2])
+		return false;
+
+	ncols = DatumGetInt32(values[2]);
+	if (ncols < 0 || (Size) ncols >= MaxAllocSize / sizeof(double))
+		return false;
+
+	model = palloc_fss_model(ncols);
+	valid = deform_fss_model(model, values, isnull);
+	pfree_fss_model(model);
+	return valid;
+}
+
+/*
+ * Makes the partially loaded model empty again.
+ */
+static void
+clear_fss_model(AqoFssModel *model)
+{
+	int			i;
+
+	model->rows = 0;
+	model->kd_root = -1;
+	model->kd_nmoved = 0;
+	memset(model->weights, 0, sizeof(*model->weights) * (model->ncols + 1));
+	if (model->nn != NULL)
+	{
+		pfree(model->nn);
+		model->nn = NULL;
+	}
+	for (i = 0; i < AQO_NMODELS; ++i)
+		model->errors[i] = -1.;
+}
+
+/*
+ * Forms k-d tree of the model for storage as the vector
+ * [root, left_0, right_0, split_0, ..., left_n, right_n, split_n,
+ *  moved_0, ..., moved_m].
+ */
+ArrayType *
+form_kd_tree(AqoFssModel *model)
+{
+	int			nelems = 1 + 3 * model->rows + model->kd_nmoved;
+	double	   *tree = palloc(sizeof(*tree) * nelems);
+	ArrayType  *array;
+	int			i;
+
+	tree[0] = model->kd_root;
+	for (i = 0; i < model->rows; ++i)
+	{
+		tree[1 + 3 * i] = model->kd_left[i];
+		tree[2 + 3 * i] = model->kd_right[i];
+		tree[3 + 3 * i] = model->kd_split[i];
+	}
+	for (i = 0; i < model->kd_nmoved; ++i)
+		tree[1 + 3 * model->rows + i] = model->kd_moved[i];
+
+	array = form_vector(tree, nelems);
+	pfree(tree);
+	return array;
+}
+
+/*
+ * Checks that the stored value is the index of an object or -1.
+ */
+static bool
+kd_index_is_valid(double value, int rows)
+{
+	return value >= -1. && value < rows && value == floor(value);
+}
+
+/*
+ * Expands stored k-d tree into the model.
+ * Returns false if the tree doesn't match stored objects of the model, i. e.
+ * an index is out of range, not every object is reachable from the root
+ * exactly once, or a moved object is listed twice. Then the tree must be
+ * rebuilt.
+ */
+bool
+deform_kd_tree(Datum datum, AqoFssModel *model)
+{
+	double	   *tree;
+	int			nelems = array_nelems(datum);
+	int			rows = model->rows;
+	bool	   *has_parent;
+	int		   *stack;
+	int			nstack = 0;
+	int			nreached = 0;
+	bool		valid = true;
+	int			i;
+
+	if (nelems < 1 + 3 * rows || nelems > 1 + 4 * rows)
+		return false;
+
+	tree = palloc(sizeof(*tree) * nelems);
+	if (!deform_vector(datum, tree, nelems, &nelems))
+	{
+		pfree(tree);
+		return false;
+	}
+
+	for (i = 0; i < nelems && valid; ++i)
+		valid = (i % 3 == 0 && i > 0 && i <= 3 * rows) ? !isnan(tree[i]) :
+				kd_index_is_valid(tree[i], rows);
+	if (!valid)
+	{
+		pfree(tree);
+		return false;
+	}
+
+	model->kd_root = (int) tree[0];
+	for (i = 0; i < rows; ++i)
+	{
+		model->kd_left[i] = (int) tree[1 + 3 * i];
+		model->kd_right[i] = (int) tree[2 + 3 * i];
+		model->kd_split[i] = tree[3 + 3 * i];
+	}
+	model->kd_nmoved = 0;
+	for (i = 1 + 3 * rows; i < nelems && valid; ++i)
+	{
+		int			row = (int) tree[i];
+
+		valid = row >= 0 && !model->kd_is_moved[row];
+		if (valid)
+		{
+			model->kd_is_moved[row] = true;
+			model->kd_moved[model->kd_nmoved++] = row;
+		}
+	}
+	pfree(tree);
+
+	/* Drop the moved objects, kd_build() is called for the invalid tree */
+	if (!valid)
+		return false;
+
+	/*
+	 * Objects may be stored without the tree, but then none of them is
+	 * moved. No object may have two parents, so the part of the tree
+	 * reachable from the root has no cycles, and it must contain all objects.
+	 */
+	if (model->kd_root < 0)
+		return model->kd_nmoved == 0;
+
+	has_parent = palloc0(sizeof(*has_parent) * rows);
+	stack = palloc(sizeof(*stack) * rows);
+	has_parent[model->kd_root] = true;
+	stack[nstack++] = model->kd_root;
+	while (nstack > 0 && valid)
+	{
+		int			node = stack[--nstack];
+		int			children[2] = {model->kd_left[node], model->kd_right[node]};
+
+		nreached++;
+		for (i = 0; i < 2 && valid; ++i)
+		{
+			if (children[i] < 0)
+				continue;
+			valid = !has_parent[children[i]];
+			if (valid)
+			{
+				has_parent[children[i]] = true;
+				stack[nstack++] = children[i];
+			}
+		}
+	}
+	pfree(has_parent);
+	pfree(stack);
+
+	return valid && nreached == rows;
+}
+
+/*
+ * Returns the number of elements of the stored array.
+ */
+int
+array_nelems(Datum datum)
+{
+	ArrayType  *array = DatumGetArrayTypeP(datum);
+	int			nelems = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+
+	if ((Pointer) array != DatumGetPointer(datum))
+		pfree(array);
+	return nelems;
+}
+
+/*
+ * Expands matrix from storage into simple C-array of nrows x ncols.
+ * Returns false if the stored matrix has other dimensions.
+ */
+bool
+deform_matrix(Datum datum, double **matrix, int nrows, int ncols)
 {
 	ArrayType  *array = DatumGetArrayTypePCopy(PG_DETOAST_DATUM(datum));
-	Datum	   *values;
+	double	   *elems = (double *) ARR_DATA_PTR(array);
 	int			i;
 
-	deconstruct_array(array,
-					  FLOAT8OID, 8, FLOAT8PASSBYVAL, 'd',
-					  &values, NULL, ncolumns);
-	for (i = 0; i < *nelems; ++i)
-		weights[i] = DatumGetFloat8(values[i]);
-	pfree(values);
+	if (ARR_NDIM(array) != 2 || ARR_HASNULL(array) ||
+		ARR_ELEMTYPE(array) != FLOAT8OID ||
+		ARR_DIMS(array)[0] != nrows || ARR_DIMS(array)[1] != ncols)
+	{
+		pfree(array);
+		return false;
+	}
+
+	for (i = 0; i < nrows; ++i)
+		memcpy(matrix[i], elems + i * ncols, sizeof(double) * ncols);
 	pfree(array);
+	return true;
 }
 
+/*
+ * Expands vector from storage into simple C-array of maxelems elements.
+ * Returns false and no elements if the stored vector doesn't fit.
+ */
+bool
+deform_vector(Datum datum, double *vector, int maxelems, int *nelems)
+{
+	ArrayType  *array = DatumGetArrayTypePCopy(PG_DETOAST_DATUM(datum));
+	int			n = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+
+	if (ARR_NDIM(array) > 1 || ARR_HASNULL(array) ||
+		ARR_ELEMTYPE(array) != FLOAT8OID || n > maxelems)
+	{
+		pfree(array);
+		*nelems = 0;
+		return false;
+	}
+
+	memcpy(vector, ARR_DATA_PTR(array), sizeof(double) * n);
+	*nelems = n;
+	pfree(array);
+	return true;
+}
 
+/*
+ * Forms ArrayType object for storage from simple C-array matrix.
+ */
 ArrayType *
-form_weights(double *weights, int ncolumns)
+form_matrix(double **matrix, int nrows, int ncols)
+{
+	Datum	   *elems;
+	ArrayType  *array;
+	int			dims[2];
+	int			lbs[2];
+	int			i,
+				j;
+
+	dims[0] = nrows;
+	dims[1] = ncols;
+	lbs[0] = lbs[1] = 1;
+	elems = palloc(sizeof(*elems) * nrows * ncols);
+	for (i = 0; i < nrows; ++i)
+		for (j = 0; j < ncols; ++j)
+			elems[i * ncols + j] = Float8GetDatum(matrix[i][j]);
+
+	array = construct_md_array(elems, NULL, 2, dims, lbs,
+							   FLOAT8OID, 8, FLOAT8PASSBYVAL, 'd');
+	pfree(elems);
+	return array;
+}
+
+/*
+ * Creates storage for given vector.
+ */
+ArrayType *
+form_vector(double *vector, int nelems)
 {
 	Datum	   *elems;
 	ArrayType  *array;
@@ -817,11 +1307,11 @@ form_weights(double *weights, int ncolumns)
 	int			lbs[1];
 	int			i;
 
-	dims[0] = ncolumns;
+	dims[0] = nelems;
 	lbs[0] = 1;
-	elems = palloc(sizeof(*elems) * ncolumns);
-	for (i = 0; i < ncolumns; ++i)
-		elems[i] = Float8GetDatum(ncolumns[i]);
+	elems = palloc(sizeof(*elems) * nelems);
+	for (i = 0; i < nelems; ++i)
+		elems[i] = Float8GetDatum(vector[i]);
 	array = construct_md_array(elems, NULL, 1, dims, lbs,
 							   FLOAT8OID, 8, FLOAT8PASSBYVAL, 'd');
 	pfree(elems);
@@ -898,43 +1388,388 @@ my_index_insert(Relation indexRelation,
 #endif
 }
 
-/* Creates a storage for hashes of deactivated queries */
+/*
+ * Creates the cache of query settings. The cache must be consistent with
+ * the transactions which changed aqo_queries, so it is watched by callbacks.
+ */
 void
-init_deactivated_queries_storage(void)
+init_query_settings_cache(void)
+{
+	reset_query_settings_cache();
+	RegisterXactCallback(query_settings_xact_callback, NULL);
+	RegisterSubXactCallback(query_settings_subxact_callback, NULL);
+}
+
+/* Drops all entries of the cache of query settings */
+static void
+reset_query_settings_cache(void)
 {
 	HASHCTL		hash_ctl;
 
-	/* Create the hashtable proper */
+	if (query_settings != NULL)
+		hash_destroy(query_settings);
+
 	MemSet(&hash_ctl, 0, sizeof(hash_ctl));
-	hash_ctl.keysize = sizeof(int);
-	hash_ctl.entrysize = sizeof(int);
-	deactivated_queries = hash_create("aqo_deactivated_queries",
-									  128,		/* start small and extend */
-									  &hash_ctl,
-									  HASH_ELEM | HASH_BLOBS);
+	hash_ctl.keysize = sizeof(int64);
+	hash_ctl.entrysize = sizeof(QuerySettings);
+	query_settings = hash_create("aqo_query_settings",
+								 128,		/* start small and extend */
+								 &hash_ctl,
+								 HASH_ELEM | HASH_BLOBS);
 }
 
-/* Destroys the storage for hash of deactivated queries */
+/*
+ * Invalidates the caches of query settings of all backends after aqo_queries
+ * was changed by the user. Other backends notice it when the transaction
+ * commits.
+ */
 void
-fini_deactivated_queries_storage(void)
+invalidate_query_settings_cache(void)
 {
-	hash_destroy(deactivated_queries);
-	deactivated_queries = NULL;
+	reset_query_settings_cache();
+	query_settings_changed = true;
 }
 
-/* Checks whether the query with given hash is deactivated */
+/*
+ * Puts the settings into the cache. Without shared memory only deactivated
+ * queries are stored.
+ */
+static void
+store_query_settings(QuerySettings *settings)
+{
+	uint64		generation;
+	QuerySettings *entry;
+
+	/*
+	 * Changes replayed from the primary don't fire the trigger, so nothing
+	 * is cached during recovery.
+	 */
+	if (RecoveryInProgress())
+		return;
+
+	if (!aqo_queries_generation(&generation) &&
+		!(settings->stored && !settings->learn_aqo && !settings->use_aqo &&
+		  !settings->auto_tuning))
+		return;
+
+	entry = (QuerySettings *) hash_search(query_settings,
+										  &settings->query_hash,
+										  HASH_ENTER, NULL);
+	*entry = *settings;
+}
+
+/*
+ * Returns the settings of the query from the cache or from aqo_queries.
+ * If recheck_missing is true, the query missing in the cache is looked up in
+ * the table again, because it may be added by another backend meanwhile.
+ * Returns true if the settings were found in the cache.
+ */
 bool
-query_is_deactivated(int query_hash)
+get_query_settings(int64 query_hash, bool recheck_missing,
+				   QuerySettings *settings)
+{
+	uint64		generation;
+	QuerySettings *entry;
+	Datum		values[5];
+	bool		nulls[5] = {false, false, false, false, false};
+
+	/*
+	 * The generation is read before the table, so a change committed after
+	 * that will drop the entry we are going to store.
+	 */
+	if (aqo_queries_generation(&generation) &&
+		generation != query_settings_generation)
+	{
+		reset_query_settings_cache();
+		query_settings_generation = generation;
+	}
+
+	entry = (QuerySettings *) hash_search(query_settings, &query_hash,
+										  HASH_FIND, NULL);
+	if (entry != NULL && (entry->stored || !recheck_missing))
+	{
+		*settings = *entry;
+		return true;
+	}
+
+	MemSet(settings, 0, sizeof(QuerySettings));
+	settings->query_hash = query_hash;
+	settings->stored = find_query(query_hash, &values[0], &nulls[0]);
+	if (settings->stored)
+	{
+		settings->learn_aqo = DatumGetBool(values[1]);
+		settings->use_aqo = DatumGetBool(values[2]);
+		settings->fspace_hash = DatumGetInt64(values[3]);
+		settings->auto_tuning = DatumGetBool(values[4]);
+	}
+
+	store_query_settings(settings);
+	return false;
+}
+
+/*
+ * Advances the generation of aqo_queries when the transaction which changed
+ * it commits. If it aborts, the entries stored by it are dropped. The changes
+ * of the prepared transaction aren't visible yet, so the generation is
+ * advanced by the backend which finishes it, see aqo_ProcessUtility().
+ */
+static void
+query_settings_xact_callback(XactEvent event, void *arg)
+{
+	if (!query_settings_changed)
+		return;
+
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+			aqo_queries_changed();
+			break;
+		case XACT_EVENT_PREPARE:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+			reset_query_settings_cache();
+			break;
+		default:
+			return;
+	}
+
+	query_settings_changed = false;
+}
+
+/*
+ * Drops the entries stored by the aborted subtransaction which changed
+ * aqo_queries. The generation is still advanced at the commit.
+ */
+static void
+query_settings_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+								SubTransactionId parentSubid, void *arg)
+{
+	if (event == SUBXACT_EVENT_ABORT_SUB && query_settings_changed)
+		reset_query_settings_cache();
+}
+
+/*
+ * Advances the generation of aqo_queries when a prepared transaction is
+ * finished, because it may have changed aqo_queries. Such statements can't
+ * run in a transaction block, so the generation is advanced right after the
+ * changes become visible.
+ */
+void
+aqo_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+				   ProcessUtilityContext context, ParamListInfo params,
+				   QueryEnvironment *queryEnv, DestReceiver *dest,
+				   char *completionTag)
 {
-	bool		found;
+	Node	   *parsetree = pstmt->utilityStmt;
 
-	hash_search(deactivated_queries, &query_hash, HASH_FIND, &found);
-	return found;
+	if (IsA(parsetree, TransactionStmt) &&
+		(((TransactionStmt *) parsetree)->kind == TRANS_STMT_COMMIT_PREPARED ||
+		 ((TransactionStmt *) parsetree)->kind == TRANS_STMT_ROLLBACK_PREPARED))
+	{
+		query_settings_changed = true;
+		fss_models_changed = true;
+	}
+
+	if (prev_ProcessUtility_hook)
+		prev_ProcessUtility_hook(pstmt, queryString, context, params,
+								 queryEnv, dest, completionTag);
+	else
+		standard_ProcessUtility(pstmt, queryString, context, params,
+								queryEnv, dest, completionTag);
 }
 
-/* Adds given query hash into the set of hashes of deactivated queries*/
+/*
+ * Creates the cache of models. Like the cache of query settings, it must be
+ * consistent with the transactions which changed aqo_data.
+ */
 void
-add_deactivated_query(int query_hash)
+init_fss_models_cache(void)
+{
+	fss_models_context = AllocSetContextCreate(AQOMemoryContext,
+											   "AQO models cache",
+											   ALLOCSET_DEFAULT_SIZES);
+	reset_fss_models_cache();
+	RegisterXactCallback(fss_models_xact_callback, NULL);
+	RegisterSubXactCallback(fss_models_subxact_callback, NULL);
+}
+
+/* Drops all entries of the cache of models */
+static void
+reset_fss_models_cache(void)
+{
+	HASHCTL		hash_ctl;
+
+	MemoryContextReset(fss_models_context);
+	fss_models_size = 0;
+
+	MemSet(&hash_ctl, 0, sizeof(hash_ctl));
+	hash_ctl.keysize = sizeof(FssModelKey);
+	hash_ctl.entrysize = sizeof(FssModelEntry);
+	hash_ctl.hcxt = fss_models_context;
+	fss_models = hash_create("aqo_fss_models",
+							 16,
+							 &hash_ctl,
+							 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+}
+
+/*
+ * Invalidates the caches of models of all backends after aqo_data was
+ * changed by the user or imported. Other backends notice it when the
+ * transaction commits.
+ */
+void
+invalidate_fss_models_cache(void)
+{
+	reset_fss_models_cache();
+	fss_models_changed = true;
+}
+
+/*
+ * Copies the cached models of the feature subspace into the model allocated
+ * by palloc_fss_model(ncols). 'index_oid' is the index of aqo_data, which
+ * tells whether the table is the same. Returns false if they aren't cached.
+ */
+static bool
+fss_models_cache_load(Oid index_oid, int64 fss_hash, int ncols,
+					  AqoFssModel *model)
+{
+	uint64		generation;
+	FssModelKey key;
+	FssModelEntry *entry;
+
+	/*
+	 * Changes replayed from the primary don't advance the generation, so
+	 * nothing is cached during recovery.
+	 */
+	if (RecoveryInProgress() || !aqo_data_generation(&generation))
+		return false;
+
+	/*
+	 * The generation is read before the table, so a change committed after
+	 * that will drop the entry we are going to store.
+	 */
+	if (generation != fss_models_generation || index_oid != fss_models_index)
+	{
+		reset_fss_models_cache();
+		fss_models_generation = generation;
+		fss_models_index = index_oid;
+	}
+
+	key.fspace_hash = query_context.fspace_hash;
+	key.fss_hash = fss_hash;
+	entry = (FssModelEntry *) hash_search(fss_models, &key, HASH_FIND, NULL);
+	if (entry == NULL || entry->model->ncols != ncols)
+		return false;
+
+	copy_fss_model(model, entry->model);
+	return true;
+}
+
+/*
+ * Puts the copy of the models into the cache, unless aqo_data has been
+ * changed since the cache was checked by fss_models_cache_load(). The cache
+ * which would outgrow its limit is dropped first.
+ */
+static void
+fss_models_cache_store(Oid index_oid, int64 fss_hash, AqoFssModel *model)
+{
+	uint64		generation;
+	FssModelKey key;
+	FssModelEntry *entry;
+	AqoFssModel *copy;
+	MemoryContext oldCxt;
+	Size		size;
+
+	if (RecoveryInProgress() || !aqo_data_generation(&generation) ||
+		generation != fss_models_generation || index_oid != fss_models_index)
+		return;
+
+	fss_models_cache_forget(fss_hash);
+
+	size = (Size) Max(model->rows, 1) *
+		   (sizeof(double) * (model->ncols + 2) + sizeof(int) * 3 +
+			sizeof(bool) + sizeof(double *)) +
+		   sizeof(double) * (model->ncols + 1);
+	if (model->nn != NULL)
+		size += sizeof(double) * nn_nparams();
+	if (size > AQO_FSS_MODELS_CACHE_SIZE)
+		return;
+
+	if (fss_models_size + size > AQO_FSS_MODELS_CACHE_SIZE)
+		reset_fss_models_cache();
+
+	oldCxt = MemoryContextSwitchTo(fss_models_context);
+	copy = palloc_fss_model(model->ncols);
+	copy_fss_model(copy, model);
+	MemoryContextSwitchTo(oldCxt);
+
+	key.fspace_hash = query_context.fspace_hash;
+	key.fss_hash = fss_hash;
+	entry = (FssModelEntry *) hash_search(fss_models, &key, HASH_ENTER,
+										  NULL);
+	entry->model = copy;
+	entry->size = size;
+	fss_models_size += size;
+}
+
+/* Drops the cached models of the feature subspace */
+static void
+fss_models_cache_forget(int64 fss_hash)
+{
+	FssModelKey key;
+	FssModelEntry *entry;
+
+	key.fspace_hash = query_context.fspace_hash;
+	key.fss_hash = fss_hash;
+	entry = (FssModelEntry *) hash_search(fss_models, &key, HASH_FIND, NULL);
+	if (entry == NULL)
+		return;
+
+	fss_models_size -= entry->size;
+	pfree_fss_model(entry->model);
+	hash_search(fss_models, &key, HASH_REMOVE, NULL);
+}
+
+/*
+ * Advances the generation of aqo_data when the transaction which changed it
+ * commits. The cache of the backend is kept if no other transaction changed
+ * aqo_data meanwhile, because it already holds our models. If the
+ * transaction aborts or is prepared, the cache is dropped.
+ */
+static void
+fss_models_xact_callback(XactEvent event, void *arg)
+{
+	if (!fss_models_changed)
+		return;
+
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+			if (aqo_data_changed() == fss_models_generation)
+				fss_models_generation++;
+			break;
+		case XACT_EVENT_PREPARE:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+			reset_fss_models_cache();
+			break;
+		default:
+			return;
+	}
+
+	fss_models_changed = false;
+}
+
+/*
+ * Drops the models cached by the aborted subtransaction which changed
+ * aqo_data. The generation is still advanced at the commit.
+ */
+static void
+fss_models_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+							SubTransactionId parentSubid, void *arg)
 {
-	hash_search(deactivated_queries, &query_hash, HASH_ENTER, NULL);
+	if (event == SUBXACT_EVENT_ABORT_SUB && fss_models_changed)
+		reset_fss_models_cache();
 }
@@ -36,6 +36,20 @@ int_cmp(const void *a, const void *b)
 		return 0;
 }
 
+/*
+ * Function for qsorting an int64 arrays
+ */
+int
+int64_cmp(const void *a, const void *b)
+{
+	if (*(int64 *) a < *(int64 *) b)
+		return -1;
+	else if (*(int64 *) a > *(int64 *) b)
+		return 1;
+	else
+		return 0;
+}
+
 /*
  * Function for qsorting an double arrays
  */
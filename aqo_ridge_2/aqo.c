@@ -56,6 +56,9 @@ const double	object_selection_prediction_threshold = 0.3;
 const double	object_selection_threshold = 0.1;
 const double	learning_rate = 1e-1;
 
+/* Regularization coefficient of the ridge regression weights */
+const double	ridge_regularization = 1e-3;
+
 /* The number of nearest neighbors which will be chosen for ML-operations */
 int			aqo_k = 3;
 double		log_selectivity_lower_bound = -30;
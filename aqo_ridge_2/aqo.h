@@ -235,6 +235,7 @@ extern double auto_tuning_convergence_error;
 extern const double object_selection_prediction_threshold;
 extern const double object_selection_threshold;
 extern const double learning_rate;
+extern const double ridge_regularization;
 extern int	aqo_k;
 extern double log_selectivity_lower_bound;
 
@@ -285,9 +286,9 @@ bool update_query(int query_hash, bool learn_aqo, bool use_aqo,
 			 int fspace_hash, bool auto_tuning);
 bool		add_query_text(int query_hash, const char *query_text);
 bool load_fss(int fss_hash, int ncols,
-		 double *weights);
+		 double *gram, double *weights);
 extern bool update_fss(int fss_hash, int ncols,
-					   double *weights);
+					   double *gram, double *weights);
 QueryStat  *get_aqo_stat(int query_hash);
 void		update_aqo_stat(int query_hash, QueryStat * stat);
 void		init_deactivated_queries_storage(void);
@@ -345,11 +346,9 @@ void		aqo_copy_generic_path_info(PlannerInfo *root, Plan *dest, Path *src);
 void		aqo_ExecutorEnd(QueryDesc *queryDesc);
 
 /* Machine learning techniques */
-extern double rg_predict(int ncols,double *weights,double *features);
-
-extern int rg_learn(int matrix_cols,
-			double *weights,
-			double *features, double target);
+extern double rg_predict(int ncols, double *weights, double *features);
+extern bool rg_learn(int ncols, double *gram, double *weights,
+		 double *features, double target);
 
 /* Automatic query tuning */
 void		automatical_query_tuning(int query_hash, QueryStat * stat);
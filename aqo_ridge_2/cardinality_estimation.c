@@ -29,15 +29,14 @@ predict_for_relation(List *restrict_clauses, List *selectivities,
 	double	*weights;
 	double	*features;
 	double	result;
-	int		rows;
 
 	*fss_hash = get_fss_for_object(restrict_clauses, selectivities, relids,
 														&nfeatures, &features);
 
-	if (nfeatures > 0)
-		weights = palloc0(sizeof(*weights) * nfeatures);
+	/* The last weight is the intercept of the linear model. */
+	weights = palloc0(sizeof(*weights) * (nfeatures + 1));
 
-	if (load_fss(*fss_hash, nfeatures, weights))
+	if (load_fss(*fss_hash, nfeatures, NULL, weights))
 		result = rg_predict(nfeatures, weights, features);
 	else
 	{
@@ -51,10 +50,7 @@ predict_for_relation(List *restrict_clauses, List *selectivities,
 	}
 
 	pfree(features);
-	if (nfeatures > 0)
-	{
-		pfree(weights);
-	}
+	pfree(weights);
 
 	if (result < 0)
 		return -1;
@@ -5,10 +5,11 @@
  *
  * This module does not know anything about DBMS, cardinalities and all other
  * stuff. It learns matrices, predicts values and is quite happy.
- * The proposed method is designed for working with limited number of objects.
- * It is guaranteed that number of rows in the matrix will not exceed aqo_K
- * setting after learning procedure. This property also allows to adapt to
- * workloads which properties are slowly changed.
+ * The proposed method is ridge regression solved exactly after each learning
+ * object. Its state is the Gram matrix of fixed size (ncols + 1) x (ncols + 2)
+ * whatever the number of learned objects. Old objects are forgotten
+ * exponentially, which allows to adapt to workloads which properties are
+ * slowly changed.
  *
  *******************************************************************************
  *
@@ -21,44 +22,130 @@
 
 #include "aqo.h"
 
+static bool cholesky_solve(int n, double *a, double *b);
+
+
+/*
+ * Predicts target value of the object by the linear model.
+ * 'weights' has ncols + 1 elements, the last one is the intercept.
+ */
 double
 rg_predict(int ncols, double *weights, double *features)
 {
-    int i;
+	double		res = weights[ncols];
+	int			i;
+
+	for (i = 0; i < ncols; ++i)
+		res += features[i] * weights[i];
+	return res;
+}
+
+/*
+ * Updates the ridge regression with a new object and solves it exactly.
+ *
+ * 'gram' is the (ncols + 1) x (ncols + 2) row-major matrix [X'X | X'y] of the
+ * objects learned so far, with features extended by the constant 1 for the
+ * intercept. It is the sufficient statistics of the least squares problem,
+ * so the solution does not depend on the previous weights and learning is
+ * exact after each object. Old objects are forgotten exponentially with
+ * learning_rate to follow slowly changing workloads.
+ * 'weights' receives ncols + 1 weights, the last one is the intercept, which
+ * is not regularized.
+ * Returns false if the system is degenerate and weights are not changed.
+ */
+bool
+rg_learn(int ncols, double *gram, double *weights,
+		 double *features, double target)
+{
+	int			n = ncols + 1;
+	double	   *a;
+	double	   *b;
+	bool		solved;
+	int			i,
+				j;
+
+	for (i = 0; i < n; ++i)
+	{
+		double		xi = (i < ncols) ? features[i] : 1.;
 
-    double res = 0;
+		for (j = 0; j < n; ++j)
+		{
+			double		xj = (j < ncols) ? features[j] : 1.;
 
-    for (i=0;i<ncols;i++){
-        res = res + features[i] * weights[i];
-    }
-    res = res + weights[ncols];
-    return res;
+			gram[i * (n + 1) + j] = (1. - learning_rate) *
+									gram[i * (n + 1) + j] + xi * xj;
+		}
+		gram[i * (n + 1) + n] = (1. - learning_rate) *
+								gram[i * (n + 1) + n] + xi * target;
+	}
+
+	a = palloc(sizeof(*a) * n * n);
+	b = palloc(sizeof(*b) * n);
+	for (i = 0; i < n; ++i)
+	{
+		for (j = 0; j < n; ++j)
+			a[i * n + j] = gram[i * (n + 1) + j];
+		if (i < ncols)
+			a[i * n + i] += ridge_regularization;
+		b[i] = gram[i * (n + 1) + n];
+	}
+
+	solved = cholesky_solve(n, a, b);
+	if (solved)
+		memcpy(weights, b, sizeof(*weights) * n);
+
+	pfree(a);
+	pfree(b);
+	return solved;
 }
 
-int
-rg_learn(int nfeatures, double *weights,
-			double *features, double target)
+/*
+ * Solves a * x = b for symmetric positive definite n x n matrix 'a'.
+ * 'a' is replaced by its Cholesky factor, 'b' is replaced by x.
+ * Returns false if 'a' is not positive definite.
+ */
+static bool
+cholesky_solve(int n, double *a, double *b)
 {
-	double *tgrad = malloc((nfeatures+1) * sizeof(double));
-    	double htheta;
-    	double err;
-    	int j,k;
-
-    	for (k=0;k<100;k++){
-              htheta = 0;
-              for (j=0;j<nfeatures;j++){
-                 htheta = htheta + features[j]*weights[j];
-              }
-              htheta = htheta + weights[nfeatures];
-	      err = htheta - target;
-              for (j=0;j<nfeatures;j++){
-                 tgrad[j] = 2*err*features[j]+2*0.001*weights[j];
-                 weights[j] = weights[j] - 0.001*tgrad[j];
-              }
-              tgrad[nfeatures] = 2*err+2*0.001*weights[nfeatures];
-              weights[nfeatures] = weights[nfeatures] - 0.001*tgrad[nfeatures];
-           }
-
-
-	return nfeatures;
+	int			i,
+				j,
+				k;
+
+	for (j = 0; j < n; ++j)
+	{
+		double		d = a[j * n + j];
+
+		for (k = 0; k < j; ++k)
+			d -= a[j * n + k] * a[j * n + k];
+		if (d <= 0.)
+			return false;
+		a[j * n + j] = sqrt(d);
+
+		for (i = j + 1; i < n; ++i)
+		{
+			double		s = a[i * n + j];
+
+			for (k = 0; k < j; ++k)
+				s -= a[i * n + k] * a[j * n + k];
+			a[i * n + j] = s / a[j * n + j];
+		}
+	}
+
+	/* Forward substitution: L * y = b */
+	for (i = 0; i < n; ++i)
+	{
+		for (k = 0; k < i; ++k)
+			b[i] -= a[i * n + k] * b[k];
+		b[i] /= a[i * n + i];
+	}
+
+	/* Back substitution: L' * x = y */
+	for (i = n - 1; i >= 0; --i)
+	{
+		for (k = i + 1; k < n; ++k)
+			b[i] -= a[k * n + i] * b[k];
+		b[i] /= a[i * n + i];
+	}
+
+	return true;
 }
@@ -41,7 +41,7 @@ static char *PlanStateInfo = "PlanStateInfo";
 
 /* Query execution statistics collecting utilities */
 static void atomic_fss_learn_step(int fss_hash, int ncols,
-					  double *weights,
+					  double *gram, double *weights,
 					  double *features, double target);
 static void learn_sample(List *clauselist,
 			 List *selectivities,
@@ -65,13 +65,26 @@ static bool ExtractFromQueryContext(QueryDesc *queryDesc);
 static void RemoveFromQueryContext(QueryDesc *queryDesc);
 
 
+/*
+ * This is the critical section: only one runner is allowed to be inside this
+ * function for one feature subspace.
+ * gram and weights are just preallocated memory for computations.
+ */
 static void
 atomic_fss_learn_step(int fss_hash, int ncols,
-					  double *weights,
+					  double *gram, double *weights,
 					  double *features, double target)
 {
+	int			n = ncols + 1;
+
+	if (!load_fss(fss_hash, ncols, gram, weights))
+	{
+		memset(gram, 0, sizeof(*gram) * n * (n + 1));
+		memset(weights, 0, sizeof(*weights) * n);
+	}
 
-	update_fss(fss_hash, ncols, weights);
+	rg_learn(ncols, gram, weights, features, target);
+	update_fss(fss_hash, ncols, gram, weights);
 }
 
 /*
@@ -84,7 +97,8 @@ learn_sample(List *clauselist, List *selectivities, List *relidslist,
 {
 	int			fss_hash;
 	int			nfeatures;
-	double	  *weights;
+	double	   *gram;
+	double	   *weights;
 	double	   *features;
 	double		target;
 
@@ -101,16 +115,16 @@ learn_sample(List *clauselist, List *selectivities, List *relidslist,
 	fss_hash = get_fss_for_object(clauselist, selectivities, relidslist,
 					   &nfeatures, &features);
 
-	if (nfeatures > 0)
-		weights = palloc(sizeof(double) * nfeatures);
+	gram = palloc(sizeof(double) * (nfeatures + 1) * (nfeatures + 2));
+	weights = palloc(sizeof(double) * (nfeatures + 1));
 
 	/* Here should be critical section */
-	atomic_fss_learn_step(fss_hash, nfeatures, weights, features, target);
+	atomic_fss_learn_step(fss_hash, nfeatures, gram, weights,
+						  features, target);
 	/* Here should be the end of critical section */
 
-	if (nfeatures > 0)
-		pfree(weights);
-
+	pfree(gram);
+	pfree(weights);
 	pfree(features);
 }
 
@@ -25,6 +25,8 @@ HTAB *deactivated_queries = NULL;
 
 static ArrayType *form_weights(double *weights, int ncols);
 static void deform_weights(Datum datum, double *vector, int *ncols);
+static ArrayType *form_gram(double *gram, int n);
+static int	array_nelems(Datum datum);
 
 #define FormVectorSz(v_name)			(form_weights((v_name), (v_name ## _size)))
 #define DeformVectorSz(datum, v_name)	(deform_weights((datum), (v_name), &(v_name ## _size)))
@@ -345,10 +347,12 @@ add_query_text(int query_hash, const char *query_text)
  *
  * 'fss_hash' is the hash of feature subspace which is supposed to be loaded
  * 'ncols' is the number of clauses in the feature subspace
- * 'weights' is an allocated memory for array of weights
+ * 'gram' is an allocated memory for (ncols + 1) x (ncols + 2) Gram matrix
+ * of the ridge regression, or NULL if it is not needed
+ * 'weights' is an allocated memory for ncols + 1 weights
  */
 bool
-load_fss(int fss_hash, int ncols, double *weights)
+load_fss(int fss_hash, int ncols, double *gram, double *weights)
 {
 	RangeVar   *aqo_data_table_rv;
 	Relation	aqo_data_heap;
@@ -412,11 +416,23 @@ load_fss(int fss_hash, int ncols, double *weights)
 
 		if (DatumGetInt32(values[2]) == ncols)
 		{
-			if (ncols > 0)
-				/*
-				 * The case than an object has not any filters and selectivities
-				 */
-				deform_weights(values[3], weights, ncols);
+			int			n = ncols + 1;
+			int			nelems;
+
+			/*
+			 * Rows stored by the previous versions of the learner have
+			 * other layout. Just learn them from scratch.
+			 */
+			if (isnull[3] || isnull[4] ||
+				array_nelems(values[3]) != n * (n + 1) ||
+				array_nelems(values[4]) != n)
+				success = false;
+			else
+			{
+				if (gram != NULL)
+					deform_weights(values[3], gram, &nelems);
+				deform_weights(values[4], weights, &nelems);
+			}
 		}
 		else
 		{
@@ -443,11 +459,12 @@ load_fss(int fss_hash, int ncols, double *weights)
  * Returns false if the operation failed, true otherwise.
  *
  * 'fss_hash' specifies the feature subspace
- * 'nrows' x 'ncols' is the shape of 'matrix'
- * 'targets' is vector of size 'nrows'
+ * 'ncols' is the number of features
+ * 'gram' is (ncols + 1) x (ncols + 2) Gram matrix of the ridge regression
+ * 'weights' is vector of size 'ncols' + 1
  */
 bool
-update_fss(int fss_hash, int ncols, double *weights)
+update_fss(int fss_hash, int ncols, double *gram, double *weights)
 {
 	RangeVar   *aqo_data_table_rv;
 	Relation	aqo_data_heap;
@@ -513,11 +530,8 @@ update_fss(int fss_hash, int ncols, double *weights)
 		values[0] = Int32GetDatum(query_context.fspace_hash);
 		values[1] = Int32GetDatum(fss_hash);
 		values[2] = Int32GetDatum(ncols);
-
-		if (ncols > 0)
-			values[3] = PointerGetDatum(form_weights(weights, ncols));
-		else
-			isnull[3] = true;
+		values[3] = PointerGetDatum(form_gram(gram, ncols + 1));
+		values[4] = PointerGetDatum(form_weights(weights, ncols + 1));
 
 		tuple = heap_form_tuple(tuple_desc, values, isnull);
 		PG_TRY();
@@ -540,11 +554,11 @@ update_fss(int fss_hash, int ncols, double *weights)
 		Assert(shouldFree != true);
 		heap_deform_tuple(tuple, aqo_data_heap->rd_att, values, isnull);
 
-		if (ncols > 0)
-			values[3] = PointerGetDatum(form_weights(weights, ncols));
-		else
-			isnull[3] = true;
-		
+		values[3] = PointerGetDatum(form_gram(gram, ncols + 1));
+		isnull[3] = false;
+		values[4] = PointerGetDatum(form_weights(weights, ncols + 1));
+		isnull[4] = false;
+
 		nw_tuple = heap_modify_tuple(tuple, tuple_desc,
 									 values, isnull, replace);
 		if (my_simple_heap_update(aqo_data_heap, &(nw_tuple->t_self), nw_tuple,
@@ -827,6 +841,44 @@ form_weights(double *weights, int ncolumns)
 	return array;
 }
 
+/*
+ * Forms two-dimensional array n x (n + 1) from the row-major Gram matrix.
+ */
+ArrayType *
+form_gram(double *gram, int n)
+{
+	Datum	   *elems;
+	ArrayType  *array;
+	int			dims[2];
+	int			lbs[2];
+	int			i;
+
+	dims[0] = n;
+	dims[1] = n + 1;
+	lbs[0] = lbs[1] = 1;
+	elems = palloc(sizeof(*elems) * n * (n + 1));
+	for (i = 0; i < n * (n + 1); ++i)
+		elems[i] = Float8GetDatum(gram[i]);
+	array = construct_md_array(elems, NULL, 2, dims, lbs,
+							   FLOAT8OID, 8, FLOAT8PASSBYVAL, 'd');
+	pfree(elems);
+	return array;
+}
+
+/*
+ * Returns the number of elements of the stored array.
+ */
+int
+array_nelems(Datum datum)
+{
+	ArrayType  *array = DatumGetArrayTypeP(datum);
+	int			nelems = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+
+	if ((Pointer) array != DatumGetPointer(datum))
+		pfree(array);
+	return nelems;
+}
+
 /*
  * Returns true if updated successfully, false if updated concurrently by
  * another session, error otherwise.